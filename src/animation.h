@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <numbers>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <lodepng.h>
+#include <glm/glm.hpp>
+
+#include <camera.h>
+#include <bvh.h>
+#include <object.h>
+#include <thread_pool.h>
+#include <trace.h>
+
+/*
+camera paths for batch renders
+
+a keyframe file has one keyframe per line, `#` starts a comment:
+
+    frame  center.x center.y center.z  direction.x direction.y direction.z  fov  focal_distance
+
+frames between two keyframes interpolate linearly, the direction is renormalized.
+*/
+
+struct Keyframe {
+    int32_t frame;
+    CameraPose pose;
+};
+
+class CameraPath {
+    std::vector<Keyframe> keyframes;
+
+public:
+    CameraPath() {}
+
+    bool load(const std::string &filename) {
+        std::ifstream ifs(filename);
+        if (!ifs) {
+            return false;
+        }
+
+        std::string line;
+        while (getline(ifs, line)) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream iss(line);
+
+            Keyframe k;
+            if (!(iss >> k.frame)) {
+                continue;
+            }
+            iss >> k.pose.center.x >> k.pose.center.y >> k.pose.center.z
+                >> k.pose.direction.x >> k.pose.direction.y >> k.pose.direction.z
+                >> k.pose.fov >> k.pose.focal_distance;
+            if (!iss) {
+                std::cout << "keyframe parser error: " << line << std::endl;
+                return false;
+            }
+            k.pose.direction = glm::normalize(k.pose.direction);
+            add(k);
+        }
+        return !keyframes.empty();
+    }
+
+    void add(const Keyframe &keyframe) {
+        auto it = keyframes.begin();
+        while (it != keyframes.end() && it->frame < keyframe.frame) {
+            ++it;
+        }
+        keyframes.insert(it, keyframe);
+    }
+
+    // frames 0 through the last keyframe
+    int32_t frame_count() const {
+        return keyframes.empty() ? 0 : keyframes.back().frame + 1;
+    }
+
+    CameraPose at(int32_t frame) const {
+        if (frame <= keyframes.front().frame) {
+            return keyframes.front().pose;
+        }
+        for (size_t i = 1; i < keyframes.size(); ++i) {
+            const Keyframe &a = keyframes[i - 1];
+            const Keyframe &b = keyframes[i];
+            if (frame <= b.frame) {
+                float t = static_cast<float>(frame - a.frame) / static_cast<float>(b.frame - a.frame);
+                CameraPose pose;
+                pose.center = a.pose.center * (1.0f - t) + b.pose.center * t;
+                pose.direction = glm::normalize(a.pose.direction * (1.0f - t) + b.pose.direction * t);
+                pose.fov = a.pose.fov * (1.0f - t) + b.pose.fov * t;
+                pose.focal_distance = a.pose.focal_distance * (1.0f - t) + b.pose.focal_distance * t;
+                return pose;
+            }
+        }
+        return keyframes.back().pose;
+    }
+
+    // a full orbit around the vertical axis through the point `pose` looks at
+    static CameraPath turntable(const CameraPose &pose, int32_t frames) {
+        glm::vec3 target = pose.center + pose.direction * pose.focal_distance;
+        glm::vec3 offset = pose.center - target;
+
+        CameraPath path;
+        for (int32_t frame = 0; frame < frames; ++frame) {
+            float angle = 2.0f * std::numbers::pi_v<float> * static_cast<float>(frame) / static_cast<float>(frames);
+            float c = std::cos(angle);
+            float s = std::sin(angle);
+            glm::vec3 rotated(c * offset.x + s * offset.z, offset.y, -s * offset.x + c * offset.z);
+
+            Keyframe k;
+            k.frame = frame;
+            k.pose = pose;
+            k.pose.center = target + rotated;
+            k.pose.direction = glm::normalize(-rotated);
+            path.add(k);
+        }
+        return path;
+    }
+};
+
+// fills a printf style pattern such as outputs/frame-%04d.png
+inline std::string frame_filename(const std::string &pattern, int32_t frame) {
+    char buffer[1024];
+    std::snprintf(buffer, sizeof(buffer), pattern.c_str(), frame);
+    return buffer;
+}
+
+/*
+renders every frame of a path in one process. the scene and its BVH are built once by the
+caller, the camera renders on a persistent pool, and frame n is png encoded on its own
+thread while frame n + 1 is traced.
+*/
+inline void render_animation(
+    PerspectiveCamera &camera,
+    const World &world,
+    const BVH &bvh,
+    const CameraPath &path,
+    const std::string &pattern,
+    ThreadPool &pool
+) {
+    int32_t height = camera.getHeight();
+    int32_t width = camera.getWidth();
+
+    camera.setThreadPool(&pool);
+
+    // two images, one being traced into while the other is encoded
+    std::vector<uint8_t> images[2] = {
+        std::vector<uint8_t>(height * width * 4),
+        std::vector<uint8_t>(height * width * 4)
+    };
+    std::future<void> encoding;
+
+    for (int32_t frame = 0; frame < path.frame_count(); ++frame) {
+        std::vector<uint8_t> &image = images[frame % 2];
+
+        camera.setPose(path.at(frame));
+        camera.render(image, world, bvh);
+
+        // the previous encode still reads the other image, it must finish before that one is reused
+        if (encoding.valid()) {
+            encoding.get();
+        }
+
+        std::string filename = frame_filename(pattern, frame);
+        encoding = std::async(std::launch::async, [&image, filename, height, width, frame]() {
+            RAY_TRACE_SCOPE_ARG("encode png", "frame", frame);
+            uint32_t error = lodepng::encode(filename, image, width, height);
+            if (error) {
+                std::cout << "encoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
+            }
+        });
+
+        std::clog << "frame " << frame + 1 << " / " << path.frame_count() << " -> " << filename << std::endl;
+    }
+
+    if (encoding.valid()) {
+        encoding.get();
+    }
+
+    camera.setThreadPool(nullptr);
+}
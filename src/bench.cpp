@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+#include <sys/resource.h>
+
+#include <lodepng.h>
+#include <glm/glm.hpp>
+
+#include <camera.h>
+#include <object.h>
+#include <bvh.h>
+#include <mesh.h>
+#include <scene.h>
+
+/*
+benchmark harness, run with `make bench`
+
+every scene is rendered with a fixed seed at a fixed resolution and sample count,
+results are written as json (one scene per line) and optionally compared against
+a stored baseline produced by an earlier `--save-baseline` run.
+
+the bvh_* fields cover the scene's whole acceleration structure: the top-level tree plus the
+tree of every mesh. meshes build while the scene loads, possibly in parallel, so their build
+time is also part of load_s, and bvh_build_s sums it with the top-level build.
+*/
+
+struct BenchScene {
+    std::string name;
+    std::string scene;
+    int32_t height, width, samples, max_depth;
+    bool specialize;
+};
+
+struct BenchResult {
+    std::string name;
+    int32_t height, width, samples, max_depth;
+    uint64_t objects;
+    int64_t bvh_nodes, bvh_node_bytes, bvh_references, out_of_tree;
+    double load_s, bvh_build_s, trace_s, encode_s;
+    RayCount rays;
+    int64_t peak_rss_kb;
+
+    double mrays_per_s(uint64_t rays_count) const {
+        return trace_s > 0.0 ? static_cast<double>(rays_count) / trace_s / 1e6 : 0.0;
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// resets the kernel's peak rss counter, so that every scene reports its own peak
+static void reset_peak_rss() {
+    std::ofstream ofs("/proc/self/clear_refs");
+    if (ofs) {
+        ofs << "5";
+    }
+}
+
+static int64_t peak_rss_kb() {
+    std::ifstream ifs("/proc/self/status");
+    std::string line;
+    while (getline(ifs, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::stoll(line.substr(6));
+        }
+    }
+
+    // no procfs, fall back to the process-wide peak
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static BenchResult run_scene(const BenchScene &scene, uint32_t seed) {
+    BenchResult result;
+    result.name = scene.name;
+    result.height = scene.height;
+    result.width = scene.width;
+    result.samples = scene.samples;
+    result.max_depth = scene.max_depth;
+
+    reset_peak_rss();
+    seed_random(seed);
+
+    World world;
+    PerspectiveCamera camera;
+
+    auto start = Clock::now();
+    load_scene(scene.scene, world, camera, scene.height, scene.width);
+    camera.setSamples(scene.samples, scene.max_depth);
+    camera.setSpecialize(scene.specialize);
+    camera.setSeed(seed);
+    TelemetryConfig telemetry;
+    telemetry.terminal = false;
+    camera.setTelemetry(telemetry);
+    result.load_s = seconds_since(start);
+    result.objects = world.get_objects().size();
+
+    start = Clock::now();
+    BVH bvh(world);
+    result.bvh_build_s = seconds_since(start);
+    result.bvh_nodes = bvh.node_count();
+    result.bvh_node_bytes = bvh.node_bytes();
+    result.bvh_references = bvh.reference_count();
+    result.out_of_tree = bvh.out_of_tree_count();
+
+    // meshes sharing one MeshData count once
+    std::vector<const MeshData*> meshes;
+    for (const Object *object : world.get_objects()) {
+        if (const Mesh *mesh = dynamic_cast<const Mesh*>(object)) {
+            meshes.push_back(&mesh->mesh_data());
+        }
+    }
+    std::sort(meshes.begin(), meshes.end());
+    meshes.erase(std::unique(meshes.begin(), meshes.end()), meshes.end());
+    for (const MeshData *mesh : meshes) {
+        result.bvh_build_s += mesh->build_s;
+        result.bvh_nodes += mesh->bvh.node_count();
+        result.bvh_node_bytes += mesh->bvh.node_bytes();
+        result.bvh_references += mesh->bvh.reference_count();
+        result.out_of_tree += mesh->bvh.out_of_tree_count();
+    }
+
+    std::vector<uint8_t> image(scene.height * scene.width * 4);
+    start = Clock::now();
+    camera.render(image, world, bvh);
+    result.trace_s = seconds_since(start);
+    result.rays = camera.getRayCount();
+
+    std::vector<uint8_t> png;
+    start = Clock::now();
+    lodepng::encode(png, image, scene.width, scene.height);
+    result.encode_s = seconds_since(start);
+
+    world.destroy();
+
+    result.peak_rss_kb = peak_rss_kb();
+    return result;
+}
+
+static std::string to_json(const BenchResult &r) {
+    std::stringstream ss;
+    ss << std::setprecision(6);
+    ss << "{\"name\": \"" << r.name << "\""
+       << ", \"width\": " << r.width
+       << ", \"height\": " << r.height
+       << ", \"samples\": " << r.samples
+       << ", \"max_depth\": " << r.max_depth
+       << ", \"objects\": " << r.objects
+       << ", \"load_s\": " << r.load_s
+       << ", \"bvh_build_s\": " << r.bvh_build_s
+       << ", \"bvh_nodes\": " << r.bvh_nodes
+       << ", \"bvh_node_bytes\": " << r.bvh_node_bytes
+       << ", \"bvh_references\": " << r.bvh_references
+       << ", \"out_of_tree\": " << r.out_of_tree
+       << ", \"trace_s\": " << r.trace_s
+       << ", \"encode_s\": " << r.encode_s
+       << ", \"primary_rays\": " << r.rays.primary
+       << ", \"secondary_rays\": " << r.rays.secondary
+       << ", \"shadow_rays\": " << r.rays.shadow
+       << ", \"primary_mrays_per_s\": " << r.mrays_per_s(r.rays.primary)
+       << ", \"secondary_mrays_per_s\": " << r.mrays_per_s(r.rays.secondary)
+       << ", \"shadow_mrays_per_s\": " << r.mrays_per_s(r.rays.shadow)
+       << ", \"total_mrays_per_s\": " << r.mrays_per_s(r.rays.total())
+       << ", \"peak_rss_kb\": " << r.peak_rss_kb
+       << "}";
+    return ss.str();
+}
+
+// the baseline is a file this harness wrote, so a flat "key": value scan of each line is enough
+static double json_number(const std::string &line, const std::string &key) {
+    std::string pattern = "\"" + key + "\": ";
+    size_t pos = line.find(pattern);
+    if (pos == std::string::npos) {
+        return -1.0;
+    }
+    return std::stod(line.substr(pos + pattern.size()));
+}
+
+static std::string json_string(const std::string &line, const std::string &key) {
+    std::string pattern = "\"" + key + "\": \"";
+    size_t pos = line.find(pattern);
+    if (pos == std::string::npos) {
+        return "";
+    }
+    pos += pattern.size();
+    return line.substr(pos, line.find('"', pos) - pos);
+}
+
+static std::map<std::string, std::string> load_baseline(const std::string &filename) {
+    std::map<std::string, std::string> baseline;
+    std::ifstream ifs(filename);
+    std::string line;
+    while (getline(ifs, line)) {
+        std::string name = json_string(line, "name");
+        if (!name.empty()) {
+            baseline[name] = line;
+        }
+    }
+    return baseline;
+}
+
+// returns the number of regressed metrics
+static int32_t compare(const BenchResult &r, const std::string &baseline, double threshold) {
+    struct Metric {
+        const char *key;
+        double value;
+        bool higher_is_better;
+    };
+
+    // timings below this are dominated by noise
+    constexpr double min_seconds = 0.01;
+
+    Metric metrics[] = {
+        {"load_s", r.load_s, false},
+        {"bvh_build_s", r.bvh_build_s, false},
+        {"trace_s", r.trace_s, false},
+        {"total_mrays_per_s", r.mrays_per_s(r.rays.total()), true},
+        {"peak_rss_kb", static_cast<double>(r.peak_rss_kb), false},
+    };
+
+    int32_t regressions = 0;
+    for (const Metric &m : metrics) {
+        double base = json_number(baseline, m.key);
+        if (base <= 0.0) {
+            continue;
+        }
+
+        bool is_time = std::string(m.key).ends_with("_s");
+        if (is_time && std::max(base, m.value) < min_seconds) {
+            continue;
+        }
+
+        double change = (m.value - base) / base;
+        bool regressed = m.higher_is_better ? change < -threshold : change > threshold;
+
+        if (regressed) {
+            ++regressions;
+            std::clog << "REGRESSION " << r.name << " " << m.key << ": "
+                      << base << " -> " << m.value
+                      << " (" << std::showpos << change * 100.0 << std::noshowpos << "%)" << std::endl;
+        }
+    }
+
+    return regressions;
+}
+
+std::vector<BenchScene> bench_scenes() {
+    return {
+        {"scene1", "scene1", 180, 320, 16, 25, true},
+        {"scene2", "scene2", 180, 320, 16, 50, true},
+        {"outdoor", "outdoor", 180, 320, 16, 8, true},
+        {"lights", "lights", 180, 320, 16, 8, true},
+        {"bunny", "bunny", 256, 256, 8, 8, true},
+        {"dragon", "dragon", 256, 256, 8, 8, true},
+        {"teapot", "teapot", 256, 256, 8, 8, true},
+        {"cow", "cow", 256, 256, 8, 8, true},
+        // the generic kernel, to keep track of what compile-time specialization buys
+        {"scene1_generic", "scene1", 180, 320, 16, 25, false},
+        {"scene2_generic", "scene2", 180, 320, 16, 50, false},
+    };
+}
+
+int32_t main(int32_t argc, char *argv[]) {
+    std::string out_filename = "bench.json";
+    std::string baseline_filename;
+    std::string only_scene;
+    bool save_baseline = false;
+    double threshold = 0.10;
+    uint32_t seed = 1;
+
+    for (int32_t i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc) {
+            out_filename = argv[++i];
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_filename = argv[++i];
+        } else if (arg == "--save-baseline") {
+            save_baseline = true;
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            threshold = std::stod(argv[++i]);
+        } else if (arg == "--scene" && i + 1 < argc) {
+            only_scene = argv[++i];
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else {
+            std::cout << "usage: " << argv[0]
+                      << " [--out file] [--baseline file] [--save-baseline] [--threshold 0.10] [--scene name] [--seed n]" << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    for (const BenchScene &scene : bench_scenes()) {
+        if (!only_scene.empty() && scene.name != only_scene) {
+            continue;
+        }
+
+        std::clog << "bench " << scene.name << " ... " << std::flush;
+        results.push_back(run_scene(scene, seed));
+
+        const BenchResult &r = results.back();
+        std::stringstream summary;
+        summary << std::fixed << std::setprecision(3)
+                << "load " << r.load_s << "s, bvh " << r.bvh_build_s << "s, trace " << r.trace_s << "s, "
+                << r.mrays_per_s(r.rays.total()) << " Mrays/s, peak " << r.peak_rss_kb / 1024 << " MiB";
+        std::clog << summary.str() << std::endl;
+    }
+
+    std::stringstream json;
+    json << "{\n  \"threads\": " << std::thread::hardware_concurrency() << ",\n  \"seed\": " << seed << ",\n  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        json << "    " << to_json(results[i]) << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+
+    std::ofstream(out_filename) << json.str();
+    std::clog << "wrote " << out_filename << std::endl;
+
+    if (baseline_filename.empty()) {
+        return 0;
+    }
+
+    if (save_baseline) {
+        std::ofstream(baseline_filename) << json.str();
+        std::clog << "saved baseline " << baseline_filename << std::endl;
+        return 0;
+    }
+
+    std::map<std::string, std::string> baseline = load_baseline(baseline_filename);
+    if (baseline.empty()) {
+        std::clog << "no baseline at " << baseline_filename << ", run `make bench-baseline` to create one" << std::endl;
+        return 0;
+    }
+
+    int32_t regressions = 0;
+    for (const BenchResult &r : results) {
+        auto it = baseline.find(r.name);
+        if (it != baseline.end()) {
+            regressions += compare(r, it->second, threshold);
+        }
+    }
+
+    if (regressions > 0) {
+        std::clog << regressions << " regression(s) over " << threshold * 100.0 << "% against " << baseline_filename << std::endl;
+        return 1;
+    }
+
+    std::clog << "no regressions against " << baseline_filename << std::endl;
+    return 0;
+}
@@ -1,131 +1,782 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
 #include <vector>
 
 #include <object.h>
+#include <stats.h>
+#include <trace.h>
+
+/*
+spatial-split bounding volume hierarchy (SBVH)
+https://www.nvidia.com/docs/IO/77714/sbvh.pdf
+
+nodes are split where the surface area heuristic is cheapest, either by binning primitive
+centroids (object split) or by cutting space into bins and clipping every primitive that
+straddles a cut into both halves (spatial split). spatial splits are only tried where the
+children of the object split overlap noticeably, and stop once the references outgrow
+reference_budget times the primitive count, so memory stays bounded.
+
+primitives whose box is larger than the rest of the scene put together, like the ground
+sphere of scene1, or that are unbounded, are kept out of the tree: inside it they would make
+every node around them overlap. they are tested on their own before traversal.
+
+the binary tree is only built, then collapsed into 4-wide nodes that store their children's
+boxes in 8 bits per side relative to the node, as in
+https://research.nvidia.com/publication/2017-07_efficient-incoherent-ray-traversal-gpus-through-compressed-wide-bvhs
+a node fills one cache line, about a third of the memory the binary nodes took.
+*/
+
+struct BVHConfig {
+    int32_t max_leaf_size = 4;
+    int32_t bins = 32;
+    float reference_budget = 1.5f;  // references allowed per primitive, spatial splits stop beyond
+    float split_alpha = 1e-5f;      // child overlap, relative to the root area, that makes spatial splits worth trying
+    int32_t max_out_of_tree = 8;
+};
 
 class BVH {
-    struct BVHNode {
+    struct BuildNode {
         bool is_leaf;
         AABB aabb;
         int64_t left;
         int64_t right;
+        int64_t first;      // leaves: objects[first, first + count)
+        int64_t count;
+    };
+
+    // one primitive, or the part of it inside a node
+    struct Reference {
+        AABB aabb;
         const Object* obj;
     };
 
-    std::vector<BVHNode> nodes;
+    struct Split {
+        float cost = std::numeric_limits<float>::max();
+        bool spatial = false;
+        int32_t axis = -1;
+        int32_t bin = 0;        // object splits: first centroid bin of the right child
+        float position = 0.0f;  // spatial splits: the cut
+        AABB left, right;
+    };
+
+    /*
+    child i spans origin + lo * 2^exponent to origin + hi * 2^exponent on every axis. the
+    quantized box is rounded outwards, it always contains the child's real box.
+    */
+    struct alignas(64) QuantizedNode {
+        glm::vec3 origin;
+        int8_t exponent[3];
+        uint8_t child_count;
+        uint8_t lo[3][4];
+        uint8_t hi[3][4];
+        uint32_t child[4];  // interior children: node index, leaves: first object
+        uint8_t count[4];   // objects of a leaf child, 0 for interior children
+    };
+
+    static constexpr int64_t max_leaf_objects = 255;
+
+    BVHConfig config;
+    std::vector<BuildNode> build_nodes;
+    std::vector<QuantizedNode> nodes;
+    std::vector<const Object*> objects;
+    std::vector<const Object*> out_of_tree;
     int64_t root = -1;
 
+    float root_area = 0.0f;
+    int64_t spare_references = 0;
+
 public:
     BVH() {}
-    BVH(const World &w) {
-        const std::vector<const Object*> &objects = w.get_objects();
+    BVH(const World &w, const BVHConfig &config = BVHConfig()) : BVH(w.get_objects(), config) {}
 
-        for (const Object* obj : objects) {
-            BVHNode node = {
-                .is_leaf = true,
-                .aabb = obj->aabb(),
-                .obj = obj
-            };
-            nodes.push_back(node);
+    BVH(const std::vector<const Object*> &primitives, const BVHConfig &config = BVHConfig()) : config(config) {
+        RAY_TRACE_SCOPE_ARG("build bvh", "primitives", primitives.size());
+        std::vector<Reference> references;
+        for (const Object* obj : primitives) {
+            references.push_back(Reference{obj->aabb(), obj});
         }
 
-        root = build_recursive(0, objects.size());
+        split_out_of_tree(references);
+        if (references.empty()) {
+            return;
+        }
+
+        AABB aabb = references[0].aabb;
+        for (const Reference &ref : references) {
+            aabb = AABB(aabb, ref.aabb);
+        }
+        root_area = surface_area(aabb);
+        spare_references = static_cast<int64_t>(static_cast<float>(references.size()) * (config.reference_budget - 1.0f));
+
+        int64_t build_root = build_recursive(references, aabb, 0);
+        root = compress(build_root);
+        build_nodes.clear();
+        build_nodes.shrink_to_fit();
+    }
+
+    int64_t node_count() const { return static_cast<int64_t>(nodes.size()); }
+    int64_t node_bytes() const { return static_cast<int64_t>(nodes.size() * sizeof(QuantizedNode)); }
+    int64_t reference_count() const { return static_cast<int64_t>(objects.size()); }
+    int64_t out_of_tree_count() const { return static_cast<int64_t>(out_of_tree.size()); }
+
+    // every object the tree holds, once each, though spatial splits may reference it from several leaves
+    std::vector<const Object*> unique_objects() const {
+        std::vector<const Object*> unique(objects);
+        unique.insert(unique.end(), out_of_tree.begin(), out_of_tree.end());
+        std::sort(unique.begin(), unique.end());
+        unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+        return unique;
+    }
+
+    // points the tree at copies of its objects, map(object) gives each one's copy
+    template <typename F>
+    void remap_objects(F &&map) {
+        for (const Object* &object : objects) {
+            object = map(object);
+        }
+        for (const Object* &object : out_of_tree) {
+            object = map(object);
+        }
     }
 
 private:
-    int64_t build_recursive(int64_t start, int64_t end) {
-        int64_t n_objects = end - start;
+    static float surface_area(const AABB &aabb) {
+        glm::vec3 d = aabb.box_bb - aabb.box_aa;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
 
-        if (n_objects == 1) {
-            return start;
+    static bool is_bounded(const AABB &aabb) {
+        for (int32_t i = 0; i < 3; ++i) {
+            if (!std::isfinite(aabb.box_aa[i]) || !std::isfinite(aabb.box_bb[i])) {
+                return false;
+            }
         }
+        return true;
+    }
 
-        // sort
-        AABB aabb;
-        for (int64_t i = start; i < end; ++i) {
-            aabb = AABB(aabb, nodes[i].aabb);
+    static AABB intersection(const AABB &a, const AABB &b) {
+        return AABB(glm::max(a.box_aa, b.box_aa), glm::min(a.box_bb, b.box_bb));
+    }
+
+    static bool overlaps(const AABB &a, const AABB &b) {
+        for (int32_t i = 0; i < 3; ++i) {
+            if (std::max(a.box_aa[i], b.box_aa[i]) > std::min(a.box_bb[i], b.box_bb[i])) {
+                return false;
+            }
         }
+        return true;
+    }
 
-        float x_size = aabb.box_bb.x - aabb.box_aa.x;
-        float y_size = aabb.box_bb.y - aabb.box_aa.y;
-        float z_size = aabb.box_bb.z - aabb.box_aa.z;
+    // moves the largest primitives out of the tree while each is bigger than everything left
+    void split_out_of_tree(std::vector<Reference> &references) {
+        std::vector<Reference> bounded;
+        for (const Reference &ref : references) {
+            if (is_bounded(ref.aabb)) {
+                bounded.push_back(ref);
+            } else {
+                out_of_tree.push_back(ref.obj);
+            }
+        }
 
-        // pick the longest axis
-        int64_t axis;
-        if (x_size > y_size) {
-            axis = x_size > z_size ? 0 : 2;
-        } else {
-            axis = y_size > z_size ? 1 : 2;
+        std::sort(bounded.begin(), bounded.end(), [](const Reference &a, const Reference &b) {
+            return surface_area(a.aabb) > surface_area(b.aabb);
+        });
+
+        // suffix[i] bounds bounded[i, end)
+        std::vector<AABB> suffix(bounded.size());
+        for (int64_t i = static_cast<int64_t>(bounded.size()) - 1; i >= 0; --i) {
+            suffix[i] = i + 1 < static_cast<int64_t>(bounded.size()) ? AABB(bounded[i].aabb, suffix[i + 1]) : bounded[i].aabb;
+        }
+
+        size_t first = 0;
+        while (first + 1 < bounded.size() &&
+               static_cast<int32_t>(out_of_tree.size()) < config.max_out_of_tree &&
+               surface_area(bounded[first].aabb) > surface_area(suffix[first + 1])) {
+            out_of_tree.push_back(bounded[first].obj);
+            ++first;
+        }
+
+        references.assign(bounded.begin() + first, bounded.end());
+    }
+
+    int64_t make_leaf(const std::vector<Reference> &references, const AABB &aabb) {
+        BuildNode node = {
+            .is_leaf = true,
+            .aabb = aabb,
+            .first = static_cast<int64_t>(objects.size()),
+            .count = static_cast<int64_t>(references.size())
+        };
+        for (const Reference &ref : references) {
+            objects.push_back(ref.obj);
+        }
+        build_nodes.push_back(node);
+        return build_nodes.size() - 1;
+    }
+
+    // leaves hold at most max_leaf_objects, larger ones are halved in whatever order they are
+    int64_t make_bounded_leaf(const std::vector<Reference> &references, const AABB &aabb) {
+        if (static_cast<int64_t>(references.size()) <= max_leaf_objects) {
+            return make_leaf(references, aabb);
+        }
+
+        size_t mid = references.size() / 2;
+        std::vector<Reference> left_references(references.begin(), references.begin() + mid);
+        std::vector<Reference> right_references(references.begin() + mid, references.end());
+        AABB left_aabb = left_references[0].aabb, right_aabb = right_references[0].aabb;
+        for (const Reference &ref : left_references) {
+            left_aabb = AABB(left_aabb, ref.aabb);
+        }
+        for (const Reference &ref : right_references) {
+            right_aabb = AABB(right_aabb, ref.aabb);
         }
 
-        auto comparator = [&](const BVHNode &a, const BVHNode &b) {
-            return a.aabb.box_aa[axis] < b.aabb.box_aa[axis];
+        int64_t left = make_bounded_leaf(left_references, left_aabb);
+        int64_t right = make_bounded_leaf(right_references, right_aabb);
+        BuildNode node = {
+            .is_leaf = false,
+            .aabb = aabb,
+            .left = left,
+            .right = right
         };
-        std::sort(nodes.begin() + start, nodes.begin() + end, comparator);
+        build_nodes.push_back(node);
+        return build_nodes.size() - 1;
+    }
+
+    int64_t build_recursive(std::vector<Reference> &references, const AABB &aabb, int32_t depth) {
+        int64_t n_references = references.size();
+
+        if (n_references == 1) {
+            return make_leaf(references, aabb);
+        }
+
+        float area = surface_area(aabb);
+        Split split = find_object_split(references, area);
+
+        if (spare_references > 0 && split.axis >= 0 && root_area > 0.0f) {
+            if (overlaps(split.left, split.right) && surface_area(intersection(split.left, split.right)) > config.split_alpha * root_area) {
+                Split spatial = find_spatial_split(references, aabb, area);
+                if (spatial.cost < split.cost) {
+                    split = spatial;
+                }
+            }
+        }
+
+        // a leaf costs one test per reference, a split one traversal step plus its children
+        float leaf_cost = static_cast<float>(n_references);
+        if (split.axis < 0 || (n_references <= config.max_leaf_size && leaf_cost <= split.cost) || depth >= 64) {
+            return make_bounded_leaf(references, aabb);
+        }
+
+        std::vector<Reference> left_references, right_references;
+        AABB left_aabb, right_aabb;
+        if (split.spatial) {
+            partition_spatial(references, split, left_references, right_references, left_aabb, right_aabb);
+        } else {
+            partition_object(references, split, left_references, right_references, left_aabb, right_aabb);
+        }
 
-        int64_t mid = start + n_objects / 2;
-        int64_t left = build_recursive(start, mid);
-        int64_t right = build_recursive(mid, end);
+        if (left_references.empty() || right_references.empty()) {
+            return make_bounded_leaf(references, aabb);
+        }
+
+        references.clear();
+        references.shrink_to_fit();
+
+        int64_t left = build_recursive(left_references, left_aabb, depth + 1);
+        int64_t right = build_recursive(right_references, right_aabb, depth + 1);
 
-        BVHNode node = {
+        BuildNode node = {
             .is_leaf = false,
             .aabb = aabb,
             .left = left,
             .right = right
         };
 
-        nodes.push_back(node);
-        return nodes.size() - 1;
+        build_nodes.push_back(node);
+        return build_nodes.size() - 1;
+    }
+
+    static glm::vec3 centroid(const AABB &aabb) {
+        return 0.5f * (aabb.box_aa + aabb.box_bb);
+    }
+
+    // binned SAH over primitive centroids
+    Split find_object_split(const std::vector<Reference> &references, float area) const {
+        Split best;
+
+        glm::vec3 lo = centroid(references[0].aabb), hi = lo;
+        for (const Reference &ref : references) {
+            lo = glm::min(lo, centroid(ref.aabb));
+            hi = glm::max(hi, centroid(ref.aabb));
+        }
+
+        int32_t bins = config.bins;
+        for (int32_t axis = 0; axis < 3; ++axis) {
+            float extent = hi[axis] - lo[axis];
+            if (extent <= 0.0f) {
+                continue;
+            }
+
+            std::vector<AABB> bin_aabb(bins);
+            std::vector<int64_t> bin_count(bins, 0);
+            for (const Reference &ref : references) {
+                int32_t b = object_bin(centroid(ref.aabb)[axis], lo[axis], extent);
+                bin_aabb[b] = bin_count[b] == 0 ? ref.aabb : AABB(bin_aabb[b], ref.aabb);
+                ++bin_count[b];
+            }
+
+            std::vector<bool> bin_used(bins);
+            for (int32_t b = 0; b < bins; ++b) {
+                bin_used[b] = bin_count[b] > 0;
+            }
+            evaluate_bins(bin_aabb, bin_used, bin_count, bin_count, area, axis, best);
+        }
+
+        return best;
+    }
+
+    int32_t object_bin(float c, float lo, float extent) const {
+        int32_t b = static_cast<int32_t>(static_cast<float>(config.bins) * (c - lo) / extent);
+        return std::clamp(b, 0, config.bins - 1);
+    }
+
+    /*
+    binned spatial split: every reference is clipped into each bin it overlaps, entering in its
+    first bin and leaving in its last; a cut between bins sends everything entering left of it
+    to the left child and everything leaving right of it to the right one
+    */
+    Split find_spatial_split(const std::vector<Reference> &references, const AABB &aabb, float area) const {
+        Split best;
+        int32_t bins = config.bins;
+
+        // only along the longest side of the node, clipping is the expensive part of the build
+        glm::vec3 size = aabb.box_bb - aabb.box_aa;
+        int32_t axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+        float lo = aabb.box_aa[axis];
+        float bin_width = size[axis] / static_cast<float>(bins);
+        if (bin_width <= 0.0f) {
+            return best;
+        }
+
+        std::vector<AABB> bin_aabb(bins);
+        std::vector<bool> bin_used(bins, false);
+        std::vector<int64_t> entries(bins, 0), exits(bins, 0);
+
+        for (const Reference &ref : references) {
+            int32_t first = std::clamp(static_cast<int32_t>((ref.aabb.box_aa[axis] - lo) / bin_width), 0, bins - 1);
+            int32_t last = std::clamp(static_cast<int32_t>((ref.aabb.box_bb[axis] - lo) / bin_width), first, bins - 1);
+
+            AABB rest = ref.aabb;
+            bool rest_empty = false;
+            for (int32_t b = first; b < last && !rest_empty; ++b) {
+                AABB left;
+                bool left_empty = !split_reference(ref.obj, rest, axis, lo + bin_width * static_cast<float>(b + 1), left, rest, rest_empty);
+                if (!left_empty) {
+                    bin_aabb[b] = bin_used[b] ? AABB(bin_aabb[b], left) : left;
+                    bin_used[b] = true;
+                }
+            }
+            if (!rest_empty) {
+                bin_aabb[last] = bin_used[last] ? AABB(bin_aabb[last], rest) : rest;
+                bin_used[last] = true;
+            }
+
+            ++entries[first];
+            ++exits[last];
+        }
+
+        evaluate_bins(bin_aabb, bin_used, entries, exits, area, axis, best);
+        best.spatial = true;
+        best.position = lo + bin_width * static_cast<float>(best.bin);
+        return best;
+    }
+
+    /*
+    sweeps the cuts between bins and keeps the cheapest in `best`. left_count[b] and
+    right_count[b] are the references bin b adds to the child left and right of a cut.
+    */
+    void evaluate_bins(
+        const std::vector<AABB> &bin_aabb,
+        const std::vector<bool> &used,
+        const std::vector<int64_t> &left_count,
+        const std::vector<int64_t> &right_count,
+        float area,
+        int32_t axis,
+        Split &best
+    ) const {
+        int32_t bins = config.bins;
+
+        // right_area[b], right_n[b]: everything in bins [b, bins)
+        std::vector<float> right_area(bins + 1, 0.0f);
+        std::vector<int64_t> right_n(bins + 1, 0);
+        std::vector<AABB> right_aabb(bins + 1);
+        bool right_any = false;
+        for (int32_t b = bins - 1; b >= 0; --b) {
+            right_aabb[b] = right_aabb[b + 1];
+            if (used[b]) {
+                right_aabb[b] = right_any ? AABB(right_aabb[b + 1], bin_aabb[b]) : bin_aabb[b];
+                right_any = true;
+            }
+            right_area[b] = right_any ? surface_area(right_aabb[b]) : 0.0f;
+            right_n[b] = right_n[b + 1] + right_count[b];
+        }
+
+        AABB left_aabb;
+        bool left_any = false;
+        int64_t left_n = 0;
+        for (int32_t b = 1; b < bins; ++b) {
+            if (used[b - 1]) {
+                left_aabb = left_any ? AABB(left_aabb, bin_aabb[b - 1]) : bin_aabb[b - 1];
+                left_any = true;
+            }
+            left_n += left_count[b - 1];
+
+            if (left_n == 0 || right_n[b] == 0) {
+                continue;
+            }
+
+            float cost = 1.0f + (surface_area(left_aabb) * static_cast<float>(left_n) + right_area[b] * static_cast<float>(right_n[b])) / area;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.left = left_aabb;
+                best.right = right_aabb[b];
+            }
+        }
+    }
+
+    void partition_object(
+        const std::vector<Reference> &references,
+        const Split &split,
+        std::vector<Reference> &left_references,
+        std::vector<Reference> &right_references,
+        AABB &left_aabb,
+        AABB &right_aabb
+    ) const {
+        glm::vec3 lo = centroid(references[0].aabb), hi = lo;
+        for (const Reference &ref : references) {
+            lo = glm::min(lo, centroid(ref.aabb));
+            hi = glm::max(hi, centroid(ref.aabb));
+        }
+        float extent = hi[split.axis] - lo[split.axis];
+
+        for (const Reference &ref : references) {
+            if (object_bin(centroid(ref.aabb)[split.axis], lo[split.axis], extent) < split.bin) {
+                left_aabb = left_references.empty() ? ref.aabb : AABB(left_aabb, ref.aabb);
+                left_references.push_back(ref);
+            } else {
+                right_aabb = right_references.empty() ? ref.aabb : AABB(right_aabb, ref.aabb);
+                right_references.push_back(ref);
+            }
+        }
+    }
+
+    /*
+    references on one side of the cut go to that side. a straddling reference is clipped into
+    both, unless keeping it whole on one side is cheaper (reference unsplitting)
+    */
+    void partition_spatial(
+        const std::vector<Reference> &references,
+        const Split &split,
+        std::vector<Reference> &left_references,
+        std::vector<Reference> &right_references,
+        AABB &left_aabb,
+        AABB &right_aabb
+    ) {
+        int32_t axis = split.axis;
+        float position = split.position;
+
+        std::vector<const Reference*> straddling;
+        auto grow = [](std::vector<Reference> &side, AABB &side_aabb, const Reference &ref) {
+            side_aabb = side.empty() ? ref.aabb : AABB(side_aabb, ref.aabb);
+            side.push_back(ref);
+        };
+
+        for (const Reference &ref : references) {
+            if (ref.aabb.box_bb[axis] <= position) {
+                grow(left_references, left_aabb, ref);
+            } else if (ref.aabb.box_aa[axis] >= position) {
+                grow(right_references, right_aabb, ref);
+            } else {
+                straddling.push_back(&ref);
+            }
+        }
+
+        for (const Reference *ref : straddling) {
+            AABB left, right;
+            bool left_empty, right_empty;
+            left_empty = !split_reference(ref->obj, ref->aabb, axis, position, left, right, right_empty);
+
+            // the part of the primitive inside this node lies on one side only
+            if (left_empty || right_empty) {
+                if (left_empty) {
+                    grow(right_references, right_aabb, Reference{right, ref->obj});
+                } else {
+                    grow(left_references, left_aabb, Reference{left, ref->obj});
+                }
+                continue;
+            }
+
+            if (left_references.empty() || right_references.empty() || spare_references <= 0) {
+                // nothing to compare against yet, or no budget left: split only if it must be
+                if (spare_references > 0) {
+                    grow(left_references, left_aabb, Reference{left, ref->obj});
+                    grow(right_references, right_aabb, Reference{right, ref->obj});
+                    --spare_references;
+                } else if (left_references.size() <= right_references.size()) {
+                    grow(left_references, left_aabb, *ref);
+                } else {
+                    grow(right_references, right_aabb, *ref);
+                }
+                continue;
+            }
+
+            float n_left = static_cast<float>(left_references.size());
+            float n_right = static_cast<float>(right_references.size());
+            float cost_split = surface_area(AABB(left_aabb, left)) * (n_left + 1.0f) + surface_area(AABB(right_aabb, right)) * (n_right + 1.0f);
+            float cost_left = surface_area(AABB(left_aabb, ref->aabb)) * (n_left + 1.0f) + surface_area(right_aabb) * n_right;
+            float cost_right = surface_area(left_aabb) * n_left + surface_area(AABB(right_aabb, ref->aabb)) * (n_right + 1.0f);
+
+            if (cost_left < cost_split && cost_left <= cost_right) {
+                grow(left_references, left_aabb, *ref);
+            } else if (cost_right < cost_split) {
+                grow(right_references, right_aabb, *ref);
+            } else {
+                grow(left_references, left_aabb, Reference{left, ref->obj});
+                grow(right_references, right_aabb, Reference{right, ref->obj});
+                --spare_references;
+            }
+        }
+    }
+
+    /*
+    clips `part`, the box of a reference, at position. returns whether the left
+    piece is non-empty, right_empty tells the same for the right one. the pieces stay conservative:
+    the primitive is split whole, then cut down to `part`.
+    */
+    static bool split_reference(const Object *obj, const AABB &part, int32_t axis, float position, AABB &left, AABB &right, bool &right_empty) {
+        AABB object_left, object_right;
+        obj->split_aabb(axis, position, object_left, object_right);
+
+        bool left_empty = !overlaps(object_left, part);
+        right_empty = !overlaps(object_right, part);
+        if (!left_empty) {
+            left = intersection(object_left, part);
+        }
+        if (!right_empty) {
+            right = intersection(object_right, part);
+        }
+        return !left_empty;
+    }
+
+    static float exponent_scale(int8_t exponent) {
+        return std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23);
+    }
+
+    // collapses the binary subtree at build_node into 4-wide quantized nodes, returns the root's index
+    int64_t compress(int64_t build_node) {
+        // open the child with the largest box until there are four, leaves stay closed
+        std::vector<int64_t> children;
+        if (build_nodes[build_node].is_leaf) {
+            children.push_back(build_node);
+        } else {
+            children = {build_nodes[build_node].left, build_nodes[build_node].right};
+        }
+        while (children.size() < 4) {
+            int64_t largest = -1;
+            for (size_t i = 0; i < children.size(); ++i) {
+                const BuildNode &child = build_nodes[children[i]];
+                if (!child.is_leaf && (largest < 0 || surface_area(child.aabb) > surface_area(build_nodes[children[largest]].aabb))) {
+                    largest = static_cast<int64_t>(i);
+                }
+            }
+            if (largest < 0) {
+                break;
+            }
+            const BuildNode &open = build_nodes[children[largest]];
+            children[largest] = open.left;
+            children.push_back(open.right);
+        }
+
+        int64_t index = static_cast<int64_t>(nodes.size());
+        nodes.emplace_back();
+
+        uint32_t child_index[4] = {0, 0, 0, 0};
+        for (size_t i = 0; i < children.size(); ++i) {
+            const BuildNode &child = build_nodes[children[i]];
+            child_index[i] = static_cast<uint32_t>(child.is_leaf ? child.first : compress(children[i]));
+        }
+
+        AABB aabb = build_nodes[children[0]].aabb;
+        for (int64_t child : children) {
+            aabb = AABB(aabb, build_nodes[child].aabb);
+        }
+
+        QuantizedNode &node = nodes[index];
+        node.origin = aabb.box_aa;
+        node.child_count = static_cast<uint8_t>(children.size());
+        for (int32_t axis = 0; axis < 3; ++axis) {
+            // the smallest power of two step whose 255th multiple still reaches the top of the box
+            float extent = aabb.box_bb[axis] - aabb.box_aa[axis];
+            int32_t exponent = std::clamp(static_cast<int32_t>(std::ceil(std::log2(std::max(extent, 1e-30f) / 255.0f))), -126, 127);
+            while (exponent < 127 && node.origin[axis] + 255.0f * exponent_scale(static_cast<int8_t>(exponent)) < aabb.box_bb[axis]) {
+                ++exponent;
+            }
+            node.exponent[axis] = static_cast<int8_t>(exponent);
+        }
+
+        for (int32_t i = 0; i < 4; ++i) {
+            bool used = i < static_cast<int32_t>(children.size());
+            const AABB &child_aabb = build_nodes[children[used ? i : 0]].aabb;
+            for (int32_t axis = 0; axis < 3; ++axis) {
+                float origin = node.origin[axis];
+                float scale = exponent_scale(node.exponent[axis]);
+                if (!used) {
+                    // an empty box, no ray enters it
+                    node.lo[axis][i] = 255;
+                    node.hi[axis][i] = 0;
+                    continue;
+                }
+
+                // round outwards, then step further while float rounding still cuts into the box
+                int32_t lo = std::clamp(static_cast<int32_t>(std::floor((child_aabb.box_aa[axis] - origin) / scale)), 0, 255);
+                int32_t hi = std::clamp(static_cast<int32_t>(std::ceil((child_aabb.box_bb[axis] - origin) / scale)), 0, 255);
+                while (lo > 0 && origin + static_cast<float>(lo) * scale > child_aabb.box_aa[axis]) {
+                    --lo;
+                }
+                while (hi < 255 && origin + static_cast<float>(hi) * scale < child_aabb.box_bb[axis]) {
+                    ++hi;
+                }
+                node.lo[axis][i] = static_cast<uint8_t>(lo);
+                node.hi[axis][i] = static_cast<uint8_t>(hi);
+            }
+            node.child[i] = child_index[i];
+            node.count[i] = used && build_nodes[children[i]].is_leaf ? static_cast<uint8_t>(build_nodes[children[i]].count) : 0;
+        }
+
+        return index;
     }
 
 public:
     BVHHit hit(const World &w, const Ray &r, float tmin, float tmax) const {
-        return hit_recursive(w, r, tmin, tmax, root);
+        return hit(r, tmin, tmax);
     }
 
-private:
-    BVHHit hit_recursive(const World &w, const Ray &r, float tmin, float tmax, int64_t parent_node) const {
-        const BVHNode &node = nodes[parent_node];
-
+    // for trees built from a list of primitives rather than a World
+    BVHHit hit(const Ray &r, float tmin, float tmax) const {
         BVHHit bvhhit;
         bvhhit.is_hit = false;
         bvhhit.t = 0.0f;
 
-        // if not node.hit
-        if (!node.aabb.hit(r, tmin, tmax)) {
+        for (const Object* object : out_of_tree) {
+            RAY_STATS_ADD(primitive_tests, 1);
+            BVHHit object_hit = object->bvh_hit(r, tmin, tmax);
+            if (object_hit.is_hit) {
+                object_hit.obj = object;
+                bvhhit = object_hit;
+                tmax = object_hit.t;
+            }
+        }
+
+        if (root < 0) {
             return bvhhit;
         }
 
-        // object.hit
-        if (node.is_leaf) {
-            const Object* object = node.obj;
+        BVHHit tree_hit = hit_tree(r, tmin, tmax);
+        return tree_hit.is_hit ? tree_hit : bvhhit;
+    }
+
+private:
+    BVHHit hit_tree(const Ray &r, float tmin, float tmax) const {
+        BVHHit bvhhit;
+        bvhhit.is_hit = false;
+        bvhhit.t = 0.0f;
 
-            bvhhit = object->bvh_hit(r, tmin, tmax);
+        glm::vec3 inverse_direction(1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z);
 
-            if (bvhhit.is_hit){
-                bvhhit.obj = object;
+        // children still to visit with the distance the ray enters them, nearest on top. a node
+        // pushes at most 4 and the tree is less than 128 deep, the depth cap plus the halving of
+        // oversized leaves
+        struct Entry {
+            float t;
+            uint32_t child;
+            uint32_t count;
+        };
+        Entry stack[512];
+        int32_t stack_size = 0;
+        stack[stack_size++] = Entry{tmin, static_cast<uint32_t>(root), 0};
+
+        while (stack_size > 0) {
+            Entry entry = stack[--stack_size];
+            // a hit since it was pushed may already be in front of it
+            if (entry.t > tmax) {
+                continue;
             }
 
-            return bvhhit;
-        } else {
-            // TODO : make sure hit_right does not have dependency on hit_left,
-            // so that we can parallelize hit_left and hit_right
-            BVHHit bvhhit_left = hit_recursive(w, r, tmin, tmax, node.left);
+            if (entry.count > 0) {
+                for (uint32_t i = entry.child; i < entry.child + entry.count; ++i) {
+                    const Object* object = objects[i];
+
+                    RAY_STATS_ADD(primitive_tests, 1);
+                    BVHHit object_hit = object->bvh_hit(r, tmin, tmax);
 
-            if (bvhhit_left.is_hit) {
-                tmax = bvhhit_left.t;
+                    if (object_hit.is_hit) {
+                        object_hit.obj = object;
+                        bvhhit = object_hit;
+                        tmax = object_hit.t;
+                    }
+                }
+                continue;
             }
 
-            BVHHit bvhhit_right = hit_recursive(w, r, tmin, tmax, node.right);
+            const QuantizedNode &node = nodes[entry.child];
+            RAY_STATS_ADD(nodes_visited, 1);
+            RAY_STATS_ADD(boxes_tested, node.child_count);
 
-            if (bvhhit_right.is_hit) {
-                return bvhhit_right;
-            } else if (bvhhit_left.is_hit){
-                return bvhhit_left;
+            // the ray's slab distances as affine functions of the quantized coordinates
+            glm::vec3 t_origin, t_step;
+            for (int32_t axis = 0; axis < 3; ++axis) {
+                t_origin[axis] = (node.origin[axis] - r.origin[axis]) * inverse_direction[axis];
+                t_step[axis] = exponent_scale(node.exponent[axis]) * inverse_direction[axis];
             }
 
-            return bvhhit;
+            // decode every child box and clip the ray against it, push the hit ones farthest first
+            Entry hits[4];
+            int32_t n_hits = 0;
+            for (int32_t i = 0; i < node.child_count; ++i) {
+                float t0 = tmin, t1 = tmax;
+                for (int32_t axis = 0; axis < 3; ++axis) {
+                    float near = t_origin[axis] + static_cast<float>(node.lo[axis][i]) * t_step[axis];
+                    float far = t_origin[axis] + static_cast<float>(node.hi[axis][i]) * t_step[axis];
+                    if (t_step[axis] < 0.0f) {
+                        std::swap(near, far);
+                    }
+                    t0 = std::max(near, t0);
+                    t1 = std::min(far, t1);
+                }
+                if (t0 > t1) {
+                    continue;
+                }
+
+                int32_t k = n_hits++;
+                while (k > 0 && hits[k - 1].t < t0) {
+                    hits[k] = hits[k - 1];
+                    --k;
+                }
+                hits[k] = Entry{t0, node.child[i], node.count[i]};
+            }
+
+            for (int32_t k = 0; k < n_hits; ++k) {
+                stack[stack_size++] = hits[k];
+            }
         }
+
+        return bvhhit;
     }
 };
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <cmath>
+#include <numbers>
 #include <thread>
 #include <algorithm>
+#include <atomic>
+#include <vector>
 
 #include <glm/glm.hpp>
 
@@ -12,11 +15,106 @@
 #include <object.h>
 #include <bvh.h>
 #include <material.h>
+#include <stats.h>
+#include <telemetry.h>
+#include <framebuffer.h>
+#include <denoise.h>
+#include <thread_pool.h>
+#include <kernel.h>
+#include <numa.h>
+#include <hit_cache.h>
+#include <environment.h>
+#include <light_bvh.h>
+#include <trace.h>
+
+// first-hit features summed over the samples of a pixel, they guide the denoiser
+struct FeatureSample {
+    glm::vec3 albedo = glm::vec3(0.0, 0.0, 0.0);
+    glm::vec3 normal = glm::vec3(0.0, 0.0, 0.0);
+    float depth = 0.0f;
+};
+
+// a pixel's samples and features summed up, stored into a frame as their mean
+struct PixelAccumulator {
+    glm::vec3 color = glm::vec3(0.0, 0.0, 0.0);
+    FeatureSample feature;
+    float sum_luminance = 0.0f, sum_luminance_sq = 0.0f;
+
+    void add(const glm::vec3 &sampled) {
+        color += sampled;
+        float l = luminance(sampled);
+        sum_luminance += l;
+        sum_luminance_sq += l * l;
+    }
+
+    void store(FrameBuffer &frame, size_t i, int32_t samples) const {
+        frame.color[i] = color / static_cast<float>(samples);
+
+        if (frame.has_features) {
+            float n = static_cast<float>(samples);
+            float mean = sum_luminance / n;
+            // variance of the pixel mean, not of a single sample
+            frame.variance[i] = std::max(0.0f, sum_luminance_sq / n - mean * mean) / n;
+            frame.albedo[i] = feature.albedo / n;
+            float normal_length = glm::length(feature.normal);
+            frame.normal[i] = normal_length > 0.0f ? feature.normal / normal_length : glm::vec3(0.0, 0.0, 0.0);
+            frame.depth[i] = feature.depth / n;
+        }
+    }
+};
+
+// the diffuse vertex a ray was scattered from, when that vertex also sampled lights directly
+struct ScatterVertex {
+    glm::vec3 point = glm::vec3(0.0, 0.0, 0.0);
+    glm::vec3 normal = glm::vec3(0.0, 0.0, 0.0);
+    float pdf = 0.0f;   // solid angle density of the scattered direction, 0 if nothing was sampled directly
+};
+
+struct CameraPose {
+    glm::vec3 center;
+    glm::vec3 direction;
+    float fov;
+    float focal_distance;
+};
+
+// rows [h_begin, h_end) and columns [w_begin, w_end) of the image
+struct Region {
+    int32_t h_begin, h_end, w_begin, w_end;
+
+    int32_t height() const { return h_end - h_begin; }
+    int32_t width() const { return w_end - w_begin; }
+};
+
+// a tile of one view, or of two coherent views traced together (see render_views)
+struct ViewTile {
+    int32_t view;
+    int32_t views;
+    Region region;
+};
+
+struct RayCount {
+    uint64_t primary = 0;
+    uint64_t secondary = 0;
+    uint64_t shadow = 0;
+
+    uint64_t total() const { return primary + secondary + shadow; }
+};
 
 class PerspectiveCamera {
     int32_t height, width, samples, max_depth;
-    float focal_distance, defocus_angle;
-    glm::vec3 center, pixel00, du, dv, disk_u, disk_v;
+    uint32_t seed = 0;
+    bool heatmap = false;
+    bool denoise = false;
+    DenoiseConfig denoise_config;
+    TelemetryConfig telemetry_config;
+    RayCount ray_count;
+    ThreadPool *pool = nullptr;
+    const WorkerPlacement *placement = nullptr;
+    HitCache *hit_cache = nullptr;
+    bool specialize = true;
+    SamplerMode sampler_mode = SamplerMode::Sobol;
+    float fov, focal_distance, defocus_angle;
+    glm::vec3 center, direction, up, pixel00, du, dv, disk_u, disk_v;
 
 public:
     PerspectiveCamera() {}
@@ -39,6 +137,9 @@ public:
         this->focal_distance = focal_distance;
         this->defocus_angle = defocus_angle;
         this->center = center;
+        this->direction = direction;
+        this->up = up;
+        this->fov = fov;
         float widthf = static_cast<float>(width);
         float heightf = static_cast<float>(height);
 
@@ -55,94 +156,349 @@ public:
                     - dv * (heightf / 2.0f);
     }
 
-    void render_subroutine(const BVH& bvh, const World& world, const int32_t num_process, const int32_t worker_id, std::vector<glm::vec3> &ret) {
-        for (int32_t i = worker_id; i < height * width; i += num_process) {
-            int32_t h = i / width;
-            int32_t w = i % width;
+    // moves the camera, keeping resolution, lens and sampling settings
+    void setPose(const CameraPose &pose) {
+        setCamera(pose.center, pose.direction, up, height, width, pose.fov, pose.focal_distance, defocus_angle, samples, max_depth);
+    }
 
-            if (worker_id == 0){
-                std::clog << "\rPixels processed: " << i << " out of " << height * width << std::flush;
-            }
+    CameraPose getPose() const {
+        return CameraPose{center, direction, fov, focal_distance};
+    }
+
+    // left and right eye of a parallel stereo rig around this pose, eye_distance apart
+    std::vector<CameraPose> stereoPoses(float eye_distance) const {
+        glm::vec3 right = glm::normalize(glm::cross(direction, up)) * (eye_distance / 2.0f);
+        return {
+            CameraPose{center - right, direction, fov, focal_distance},
+            CameraPose{center + right, direction, fov, focal_distance}
+        };
+    }
+
+    // render on a persistent pool instead of starting threads per call, the pool must outlive the camera's renders
+    void setThreadPool(ThreadPool *pool) {
+        this->pool = pool;
+    }
+
+    // pin workers and give each its NUMA node's copy of the BVH, the placement must outlive the camera's renders
+    void setPlacement(const WorkerPlacement *placement) {
+        this->placement = placement;
+    }
+
+    // record first hits into the cache, or take them from it instead of tracing primary rays
+    void setHitCache(HitCache *hit_cache) {
+        this->hit_cache = hit_cache;
+    }
+
+    // hash of everything that decides the first hit of each sample: camera, sample sequence and geometry
+    uint64_t primaryHitHash(const World &world) const {
+        GeometryHash hash;
+        hash.add(center);
+        hash.add(direction);
+        hash.add(up);
+        hash.add(fov);
+        hash.add(focal_distance);
+        hash.add(defocus_angle);
+        hash.add(seed);
+        hash.add(sampler_mode);
+        hash.add(world.get_objects().size());
+        for (const Object *obj : world.get_objects()) {
+            obj->hash_geometry(hash);
+        }
+        return hash.value;
+    }
 
-            glm::vec3 pixel(0.0, 0.0, 0.0);
+    // pick a render kernel compiled for this scene's features (see kernel.h), or always use the generic one
+    void setSpecialize(bool specialize) {
+        this->specialize = specialize;
+    }
+
+    // sequence behind pixel jitter, lens and bounce decisions, see sampler.h
+    void setSampler(SamplerMode sampler_mode) {
+        this->sampler_mode = sampler_mode;
+    }
+
+    void setSamples(int32_t samples, int32_t max_depth) {
+        this->samples = samples;
+        this->max_depth = max_depth;
+    }
+
+    void setSeed(uint32_t seed) {
+        this->seed = seed;
+    }
+
+    // render traversal cost per pixel as false colour instead of radiance, needs RAY_STATS
+    void setHeatmap(bool heatmap) {
+        this->heatmap = heatmap;
+    }
+
+    // filter the frame with the a-trous denoiser guided by first-hit albedo, normal and depth
+    void setDenoise(bool denoise, const DenoiseConfig &denoise_config = DenoiseConfig()) {
+        this->denoise = denoise;
+        this->denoise_config = denoise_config;
+    }
+
+    void setTelemetry(const TelemetryConfig &telemetry_config) {
+        this->telemetry_config = telemetry_config;
+    }
+
+    int32_t getHeight() const { return height; }
+    int32_t getWidth() const { return width; }
+    int32_t getSamples() const { return samples; }
+    int32_t getMaxDepth() const { return max_depth; }
+
+    // rays traced by the last render call, summed over all workers
+    const RayCount& getRayCount() const { return ray_count; }
+
+    template <typename K>
+    void render_subroutine(const BVH& bvh, const World& world, const int32_t num_process, const int32_t worker_id, const Region region, FrameBuffer &frame, RayCount &count, Telemetry &telemetry) {
+        RAY_TRACE_SCOPE_ARG("render worker", "worker", worker_id);
+        // mix the region in, so tiles rendered separately do not repeat each other's noise
+        uint32_t region_seed = static_cast<uint32_t>(region.h_begin) * 73856093u ^ static_cast<uint32_t>(region.w_begin) * 19349663u;
+        seed_random(seed * 7919u + static_cast<uint32_t>(worker_id) + region_seed);
+
+        // keyed by absolute pixel coordinates, so the image does not depend on how it was split up
+        Sampler sampler(sampler_mode, seed);
+        Sampler::current() = &sampler;
+
+        uint64_t pixels_done = 0;
+        int32_t region_width = region.width();
+        int32_t region_pixels = region.height() * region_width;
+
+        for (int32_t i = worker_id; i < region_pixels; i += num_process) {
+            int32_t h = region.h_begin + i / region_width;
+            int32_t w = region.w_begin + i % region_width;
+
+            PixelAccumulator pixel;
+            uint64_t cost_before = thread_stats().cost();
 
             for (int32_t s = 0; s < samples; ++s) {
-                Ray r = this->get_ray(h, w);
-                glm::vec3 sampled = get_color(bvh, world, r, 50);
-                pixel += sampled;
+                sampler.start_sample(h, w, s);
+                Ray r = this->get_ray<K>(h, w);
+
+                BVHHit primary_hit;
+                if (hit_cache != nullptr && hit_cache->replay()) {
+                    primary_hit = hit_cache->load(hit_cache->index(h, w, s));
+                } else {
+                    ++count.primary;
+                    primary_hit = bvh.hit(world, r, 0.001f, std::numeric_limits<float>::max());
+                    if (hit_cache != nullptr) {
+                        hit_cache->store(hit_cache->index(h, w, s), primary_hit);
+                    }
+                }
+                pixel.add(shade<K>(bvh, world, r, primary_hit, max_depth, count, frame.has_features ? &pixel.feature : nullptr));
             }
 
-            pixel /= samples;
+            ++pixels_done;
+            telemetry.update(worker_id, pixels_done, pixels_done * samples, count.total());
+
+            if (heatmap) {
+                // average traversal work per sample, mapped to colour after all workers finish
+                float cost = static_cast<float>(thread_stats().cost() - cost_before) / static_cast<float>(samples);
+                frame.color[i] = glm::vec3(cost, 0.0, 0.0);
+                continue;
+            }
 
-            // linear to gamma
-            pixel.x = pixel.x > 0.0f ? std::sqrt(pixel.x) : 0.0f;
-            pixel.y = pixel.y > 0.0f ? std::sqrt(pixel.y) : 0.0f;
-            pixel.z = pixel.z > 0.0f ? std::sqrt(pixel.z) : 0.0f;
+            pixel.store(frame, i, samples);
+        }
 
-            // clamp
-            pixel.x = std::clamp(pixel.x, 0.0f, 1.0f);
-            pixel.y = std::clamp(pixel.y, 0.0f, 1.0f);
-            pixel.z = std::clamp(pixel.z, 0.0f, 1.0f);
+        Sampler::current() = nullptr;
+        GlobalStats::instance().merge_thread();
+    }
 
-            ret[i/num_process] = pixel;
+    // pulls tiles of render_views until none are left, cameras[v] looks through pose v
+    template <typename K>
+    void render_views_subroutine(const BVH& bvh, const World& world, const std::vector<PerspectiveCamera> &cameras, const std::vector<ViewTile> &tiles, std::atomic<size_t> &next_tile, std::vector<FrameBuffer> &frames, const int32_t worker_id, RayCount &count, Telemetry &telemetry) {
+        RAY_TRACE_SCOPE_ARG("render worker", "worker", worker_id);
+        Sampler sampler(sampler_mode, seed);
+        Sampler::current() = &sampler;
+
+        uint64_t pixels_done = 0;
+        for (size_t t = next_tile.fetch_add(1); t < tiles.size(); t = next_tile.fetch_add(1)) {
+            const ViewTile &tile = tiles[t];
+            RAY_TRACE_SCOPE_ARG("tile", "view", tile.view);
+            // which worker takes a tile varies, so the random stream is keyed by the tile instead
+            seed_random(seed * 7919u + static_cast<uint32_t>(t) * 2654435761u);
+
+            for (int32_t h = tile.region.h_begin; h < tile.region.h_end; ++h) {
+                for (int32_t w = tile.region.w_begin; w < tile.region.w_end; ++w) {
+                    PixelAccumulator pixel[2];
+
+                    for (int32_t s = 0; s < samples; ++s) {
+                        // every view draws the same sample, as if it were rendered alone
+                        Ray r[2];
+                        for (int32_t v = 0; v < tile.views; ++v) {
+                            sampler.start_sample(h, w, s);
+                            r[v] = cameras[tile.view + v].template get_ray<K>(h, w);
+                        }
+
+                        // the eyes' rays run close together, the second finds the nodes the first just fetched
+                        BVHHit primary_hit[2];
+                        for (int32_t v = 0; v < tile.views; ++v) {
+                            ++count.primary;
+                            primary_hit[v] = bvh.hit(world, r[v], 0.001f, std::numeric_limits<float>::max());
+                        }
+
+                        for (int32_t v = 0; v < tile.views; ++v) {
+                            FrameBuffer &frame = frames[tile.view + v];
+                            pixel[v].add(cameras[tile.view + v].template shade<K>(bvh, world, r[v], primary_hit[v], max_depth, count, frame.has_features ? &pixel[v].feature : nullptr));
+                        }
+                    }
+
+                    size_t i = static_cast<size_t>(h) * width + w;
+                    for (int32_t v = 0; v < tile.views; ++v) {
+                        pixel[v].store(frames[tile.view + v], i, samples);
+                    }
+
+                    pixels_done += tile.views;
+                    telemetry.update(worker_id, pixels_done, pixels_done * samples, count.total());
+                }
+            }
         }
+
+        Sampler::current() = nullptr;
+        GlobalStats::instance().merge_thread();
     }
 
     void render(std::vector<uint8_t> &image, const World& world) {
         BVH bvh(world);
+        render(image, world, bvh);
+    }
 
-        int32_t num_process = std::thread::hardware_concurrency();
-        std::vector<std::vector<glm::vec3>> ret;
-        std::vector<std::thread> process;
+    void render(std::vector<uint8_t> &image, const World& world, const BVH& bvh) {
+        int32_t num_process = pool != nullptr ? pool->size() : static_cast<int32_t>(std::thread::hardware_concurrency());
 
-        int32_t ret_size = (height * width + num_process - 1) / num_process;
+        FrameBuffer frame(height, width, needsFeatures());
+        render(frame, world, bvh, num_process);
+        finish(frame, image, num_process);
+    }
 
-        ret.resize(num_process);
-        for(int32_t p = 0; p < num_process; ++p) {
-            ret[p].resize(ret_size);
-        }
-        process.resize(num_process);
+    // whether frames rendered for this camera should capture first-hit features
+    bool needsFeatures() const {
+        return denoise && !heatmap;
+    }
+
+    // post-processing of a traced frame: heatmap colouring or denoising, then tonemapping to rgba8
+    void finish(FrameBuffer &frame, std::vector<uint8_t> &image, int32_t num_process) const {
+        if (heatmap) {
+            float max_cost = 0.0f;
+            for (const glm::vec3 &cost : frame.color) {
+                max_cost = std::max(max_cost, cost.x);
+            }
+            std::clog << "heatmap: max cost " << max_cost << " nodes + primitives per sample" << std::endl;
 
-        for(int32_t p = 0; p < num_process; ++p) {
-            process[p] = std::thread(
-                &PerspectiveCamera::render_subroutine,
-                this,
-                bvh,
-                world,
-                num_process,
-                p,
-                std::ref(ret[p])
-            );
+            for (glm::vec3 &pixel : frame.color) {
+                pixel = heatmap_color(max_cost > 0.0f ? pixel.x / max_cost : 0.0f);
+            }
+            frame.to_rgba8(image, false);
+            return;
         }
 
-        for(int32_t p = 0; p < num_process; ++p) {
-            process[p].join();
+        if (denoise) {
+            RAY_TRACE_SCOPE("denoise");
+            ATrousDenoiser(denoise_config).apply(frame, num_process, pool);
         }
 
-        for(int32_t h = 0; h < height; ++h) {
-            for(int32_t w = 0; w < width; ++w) {
-                int32_t worker_id = (h * width + w) % num_process;
+        RAY_TRACE_SCOPE("tonemap");
+        frame.to_rgba8(image);
+    }
+
+    // traces the whole frame into linear radiance, features are captured if the frame has them
+    void render(FrameBuffer &frame, const World& world, const BVH& bvh, int32_t num_process) {
+        render(frame, world, bvh, num_process, Region{0, height, 0, width});
+    }
 
-                glm::vec3 pixel = ret[worker_id][(h * width + w)/num_process];
+    // traces one region of the image into a frame of the region's size
+    void render(FrameBuffer &frame, const World& world, const BVH& bvh, int32_t num_process, const Region &region) {
+        RAY_TRACE_SCOPE_ARG("render", "row", region.h_begin);
+        std::vector<RayCount> counts(num_process);
 
-                uint8_t ir = static_cast<uint8_t>(255.999f * pixel.x);
-                uint8_t ig = static_cast<uint8_t>(255.999f * pixel.y);
-                uint8_t ib = static_cast<uint8_t>(255.999f * pixel.z);
+        GlobalStats::instance().reset();
+
+        Telemetry telemetry(telemetry_config, num_process, static_cast<uint64_t>(region.height()) * region.width());
+        telemetry.start();
+
+        auto run = [&]<typename K>() {
+            // world and bvh are shared by reference, workers never copy the scene
+            run_workers(pool, num_process, [&](int32_t p) {
+                const BVH &worker_bvh = placement != nullptr ? placement->bind_worker(p, bvh) : bvh;
+                render_subroutine<K>(worker_bvh, world, num_process, p, region, frame, counts[p], telemetry);
+            });
+        };
+
+        dispatch(world, run);
+        telemetry.stop();
+        sum_ray_counts(counts);
+    }
 
-                image[h * width * 4 + w * 4 + 0] = ir;
-                image[h * width * 4 + w * 4 + 1] = ig;
-                image[h * width * 4 + w * 4 + 2] = ib;
-                image[h * width * 4 + w * 4 + 3] = 255;
+    /*
+    renders every pose in one pass, into frames[v] for poses[v] at this camera's resolution,
+    lens and sampling. the views share the BVH, the workers and one queue of 16x16 tiles, so a
+    worker that finishes one view's tiles moves on to the next view's instead of waiting.
+
+    neighbouring poses that look the same way from nearby, such as the two eyes of
+    stereoPoses, are paired: a tile of the pair traces each sample's primary ray for one eye
+    right after the other's, while the same nodes are in cache. every view comes out as it
+    would from render() with that pose
+    */
+    void render_views(std::vector<FrameBuffer> &frames, const std::vector<CameraPose> &poses, const World& world, const BVH& bvh, int32_t num_process) {
+        RAY_TRACE_SCOPE_ARG("render views", "views", poses.size());
+        int32_t view_count = static_cast<int32_t>(poses.size());
+
+        std::vector<PerspectiveCamera> cameras(poses.size(), *this);
+        frames.clear();
+        for (int32_t v = 0; v < view_count; ++v) {
+            cameras[v].setPose(poses[v]);
+            frames.emplace_back(height, width, needsFeatures());
+        }
+
+        constexpr int32_t tile_size = 16;
+        std::vector<ViewTile> tiles;
+        for (int32_t v = 0; v < view_count; ) {
+            int32_t views = v + 1 < view_count && coherent(poses[v], poses[v + 1]) ? 2 : 1;
+            for (int32_t h = 0; h < height; h += tile_size) {
+                for (int32_t w = 0; w < width; w += tile_size) {
+                    tiles.push_back(ViewTile{v, views, Region{h, std::min(height, h + tile_size), w, std::min(width, w + tile_size)}});
+                }
             }
+            v += views;
         }
+
+        std::vector<RayCount> counts(num_process);
+        GlobalStats::instance().reset();
+
+        Telemetry telemetry(telemetry_config, num_process, static_cast<uint64_t>(height) * width * view_count);
+        telemetry.start();
+
+        std::atomic<size_t> next_tile = 0;
+        auto run = [&]<typename K>() {
+            run_workers(pool, num_process, [&](int32_t p) {
+                const BVH &worker_bvh = placement != nullptr ? placement->bind_worker(p, bvh) : bvh;
+                render_views_subroutine<K>(worker_bvh, world, cameras, tiles, next_tile, frames, p, counts[p], telemetry);
+            });
+        };
+
+        dispatch(world, run);
+        telemetry.stop();
+        sum_ray_counts(counts);
+    }
+
+    // whether two views see nearly the same rays: same lens, directions within ~5 degrees, close together
+    static bool coherent(const CameraPose &a, const CameraPose &b) {
+        return a.fov == b.fov &&
+               glm::dot(glm::normalize(a.direction), glm::normalize(b.direction)) > 0.996f &&
+               glm::length(a.center - b.center) < 0.1f * std::min(a.focal_distance, b.focal_distance);
     }
 
-    Ray get_ray(int32_t h, int32_t w) {
-        float random_h = static_cast<float>(h) + random_float();
-        float random_w = static_cast<float>(w) + random_float();
+    template <typename K = GenericKernel>
+    Ray get_ray(int32_t h, int32_t w) const {
+        glm::vec2 jitter = random_2d();
+        float random_h = static_cast<float>(h) + jitter.x;
+        float random_w = static_cast<float>(w) + jitter.y;
         glm::vec3 origin;
 
-        if (defocus_angle <= 0) {
+        bool defocus = K::specialized ? K::defocus : defocus_angle > 0;
+
+        if (!defocus) {
             origin = center;
         } else {
             glm::vec2 p = random_disk();
@@ -155,28 +511,170 @@ public:
         return Ray(origin, direction);
     }
 
-    glm::vec3 get_color(const BVH &bvh, const World &world, const Ray &r, int32_t depth) const {
+    template <typename K = GenericKernel>
+    glm::vec3 get_color(const BVH &bvh, const World &world, const Ray &r, int32_t depth, RayCount &count, FeatureSample *feature = nullptr, const ScatterVertex &from = ScatterVertex()) const {
         if (depth <= 0) {
+            RAY_STATS_END_PATH(max_depth, Termination::MaxDepth);
             return glm::vec3(0.0, 0.0, 0.0);
         }
 
         BVHHit bvh_hit = bvh.hit(world, r, 0.001f, std::numeric_limits<float>::max());
+        return shade<K>(bvh, world, r, bvh_hit, depth, count, feature, from);
+    }
 
+    /*
+    radiance along r, given where it hits first. from is the vertex r was scattered from, its
+    pdf is 0 unless it also sampled lights directly
+    */
+    template <typename K = GenericKernel>
+    glm::vec3 shade(const BVH &bvh, const World &world, const Ray &r, const BVHHit &bvh_hit, int32_t depth, RayCount &count, FeatureSample *feature = nullptr, const ScatterVertex &from = ScatterVertex()) const {
         if (!bvh_hit.is_hit) {
-            return glm::vec3(0.0, 0.0, 0.0);
+            RAY_STATS_END_PATH(max_depth - depth, Termination::Escaped);
+            return escaped(world, r, from.pdf);
         }
 
         const Object* obj = bvh_hit.obj;
         ColorHit hit = obj->hit(bvh_hit, r, 0.001f, std::numeric_limits<float>::max());
 
+        if (feature != nullptr) {
+            feature->albedo += hit.mat->surface_albedo(hit);
+            feature->normal += hit.normal;
+            feature->depth += bvh_hit.t;
+        }
+
+        if (Sampler *sampler = Sampler::current()) {
+            sampler->start_vertex(max_depth - depth);
+        }
+
         // bool is_scatter, glm::vec3 attenuation, Ray ray_scatter
-        const auto& [is_scatter, attenuation, ray_scatter] = hit.mat->scatter(r, hit);
-        const glm::vec3 color_emitted = hit.mat->emitted(hit);
+        const auto& [is_scatter, attenuation, ray_scatter] = kernel_scatter<K>(hit.mat.get(), r, hit);
+        const glm::vec3 color_emitted = kernel_emitted<K>(hit.mat.get(), hit);
 
         if (!is_scatter) {
-            return color_emitted;
+            RAY_STATS_END_PATH(max_depth - depth, Termination::Absorbed);
+            return color_emitted * emitted_weight<K>(world, bvh_hit, hit, from);
+        }
+
+        // diffuse vertices also sample the environment and the scene's lights, unless the path ends here anyway
+        glm::vec3 direct(0.0, 0.0, 0.0);
+        ScatterVertex next;
+        if constexpr (!K::specialized || K::has(MaterialKind::Lambertian)) {
+            if ((world.environment() != nullptr || world.lights() != nullptr) && hit.mat->kind == MaterialKind::Lambertian && depth > 1) {
+                if (world.environment() != nullptr) {
+                    direct += sample_environment(bvh, world, hit, attenuation, count);
+                }
+                if (world.lights() != nullptr) {
+                    direct += sample_lights<K>(bvh, world, hit, attenuation, count);
+                }
+                next.point = hit.point;
+                next.normal = hit.normal;
+                next.pdf = std::max(0.0f, glm::dot(hit.normal, ray_scatter.direction)) / std::numbers::pi_v<float>;
+            }
+        }
+
+        if (depth > 1) {
+            ++count.secondary;
+        }
+        return color_emitted + direct + attenuation * get_color<K>(bvh, world, ray_scatter, depth - 1, count, nullptr, next);
+    }
+
+private:
+    // runs run<K>() with the kernel compiled for this scene's features, or the generic one
+    template <typename F>
+    void dispatch(const World &world, F &&run) const {
+        if (specialize) {
+            dispatch_kernel(KernelFeatures::detect(world, defocus_angle), run);
+        } else {
+            run.template operator()<GenericKernel>();
+        }
+    }
+
+    void sum_ray_counts(const std::vector<RayCount> &counts) {
+        ray_count = RayCount();
+        for (const RayCount &count : counts) {
+            ray_count.primary += count.primary;
+            ray_count.secondary += count.secondary;
+            ray_count.shadow += count.shadow;
+        }
+    }
+
+    // weight of the strategy with density a against one with density b, https://graphics.stanford.edu/papers/veach_thesis/
+    static float power_heuristic(float a, float b) {
+        return a * a / (a * a + b * b);
+    }
+
+    // environment light seen along an escaping ray, scatter_pdf as in shade
+    glm::vec3 escaped(const World &world, const Ray &r, float scatter_pdf) const {
+        const EnvironmentMap *environment = world.environment();
+        if (environment == nullptr) {
+            return glm::vec3(0.0, 0.0, 0.0);
+        }
+        float light_pdf;
+        glm::vec3 radiance = environment->lookup(r.direction, light_pdf);
+        return scatter_pdf > 0.0f ? radiance * power_heuristic(scatter_pdf, light_pdf) : radiance;
+    }
+
+    // one shadow ray from a diffuse hit towards the environment, weighted against the diffuse bounce finding the same direction
+    glm::vec3 sample_environment(const BVH &bvh, const World &world, const ColorHit &hit, const glm::vec3 &albedo, RayCount &count) const {
+        glm::vec2 u_texel = random_2d();
+        glm::vec2 u_direction = random_2d();
+
+        glm::vec3 direction;
+        float light_pdf;
+        glm::vec3 radiance = world.environment()->sample(u_texel, u_direction, direction, light_pdf);
+        float cos_theta = glm::dot(hit.normal, direction);
+        if (cos_theta <= 0.0f || light_pdf <= 0.0f) {
+            return glm::vec3(0.0, 0.0, 0.0);
+        }
+
+        ++count.shadow;
+        if (bvh.hit(world, Ray(hit.point, direction), 0.001f, std::numeric_limits<float>::max()).is_hit) {
+            return glm::vec3(0.0, 0.0, 0.0);
         }
 
-        return color_emitted + attenuation * get_color(bvh, world, ray_scatter, depth - 1);
+        float scatter_pdf = cos_theta / std::numbers::pi_v<float>;
+        return albedo * (scatter_pdf / light_pdf * power_heuristic(light_pdf, scatter_pdf)) * radiance;
+    }
+
+    // one shadow ray from a diffuse hit towards a light picked from the light BVH, weighted against the diffuse bounce hitting it
+    template <typename K>
+    glm::vec3 sample_lights(const BVH &bvh, const World &world, const ColorHit &hit, const glm::vec3 &albedo, RayCount &count) const {
+        glm::vec2 u_light = random_2d();
+        glm::vec2 u_point = random_2d();
+
+        LightSample sample;
+        if (!world.lights()->sample(hit.point, hit.normal, u_light, u_point, sample)) {
+            return glm::vec3(0.0, 0.0, 0.0);
+        }
+        float cos_theta = glm::dot(hit.normal, sample.direction);
+        if (cos_theta <= 0.0f || sample.pdf <= 0.0f) {
+            return glm::vec3(0.0, 0.0, 0.0);
+        }
+
+        ++count.shadow;
+        Ray shadow_ray(hit.point, sample.direction);
+        BVHHit shadow_hit = bvh.hit(world, shadow_ray, 0.001f, std::numeric_limits<float>::max());
+        if (!LightBVH::reached(sample, shadow_hit)) {
+            return glm::vec3(0.0, 0.0, 0.0);
+        }
+
+        ColorHit light_hit = shadow_hit.obj->hit(shadow_hit, shadow_ray, 0.001f, std::numeric_limits<float>::max());
+        glm::vec3 radiance = kernel_emitted<K>(light_hit.mat.get(), light_hit);
+
+        float scatter_pdf = cos_theta / std::numbers::pi_v<float>;
+        return albedo * (scatter_pdf / sample.pdf * power_heuristic(sample.pdf, scatter_pdf)) * radiance;
+    }
+
+    // MIS weight of light emitted at a hit, against the light BVH having picked it from the previous vertex
+    template <typename K>
+    float emitted_weight(const World &world, const BVHHit &bvh_hit, const ColorHit &hit, const ScatterVertex &from) const {
+        if constexpr (K::specialized && !K::has(MaterialKind::DiffuseLight)) {
+            return 1.0f;
+        }
+        if (from.pdf <= 0.0f || world.lights() == nullptr) {
+            return 1.0f;
+        }
+        float light_pdf = world.lights()->pdf(from.point, from.normal, bvh_hit, hit.point);
+        return light_pdf > 0.0f ? power_heuristic(from.pdf, light_pdf) : 1.0f;
     }
 };
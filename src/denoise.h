@@ -0,0 +1,255 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <framebuffer.h>
+#include <thread_pool.h>
+
+/*
+edge-avoiding a-trous wavelet denoiser
+https://jo.dreggn.org/home/2010_atrous.pdf, with the variance guided luminance weight of
+https://research.nvidia.com/publication/2017-07_spatiotemporal-variance-guided-filtering
+
+the color is demodulated by the first-hit albedo so textures stay sharp, filtered with a
+5x5 b3-spline kernel whose taps spread 1, 2, 4, ... pixels apart, and remodulated.
+taps are weighted down across normal, depth, albedo and luminance edges.
+*/
+
+struct DenoiseConfig {
+    int32_t iterations = 5;
+    float sigma_luminance = 4.0f;
+    float sigma_normal = 32.0f;     // exponent on the normal dot product
+    float sigma_depth = 1.0f;
+    float sigma_albedo = 0.5f;
+    int32_t tile_size = 64;
+};
+
+class ATrousDenoiser {
+    DenoiseConfig config;
+
+    struct Buffers {
+        std::vector<glm::vec3> irradiance;
+        std::vector<float> variance;
+    };
+
+public:
+    ATrousDenoiser() {}
+    ATrousDenoiser(const DenoiseConfig &config) : config(config) {}
+
+    void apply(FrameBuffer &frame, int32_t num_threads, ThreadPool *pool = nullptr) const {
+        if (!frame.has_features) {
+            return;
+        }
+
+        int32_t height = frame.height;
+        int32_t width = frame.width;
+        size_t n = static_cast<size_t>(height) * width;
+
+        // demodulate
+        Buffers current;
+        current.irradiance.resize(n);
+        current.variance.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            glm::vec3 albedo = glm::max(frame.albedo[i], glm::vec3(0.01f, 0.01f, 0.01f));
+            current.irradiance[i] = frame.color[i] / albedo;
+            float albedo_luminance = luminance(albedo);
+            current.variance[i] = frame.variance[i] / (albedo_luminance * albedo_luminance);
+        }
+
+        // with few samples many pixels never saw a light and report zero variance, which would pin
+        // them in place, so fall back to the variance of their neighbourhood
+        std::vector<float> spatial = spatial_variance(current.irradiance, height, width);
+        for (size_t i = 0; i < n; ++i) {
+            current.variance[i] = std::max(current.variance[i], spatial[i]);
+        }
+
+        std::vector<float> depth_gradient = compute_depth_gradient(frame);
+
+        Buffers next;
+        next.irradiance.resize(n);
+        next.variance.resize(n);
+
+        for (int32_t iteration = 0; iteration < config.iterations; ++iteration) {
+            int32_t step = 1 << iteration;
+            std::vector<float> filtered_variance = blur_variance(current.variance, height, width);
+
+            for_each_tile(height, width, num_threads, pool, [&](int32_t h0, int32_t h1, int32_t w0, int32_t w1) {
+                for (int32_t h = h0; h < h1; ++h) {
+                    for (int32_t w = w0; w < w1; ++w) {
+                        filter_pixel(frame, current, filtered_variance, depth_gradient, next, h, w, step);
+                    }
+                }
+            });
+
+            std::swap(current, next);
+        }
+
+        // remodulate
+        for (size_t i = 0; i < n; ++i) {
+            frame.color[i] = current.irradiance[i] * glm::max(frame.albedo[i], glm::vec3(0.01f, 0.01f, 0.01f));
+        }
+    }
+
+private:
+    void filter_pixel(
+        const FrameBuffer &frame,
+        const Buffers &in,
+        const std::vector<float> &filtered_variance,
+        const std::vector<float> &depth_gradient,
+        Buffers &out,
+        int32_t h,
+        int32_t w,
+        int32_t step
+    ) const {
+        static constexpr float kernel[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+        int32_t height = frame.height;
+        int32_t width = frame.width;
+        size_t p = static_cast<size_t>(h) * width + w;
+
+        const glm::vec3 &normal_p = frame.normal[p];
+        const glm::vec3 &albedo_p = frame.albedo[p];
+        float depth_p = frame.depth[p];
+        float luminance_p = luminance(in.irradiance[p]);
+        float luminance_scale = 1.0f / (config.sigma_luminance * std::sqrt(std::max(filtered_variance[p], 0.0f)) + 1e-6f);
+        float depth_scale = 1.0f / (config.sigma_depth * depth_gradient[p] * static_cast<float>(step) + 1e-6f);
+        bool background_p = normal_p.x == 0.0f && normal_p.y == 0.0f && normal_p.z == 0.0f;
+
+        glm::vec3 sum(0.0, 0.0, 0.0);
+        float sum_variance = 0.0f;
+        float sum_weight = 0.0f;
+
+        for (int32_t dy = -2; dy <= 2; ++dy) {
+            int32_t qh = h + dy * step;
+            if (qh < 0 || qh >= height) {
+                continue;
+            }
+
+            for (int32_t dx = -2; dx <= 2; ++dx) {
+                int32_t qw = w + dx * step;
+                if (qw < 0 || qw >= width) {
+                    continue;
+                }
+
+                size_t q = static_cast<size_t>(qh) * width + qw;
+                float weight = kernel[std::abs(dy)] * kernel[std::abs(dx)];
+
+                if (q != p) {
+                    const glm::vec3 &normal_q = frame.normal[q];
+                    bool background_q = normal_q.x == 0.0f && normal_q.y == 0.0f && normal_q.z == 0.0f;
+                    if (background_p != background_q) {
+                        continue;
+                    }
+
+                    float weight_normal = background_p ? 1.0f : std::pow(std::max(0.0f, glm::dot(normal_p, normal_q)), config.sigma_normal);
+                    float weight_depth = std::exp(-std::fabs(depth_p - frame.depth[q]) * depth_scale);
+
+                    glm::vec3 albedo_difference = albedo_p - frame.albedo[q];
+                    float weight_albedo = std::exp(-glm::dot(albedo_difference, albedo_difference) / (config.sigma_albedo * config.sigma_albedo));
+
+                    float weight_luminance = std::exp(-std::fabs(luminance_p - luminance(in.irradiance[q])) * luminance_scale);
+
+                    weight *= weight_normal * weight_depth * weight_albedo * weight_luminance;
+                }
+
+                sum += in.irradiance[q] * weight;
+                sum_variance += in.variance[q] * weight * weight;
+                sum_weight += weight;
+            }
+        }
+
+        out.irradiance[p] = sum / sum_weight;
+        out.variance[p] = sum_variance / (sum_weight * sum_weight);
+    }
+
+    // 3x3 gaussian over the variance, the per-pixel estimate is too noisy to steer the filter alone
+    static std::vector<float> blur_variance(const std::vector<float> &variance, int32_t height, int32_t width) {
+        static constexpr float kernel[2] = {1.0f / 2.0f, 1.0f / 4.0f};
+
+        std::vector<float> ret(variance.size());
+        for (int32_t h = 0; h < height; ++h) {
+            for (int32_t w = 0; w < width; ++w) {
+                float sum = 0.0f;
+                float sum_weight = 0.0f;
+                for (int32_t dy = -1; dy <= 1; ++dy) {
+                    for (int32_t dx = -1; dx <= 1; ++dx) {
+                        int32_t qh = h + dy;
+                        int32_t qw = w + dx;
+                        if (qh < 0 || qh >= height || qw < 0 || qw >= width) {
+                            continue;
+                        }
+                        float weight = kernel[std::abs(dy)] * kernel[std::abs(dx)];
+                        sum += variance[qh * width + qw] * weight;
+                        sum_weight += weight;
+                    }
+                }
+                ret[h * width + w] = sum / sum_weight;
+            }
+        }
+        return ret;
+    }
+
+    static std::vector<float> spatial_variance(const std::vector<glm::vec3> &irradiance, int32_t height, int32_t width) {
+        constexpr int32_t radius = 2;
+
+        std::vector<float> ret(irradiance.size());
+        for (int32_t h = 0; h < height; ++h) {
+            for (int32_t w = 0; w < width; ++w) {
+                float sum = 0.0f;
+                float sum_sq = 0.0f;
+                int32_t count = 0;
+                for (int32_t qh = std::max(h - radius, 0); qh <= std::min(h + radius, height - 1); ++qh) {
+                    for (int32_t qw = std::max(w - radius, 0); qw <= std::min(w + radius, width - 1); ++qw) {
+                        float l = luminance(irradiance[qh * width + qw]);
+                        sum += l;
+                        sum_sq += l * l;
+                        ++count;
+                    }
+                }
+                float mean = sum / static_cast<float>(count);
+                ret[h * width + w] = std::max(0.0f, sum_sq / static_cast<float>(count) - mean * mean);
+            }
+        }
+        return ret;
+    }
+
+    // largest depth change to a neighbouring pixel, so the depth weight adapts to slanted surfaces
+    static std::vector<float> compute_depth_gradient(const FrameBuffer &frame) {
+        int32_t height = frame.height;
+        int32_t width = frame.width;
+
+        std::vector<float> ret(static_cast<size_t>(height) * width);
+        for (int32_t h = 0; h < height; ++h) {
+            for (int32_t w = 0; w < width; ++w) {
+                float depth = frame.depth[h * width + w];
+                float gradient = 0.0f;
+                if (w + 1 < width) gradient = std::max(gradient, std::fabs(frame.depth[h * width + w + 1] - depth));
+                if (w > 0) gradient = std::max(gradient, std::fabs(frame.depth[h * width + w - 1] - depth));
+                if (h + 1 < height) gradient = std::max(gradient, std::fabs(frame.depth[(h + 1) * width + w] - depth));
+                if (h > 0) gradient = std::max(gradient, std::fabs(frame.depth[(h - 1) * width + w] - depth));
+                ret[h * width + w] = gradient;
+            }
+        }
+        return ret;
+    }
+
+    template <typename F>
+    void for_each_tile(int32_t height, int32_t width, int32_t num_threads, ThreadPool *pool, const F &f) const {
+        int32_t tiles_h = (height + config.tile_size - 1) / config.tile_size;
+        int32_t tiles_w = (width + config.tile_size - 1) / config.tile_size;
+        int32_t num_tiles = tiles_h * tiles_w;
+
+        std::atomic<int32_t> next_tile(0);
+        run_workers(pool, num_threads, [&](int32_t) {
+            for (int32_t tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+                int32_t h0 = (tile / tiles_w) * config.tile_size;
+                int32_t w0 = (tile % tiles_w) * config.tile_size;
+                f(h0, std::min(h0 + config.tile_size, height), w0, std::min(w0 + config.tile_size, width));
+            }
+        });
+    }
+};
@@ -0,0 +1,515 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <camera.h>
+#include <framebuffer.h>
+#include <scene.h>
+#include <thread_pool.h>
+#include <trace.h>
+
+/*
+distributed tile rendering
+
+the coordinator listens on a port and splits the frame into tiles. every worker that
+connects gets the job (scene name, resolution, sampling settings), loads the scene and
+builds its BVH once, then renders the tiles it is handed with all of its cores and sends
+back linear float results. the coordinator merges them into one FrameBuffer.
+
+a worker that disconnects has its outstanding tiles put back in the queue, and a tile that
+has been out longer than the timeout is handed out again; whichever copy arrives first wins.
+
+messages are a {type, size} header followed by a raw payload. both ends are expected to
+run the same build on the same architecture, so structs and floats go over the wire as is.
+*/
+
+enum class MessageType : uint32_t {
+    Job = 1,
+    Tile = 2,
+    Result = 3,
+    Done = 4
+};
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct JobMessage {
+    char scene[64];
+    int32_t height, width, samples, max_depth;
+    uint32_t seed;
+    int32_t has_features;
+    int32_t sampler;
+};
+
+struct TileMessage {
+    int32_t tile_id;
+    Region region;
+};
+
+class Connection {
+    int32_t fd = -1;
+
+public:
+    Connection() {}
+    explicit Connection(int32_t fd) : fd(fd) {}
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+    Connection(Connection &&other) : fd(other.fd) { other.fd = -1; }
+    Connection& operator=(Connection &&other) {
+        std::swap(fd, other.fd);
+        return *this;
+    }
+
+    ~Connection() {
+        close();
+    }
+
+    int32_t get_fd() const { return fd; }
+    bool is_open() const { return fd >= 0; }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    static Connection connect_to(const std::string &host, uint16_t port) {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo *result = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+            return Connection();
+        }
+
+        int32_t fd = -1;
+        for (addrinfo *ai = result; ai != nullptr; ai = ai->ai_next) {
+            fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+
+        if (fd >= 0) {
+            int32_t flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        }
+        return Connection(fd);
+    }
+
+    bool send_message(MessageType type, const void *payload, uint32_t size) {
+        MessageHeader header = {static_cast<uint32_t>(type), size};
+        return send_all(&header, sizeof(header)) && send_all(payload, size);
+    }
+
+    bool send_message(MessageType type, const void *payload0, uint32_t size0, const void *payload1, uint32_t size1) {
+        MessageHeader header = {static_cast<uint32_t>(type), size0 + size1};
+        return send_all(&header, sizeof(header)) && send_all(payload0, size0) && send_all(payload1, size1);
+    }
+
+    bool recv_message(MessageType &type, std::vector<uint8_t> &payload) {
+        MessageHeader header;
+        if (!recv_all(&header, sizeof(header))) {
+            return false;
+        }
+        type = static_cast<MessageType>(header.type);
+        payload.resize(header.size);
+        return recv_all(payload.data(), header.size);
+    }
+
+private:
+    bool send_all(const void *data, size_t size) {
+        const uint8_t *p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool recv_all(void *data, size_t size) {
+        uint8_t *p = static_cast<uint8_t*>(data);
+        while (size > 0) {
+            ssize_t n = ::recv(fd, p, size, 0);
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+};
+
+// floats per pixel of a tile result
+inline int32_t floats_per_pixel(bool has_features) {
+    // color, then variance, albedo, normal, depth
+    return has_features ? 3 + 1 + 3 + 3 + 1 : 3;
+}
+
+inline std::vector<float> pack_tile(const FrameBuffer &tile) {
+    std::vector<float> ret;
+    ret.reserve(tile.color.size() * floats_per_pixel(tile.has_features));
+    for (size_t i = 0; i < tile.color.size(); ++i) {
+        ret.insert(ret.end(), {tile.color[i].x, tile.color[i].y, tile.color[i].z});
+        if (tile.has_features) {
+            ret.push_back(tile.variance[i]);
+            ret.insert(ret.end(), {tile.albedo[i].x, tile.albedo[i].y, tile.albedo[i].z});
+            ret.insert(ret.end(), {tile.normal[i].x, tile.normal[i].y, tile.normal[i].z});
+            ret.push_back(tile.depth[i]);
+        }
+    }
+    return ret;
+}
+
+inline void unpack_tile(FrameBuffer &frame, const Region &region, const float *data) {
+    for (int32_t h = region.h_begin; h < region.h_end; ++h) {
+        for (int32_t w = region.w_begin; w < region.w_end; ++w) {
+            size_t i = static_cast<size_t>(h) * frame.width + w;
+            frame.color[i] = glm::vec3(data[0], data[1], data[2]);
+            data += 3;
+            if (frame.has_features) {
+                frame.variance[i] = data[0];
+                frame.albedo[i] = glm::vec3(data[1], data[2], data[3]);
+                frame.normal[i] = glm::vec3(data[4], data[5], data[6]);
+                frame.depth[i] = data[7];
+                data += 8;
+            }
+        }
+    }
+}
+
+struct CoordinatorConfig {
+    uint16_t port = 7700;
+    int32_t tile_size = 32;
+    int32_t tiles_in_flight = 2;    // per worker, so a worker never idles waiting for its next tile
+    double tile_timeout = 0.0;      // seconds before a tile is handed out again, 0 to only reassign on disconnect
+};
+
+class Coordinator {
+    using Clock = std::chrono::steady_clock;
+
+    struct WorkerState {
+        Connection connection;
+        std::vector<int32_t> tiles;
+        std::string name;
+    };
+
+    CoordinatorConfig config;
+    JobMessage job;
+
+    std::vector<Region> tiles;
+    std::vector<bool> done;
+    std::vector<Clock::time_point> issued_at;
+    std::deque<int32_t> pending;
+    int32_t done_count = 0;
+
+    std::vector<WorkerState> workers;
+
+public:
+    Coordinator(const CoordinatorConfig &config, const JobMessage &job) : config(config), job(job) {}
+
+    // blocks until every tile of the frame has been rendered by some worker
+    bool run(FrameBuffer &frame) {
+        Connection listener = listen_on(config.port);
+        if (!listener.is_open()) {
+            std::cout << "coordinator: cannot listen on port " << config.port << std::endl;
+            return false;
+        }
+        std::clog << "coordinator: listening on port " << config.port << std::endl;
+
+        split_tiles();
+
+        std::vector<uint8_t> payload;
+        while (done_count < static_cast<int32_t>(tiles.size())) {
+            std::vector<pollfd> fds;
+            fds.push_back({listener.get_fd(), POLLIN, 0});
+            for (const WorkerState &worker : workers) {
+                fds.push_back({worker.connection.get_fd(), POLLIN, 0});
+            }
+
+            ::poll(fds.data(), fds.size(), 200);
+
+            if (fds[0].revents & POLLIN) {
+                accept_worker(listener);
+            }
+
+            // walk backwards so dropping a worker does not shift the ones still to visit
+            for (int32_t i = static_cast<int32_t>(fds.size()) - 1; i >= 1; --i) {
+                if (fds[i].revents == 0) {
+                    continue;
+                }
+
+                WorkerState &worker = workers[i - 1];
+                MessageType type;
+                if (!(fds[i].revents & POLLIN) || !worker.connection.recv_message(type, payload) || type != MessageType::Result
+                    || !merge_result(frame, worker, payload)) {
+                    drop_worker(i - 1);
+                    continue;
+                }
+
+                fill(worker);
+            }
+
+            requeue_timed_out();
+            for (WorkerState &worker : workers) {
+                fill(worker);
+            }
+
+            std::clog << "\rtiles: " << done_count << " / " << tiles.size() << ", workers: " << workers.size() << "   " << std::flush;
+        }
+        std::clog << std::endl;
+
+        for (WorkerState &worker : workers) {
+            worker.connection.send_message(MessageType::Done, nullptr, 0);
+        }
+        workers.clear();
+        return true;
+    }
+
+private:
+    static Connection listen_on(uint16_t port) {
+        int32_t fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return Connection();
+        }
+        Connection listener(fd);
+
+        int32_t flag = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 64) != 0) {
+            return Connection();
+        }
+        return listener;
+    }
+
+    void split_tiles() {
+        for (int32_t h = 0; h < job.height; h += config.tile_size) {
+            for (int32_t w = 0; w < job.width; w += config.tile_size) {
+                tiles.push_back(Region{h, std::min(h + config.tile_size, job.height), w, std::min(w + config.tile_size, job.width)});
+            }
+        }
+        done.assign(tiles.size(), false);
+        issued_at.assign(tiles.size(), Clock::time_point());
+        for (int32_t i = 0; i < static_cast<int32_t>(tiles.size()); ++i) {
+            pending.push_back(i);
+        }
+    }
+
+    void accept_worker(const Connection &listener) {
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        int32_t fd = ::accept(listener.get_fd(), reinterpret_cast<sockaddr*>(&address), &length);
+        if (fd < 0) {
+            return;
+        }
+
+        int32_t flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        WorkerState worker;
+        worker.connection = Connection(fd);
+        worker.name = std::string(inet_ntoa(address.sin_addr)) + ":" + std::to_string(ntohs(address.sin_port));
+
+        if (!worker.connection.send_message(MessageType::Job, &job, sizeof(job))) {
+            return;
+        }
+
+        std::clog << std::endl << "coordinator: worker " << worker.name << " joined" << std::endl;
+        workers.push_back(std::move(worker));
+        fill(workers.back());
+    }
+
+    void drop_worker(int32_t index) {
+        WorkerState &worker = workers[index];
+        std::clog << std::endl << "coordinator: worker " << worker.name << " dropped, reassigning " << worker.tiles.size() << " tile(s)" << std::endl;
+
+        // put its tiles at the front, they are the oldest outstanding work
+        for (int32_t tile : worker.tiles) {
+            if (!done[tile]) {
+                pending.push_front(tile);
+            }
+        }
+        workers.erase(workers.begin() + index);
+    }
+
+    void fill(WorkerState &worker) {
+        while (static_cast<int32_t>(worker.tiles.size()) < config.tiles_in_flight && !pending.empty()) {
+            int32_t tile = pending.front();
+            pending.pop_front();
+            if (done[tile]) {
+                continue;
+            }
+
+            TileMessage message = {tile, tiles[tile]};
+            if (!worker.connection.send_message(MessageType::Tile, &message, sizeof(message))) {
+                pending.push_front(tile);
+                return;
+            }
+            worker.tiles.push_back(tile);
+            issued_at[tile] = Clock::now();
+        }
+    }
+
+    // false for a short or corrupt result, the caller drops the worker so its tiles are handed out again
+    bool merge_result(FrameBuffer &frame, WorkerState &worker, const std::vector<uint8_t> &payload) {
+        TileMessage message;
+        if (payload.size() < sizeof(message)) {
+            return false;
+        }
+        std::memcpy(&message, payload.data(), sizeof(message));
+        int32_t tile = message.tile_id;
+        if (tile < 0 || static_cast<size_t>(tile) >= tiles.size()) {
+            return false;
+        }
+
+        size_t expected = sizeof(message) + sizeof(float) * static_cast<size_t>(tiles[tile].height()) * tiles[tile].width() * floats_per_pixel(frame.has_features);
+        if (payload.size() != expected) {
+            return false;
+        }
+
+        std::erase(worker.tiles, tile);
+        if (done[tile]) {
+            return true;
+        }
+
+        RAY_TRACE_SCOPE_ARG("merge tile", "tile", tile);
+        unpack_tile(frame, tiles[tile], reinterpret_cast<const float*>(payload.data() + sizeof(message)));
+        done[tile] = true;
+        ++done_count;
+        return true;
+    }
+
+    void requeue_timed_out() {
+        if (config.tile_timeout <= 0.0) {
+            return;
+        }
+
+        auto now = Clock::now();
+        for (const WorkerState &worker : workers) {
+            for (int32_t tile : worker.tiles) {
+                if (!done[tile] && std::chrono::duration<double>(now - issued_at[tile]).count() > config.tile_timeout) {
+                    pending.push_back(tile);
+                    // restart the clock, so the tile is not queued again on every poll
+                    issued_at[tile] = now;
+                }
+            }
+        }
+    }
+};
+
+class RenderWorker {
+public:
+    // connects to the coordinator, renders tiles until told to stop, returns a process exit code
+    static int32_t run(const std::string &host, uint16_t port, int32_t num_process) {
+        Connection connection;
+        for (int32_t attempt = 0; attempt < 50 && !connection.is_open(); ++attempt) {
+            connection = Connection::connect_to(host, port);
+            if (!connection.is_open()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            }
+        }
+        if (!connection.is_open()) {
+            std::cout << "worker: cannot connect to " << host << ":" << port << std::endl;
+            return 1;
+        }
+
+        MessageType type;
+        std::vector<uint8_t> payload;
+        if (!connection.recv_message(type, payload) || type != MessageType::Job || payload.size() != sizeof(JobMessage)) {
+            std::cout << "worker: expected a job from the coordinator" << std::endl;
+            return 1;
+        }
+
+        JobMessage job;
+        std::memcpy(&job, payload.data(), sizeof(job));
+        job.scene[sizeof(job.scene) - 1] = '\0';
+
+        // the scene and its BVH live for the whole session
+        World world;
+        PerspectiveCamera camera;
+        // as main seeds it, so scenes placed at random match the coordinator's
+        seed_random(job.seed);
+        if (!load_scene(job.scene, world, camera, job.height, job.width)) {
+            std::cout << "worker: unknown scene " << job.scene << std::endl;
+            return 1;
+        }
+        camera.setSamples(job.samples, job.max_depth);
+        camera.setSeed(job.seed);
+        camera.setSampler(static_cast<SamplerMode>(job.sampler));
+
+        TelemetryConfig telemetry;
+        telemetry.terminal = false;
+        camera.setTelemetry(telemetry);
+
+        BVH bvh(world);
+        ThreadPool pool(num_process);
+        camera.setThreadPool(&pool);
+        std::clog << "worker: loaded " << job.scene << ", " << world.get_objects().size() << " objects" << std::endl;
+
+        int32_t tiles_rendered = 0;
+        while (connection.recv_message(type, payload) && type == MessageType::Tile) {
+            TileMessage message;
+            if (payload.size() != sizeof(message)) {
+                std::cout << "worker: malformed tile message" << std::endl;
+                break;
+            }
+            std::memcpy(&message, payload.data(), sizeof(message));
+            const Region &region = message.region;
+            if (region.h_begin < 0 || region.h_begin >= region.h_end || region.h_end > job.height ||
+                region.w_begin < 0 || region.w_begin >= region.w_end || region.w_end > job.width) {
+                std::cout << "worker: tile " << message.tile_id << " lies outside the image" << std::endl;
+                break;
+            }
+
+            RAY_TRACE_SCOPE_ARG("tile", "tile", message.tile_id);
+            FrameBuffer tile(message.region.height(), message.region.width(), job.has_features != 0);
+            camera.render(tile, world, bvh, num_process, message.region);
+
+            std::vector<float> data = pack_tile(tile);
+            if (!connection.send_message(MessageType::Result, &message, sizeof(message), data.data(), data.size() * sizeof(float))) {
+                break;
+            }
+            ++tiles_rendered;
+        }
+
+        std::clog << "worker: rendered " << tiles_rendered << " tile(s)" << std::endl;
+        world.destroy();
+        return 0;
+    }
+};
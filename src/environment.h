@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numbers>
+#include <string>
+#include <vector>
+
+#include <lodepng.h>
+#include <glm/glm.hpp>
+
+/*
+image based lighting from an equirectangular environment map
+
+rays that leave the scene read the map instead of returning black, and diffuse surfaces
+sample it directly (see PerspectiveCamera::shade). texels are picked in proportion to their
+luminance times their solid angle from an alias table, so a bright sun costs one table
+lookup, not a search. within the texel the direction is uniform in solid angle, which keeps
+the pdf a per-texel constant.
+
+directions are mapped to texels through an octahedral lookup table built once at load
+time. a table cell can straddle texel edges, most of all near the poles where the texels
+are narrow, so its texel is only a first guess: it is moved row and column-wise until the
+direction lies inside it, comparing against the texel edges. lookup() then finds the texel
+sample() would have drawn the direction from, and both report the same pdf for it, which
+keeps the MIS weights of escaping rays and environment samples summing to one. neither
+calls acos or atan2 unless a guess is more than a few texels off.
+*/
+
+/*
+Vose's alias method, https://doi.org/10.1109/32.92917
+samples one of n weighted outcomes in O(1)
+*/
+class AliasTable {
+    std::vector<float> probability;
+    std::vector<uint32_t> alias;
+    std::vector<float> pmf;
+
+public:
+    AliasTable() {}
+
+    explicit AliasTable(const std::vector<float> &weights) {
+        uint32_t n = static_cast<uint32_t>(weights.size());
+        probability.assign(n, 1.0f);
+        alias.resize(n);
+        pmf.resize(n);
+
+        double total = 0.0;
+        for (float w : weights) {
+            total += static_cast<double>(w);
+        }
+
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (uint32_t i = 0; i < n; ++i) {
+            alias[i] = i;
+            pmf[i] = total > 0.0 ? static_cast<float>(static_cast<double>(weights[i]) / total) : 1.0f / static_cast<float>(n);
+            scaled[i] = total > 0.0 ? static_cast<double>(weights[i]) * n / total : 1.0;
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            probability[s] = static_cast<float>(scaled[s]);
+            alias[s] = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // whatever is left is 1 up to rounding
+    }
+
+    uint32_t size() const {
+        return static_cast<uint32_t>(pmf.size());
+    }
+
+    // u.x picks a column of the table, u.y decides between it and its alias
+    uint32_t sample(const glm::vec2 &u) const {
+        uint32_t i = std::min(size() - 1, static_cast<uint32_t>(u.x * static_cast<float>(size())));
+        return u.y < probability[i] ? i : alias[i];
+    }
+
+    float probability_of(uint32_t i) const {
+        return pmf[i];
+    }
+};
+
+// octahedral mapping of the unit sphere onto [0, 1]^2, https://jcgt.org/published/0003/02/01/
+inline glm::vec2 octahedral_encode(const glm::vec3 &d) {
+    float s = std::fabs(d.x) + std::fabs(d.y) + std::fabs(d.z);
+    float a = d.x / s, b = d.z / s;
+    if (d.y < 0.0f) {
+        float a_folded = (1.0f - std::fabs(b)) * (a >= 0.0f ? 1.0f : -1.0f);
+        float b_folded = (1.0f - std::fabs(a)) * (b >= 0.0f ? 1.0f : -1.0f);
+        a = a_folded;
+        b = b_folded;
+    }
+    return glm::vec2(a * 0.5f + 0.5f, b * 0.5f + 0.5f);
+}
+
+inline glm::vec3 octahedral_decode(const glm::vec2 &p) {
+    float a = p.x * 2.0f - 1.0f, b = p.y * 2.0f - 1.0f;
+    float y = 1.0f - std::fabs(a) - std::fabs(b);
+    if (y < 0.0f) {
+        float a_folded = (1.0f - std::fabs(b)) * (a >= 0.0f ? 1.0f : -1.0f);
+        float b_folded = (1.0f - std::fabs(a)) * (b >= 0.0f ? 1.0f : -1.0f);
+        a = a_folded;
+        b = b_folded;
+    }
+    return glm::normalize(glm::vec3(a, y, b));
+}
+
+class EnvironmentMap {
+    int32_t height = 0, width = 0;
+    std::vector<glm::vec3> radiance;
+    std::vector<float> solid_angle; // per row
+    AliasTable texels;
+
+    int32_t lut_size = 0;
+    std::vector<uint32_t> lut; // octahedral cell -> texel of its centre
+
+    std::vector<float> row_edge;        // -y where row j begins, increasing: -1 at row 0, 1 past the last
+    std::vector<glm::vec2> column_edge; // (x, -z) towards where column i begins
+
+public:
+    // the image's texels are scaled by intensity, uv follows Sphere: the top row is straight up
+    EnvironmentMap(const std::string &filename, float intensity = 1.0f) {
+        std::vector<uint8_t> image;
+        uint32_t image_width = 0, image_height = 0;
+        uint32_t error = lodepng::decode(image, image_width, image_height, filename);
+        if (error) {
+            std::cout << "decoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
+            image.assign(4, 0);
+            image_width = image_height = 1;
+        }
+        height = static_cast<int32_t>(image_height);
+        width = static_cast<int32_t>(image_width);
+
+        radiance.resize(static_cast<size_t>(height) * width);
+        for (size_t i = 0; i < radiance.size(); ++i) {
+            radiance[i] = intensity * glm::vec3(image[i * 4 + 0], image[i * 4 + 1], image[i * 4 + 2]) / 256.0f;
+        }
+
+        // row j spans v from 1 - j / height down to 1 - (j + 1) / height, theta = v * pi
+        solid_angle.resize(height);
+        for (int32_t j = 0; j < height; ++j) {
+            float cos_top = std::cos(std::numbers::pi_v<float> * (1.0f - static_cast<float>(j) / static_cast<float>(height)));
+            float cos_bottom = std::cos(std::numbers::pi_v<float> * (1.0f - static_cast<float>(j + 1) / static_cast<float>(height)));
+            solid_angle[j] = 2.0f * std::numbers::pi_v<float> / static_cast<float>(width) * std::fabs(cos_top - cos_bottom);
+        }
+
+        std::vector<float> weights(radiance.size());
+        for (int32_t j = 0; j < height; ++j) {
+            for (int32_t i = 0; i < width; ++i) {
+                const glm::vec3 &c = radiance[j * width + i];
+                weights[j * width + i] = (0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z) * solid_angle[j];
+            }
+        }
+        texels = AliasTable(weights);
+
+        row_edge.resize(height + 1);
+        for (int32_t j = 0; j <= height; ++j) {
+            row_edge[j] = std::cos(std::numbers::pi_v<float> * (1.0f - static_cast<float>(j) / static_cast<float>(height)));
+        }
+        column_edge.resize(width + 1);
+        for (int32_t i = 0; i <= width; ++i) {
+            float phi = 2.0f * std::numbers::pi_v<float> * static_cast<float>(i) / static_cast<float>(width);
+            column_edge[i] = glm::vec2(-std::cos(phi), -std::sin(phi));
+        }
+
+        // cells a bit finer than the texels at the equator
+        lut_size = std::clamp(2 * height, 64, 4096);
+        lut.resize(static_cast<size_t>(lut_size) * lut_size);
+        for (int32_t b = 0; b < lut_size; ++b) {
+            for (int32_t a = 0; a < lut_size; ++a) {
+                glm::vec2 p((static_cast<float>(a) + 0.5f) / static_cast<float>(lut_size), (static_cast<float>(b) + 0.5f) / static_cast<float>(lut_size));
+                lut[b * lut_size + a] = texel_of(octahedral_decode(p));
+            }
+        }
+    }
+
+    // radiance arriving from direction, and the pdf of sample() picking it
+    glm::vec3 lookup(const glm::vec3 &direction, float &pdf) const {
+        glm::vec2 p = octahedral_encode(direction);
+        int32_t a = std::min(lut_size - 1, static_cast<int32_t>(p.x * static_cast<float>(lut_size)));
+        int32_t b = std::min(lut_size - 1, static_cast<int32_t>(p.y * static_cast<float>(lut_size)));
+        uint32_t texel = refine(direction, lut[b * lut_size + a]);
+        pdf = texel_pdf(texel);
+        return radiance[texel];
+    }
+
+    // a direction towards the map with probability proportional to its luminance
+    glm::vec3 sample(const glm::vec2 &u_texel, const glm::vec2 &u_direction, glm::vec3 &direction, float &pdf) const {
+        uint32_t texel = texels.sample(u_texel);
+        int32_t j = static_cast<int32_t>(texel) / width;
+        int32_t i = static_cast<int32_t>(texel) % width;
+
+        // uniform in solid angle: phi uniform, cos theta uniform between the row's edges
+        float phi = 2.0f * std::numbers::pi_v<float> * (static_cast<float>(i) + u_direction.x) / static_cast<float>(width);
+        float cos_top = std::cos(std::numbers::pi_v<float> * (1.0f - static_cast<float>(j) / static_cast<float>(height)));
+        float cos_bottom = std::cos(std::numbers::pi_v<float> * (1.0f - static_cast<float>(j + 1) / static_cast<float>(height)));
+        float cos_theta = cos_top + (cos_bottom - cos_top) * u_direction.y;
+        float sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+
+        // inverse of Sphere's uv: theta = acos(-y), phi = atan2(-z, x) + pi
+        float phi_centered = phi - std::numbers::pi_v<float>;
+        direction = glm::vec3(sin_theta * std::cos(phi_centered), -cos_theta, -sin_theta * std::sin(phi_centered));
+        pdf = texel_pdf(texel);
+        return radiance[texel];
+    }
+
+private:
+    // the texel containing d, starting from a nearby guess
+    uint32_t refine(const glm::vec3 &d, uint32_t guess) const {
+        constexpr int32_t max_steps = 4;
+        int32_t j = static_cast<int32_t>(guess) / width;
+        int32_t i = static_cast<int32_t>(guess) % width;
+        int32_t steps = 0;
+
+        // rows by the height of d, as in texel_of: -y grows with the row
+        float h = -d.y;
+        while (j > 0 && h < row_edge[j] && steps++ < max_steps) {
+            --j;
+        }
+        while (j < height - 1 && h >= row_edge[j + 1] && steps++ < max_steps) {
+            ++j;
+        }
+
+        // columns by the side of each edge (x, -z) lies on, columns wrap around
+        glm::vec2 p(d.x, -d.z);
+        auto before = [&p](const glm::vec2 &edge) {
+            return edge.x * p.y - edge.y * p.x < 0.0f;
+        };
+        while (before(column_edge[i]) && steps++ < max_steps) {
+            i = (i + width - 1) % width;
+        }
+        while (!before(column_edge[i + 1]) && steps++ < max_steps) {
+            i = (i + 1) % width;
+        }
+
+        if (steps > max_steps) {
+            // a cell spanning many texels, near a pole
+            return texel_of(d);
+        }
+        return static_cast<uint32_t>(j * width + i);
+    }
+
+    float texel_pdf(uint32_t texel) const {
+        float omega = solid_angle[static_cast<int32_t>(texel) / width];
+        return omega > 0.0f ? texels.probability_of(texel) / omega : 0.0f;
+    }
+
+    uint32_t texel_of(const glm::vec3 &d) const {
+        float theta = std::acos(std::clamp(-d.y, -1.0f, 1.0f));
+        float phi = std::atan2(-d.z, d.x) + std::numbers::pi_v<float>;
+        float u = phi / (2.0f * std::numbers::pi_v<float>);
+        float v = theta / std::numbers::pi_v<float>;
+        int32_t i = std::clamp(static_cast<int32_t>(u * static_cast<float>(width)), 0, width - 1);
+        int32_t j = std::clamp(static_cast<int32_t>((1.0f - v) * static_cast<float>(height)), 0, height - 1);
+        return static_cast<uint32_t>(j * width + i);
+    }
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/*
+linear radiance of a whole frame, plus the first-hit feature buffers the
+denoiser is guided by. every pixel is written by exactly one worker.
+*/
+struct FrameBuffer {
+    int32_t height = 0, width = 0;
+    bool has_features = false;
+
+    std::vector<glm::vec3> color;    // mean radiance
+    std::vector<float> variance;     // variance of the mean luminance
+
+    // first hit of each sample, averaged over the samples of the pixel
+    std::vector<glm::vec3> albedo;
+    std::vector<glm::vec3> normal;
+    std::vector<float> depth;
+
+    FrameBuffer() {}
+    FrameBuffer(int32_t height, int32_t width, bool has_features) : height(height), width(width), has_features(has_features) {
+        size_t n = static_cast<size_t>(height) * width;
+        color.resize(n);
+        if (has_features) {
+            variance.resize(n);
+            albedo.resize(n);
+            normal.resize(n);
+            depth.resize(n);
+        }
+    }
+
+    // gamma and clamp into rgba8
+    void to_rgba8(std::vector<uint8_t> &image, bool gamma = true) const {
+        for (int32_t h = 0; h < height; ++h) {
+            for (int32_t w = 0; w < width; ++w) {
+                glm::vec3 pixel = color[h * width + w];
+
+                if (gamma) {
+                    // linear to gamma
+                    pixel.x = pixel.x > 0.0f ? std::sqrt(pixel.x) : 0.0f;
+                    pixel.y = pixel.y > 0.0f ? std::sqrt(pixel.y) : 0.0f;
+                    pixel.z = pixel.z > 0.0f ? std::sqrt(pixel.z) : 0.0f;
+                }
+
+                // clamp
+                pixel.x = std::clamp(pixel.x, 0.0f, 1.0f);
+                pixel.y = std::clamp(pixel.y, 0.0f, 1.0f);
+                pixel.z = std::clamp(pixel.z, 0.0f, 1.0f);
+
+                size_t offset = (static_cast<size_t>(h) * width + w) * 4;
+                image[offset + 0] = static_cast<uint8_t>(255.999f * pixel.x);
+                image[offset + 1] = static_cast<uint8_t>(255.999f * pixel.y);
+                image[offset + 2] = static_cast<uint8_t>(255.999f * pixel.z);
+                image[offset + 3] = 255;
+            }
+        }
+    }
+};
+
+inline float luminance(const glm::vec3 &c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <object.h>
+#include <trace.h>
+
+/*
+primary hit cache for look-dev re-renders
+
+the first hit of every pixel sample depends on the camera, the sample sequence and the
+geometry, never on materials or textures. a HitCache records those hits to a file during one
+render, and while the scene hash stays the same later renders read them back instead of
+tracing primary rays: only the bounces after the first hit are traced again.
+
+the record is the hit object, the primitive within it, t and the barycentrics, which is all
+Object::hit needs to rebuild the surface point. the sample's random state is not stored, it
+is implied: cached renders use the sobol or blue-noise sequence, whose points are a function
+of the seed, the pixel and the sample index, and those are part of the hash.
+*/
+
+struct HitRecord {
+    uint32_t object;    // index in the world's objects, miss for rays that escaped
+    uint32_t prim;
+    float t;
+    float u, v;
+
+    static constexpr uint32_t miss = std::numeric_limits<uint32_t>::max();
+};
+
+struct HitCacheHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t height;
+    int32_t width;
+    int32_t samples;
+    uint64_t scene_hash;
+};
+
+constexpr char hit_cache_magic[8] = {'R', 'T', 'H', 'I', 'T', 'S', '\0', '\0'};
+constexpr uint32_t hit_cache_version = 1;
+
+class HitCache {
+    std::string filename;
+    HitCacheHeader header = {};
+    int32_t fd = -1;
+    uint8_t *mapping = nullptr;
+    size_t size = 0;
+    HitRecord *records = nullptr;
+    bool replaying = false;
+
+    std::vector<const Object*> objects;
+    std::unordered_map<const Object*, uint32_t> object_index;
+
+public:
+    // size of the cache file, 20 bytes per pixel sample
+    static uint64_t file_bytes(int32_t height, int32_t width, int32_t samples) {
+        return sizeof(HitCacheHeader) + static_cast<uint64_t>(height) * width * samples * sizeof(HitRecord);
+    }
+
+    /*
+    replays filename if it holds the hits of a scene with scene_hash at this resolution and
+    sample count, otherwise records them for save(). the records are a shared mapping of the
+    file, so the kernel pages them in and out instead of the process holding them all
+    */
+    HitCache(const std::string &filename, const World &world, uint64_t scene_hash, int32_t height, int32_t width, int32_t samples) :
+        filename(filename),
+        objects(world.get_objects())
+    {
+        for (uint32_t i = 0; i < objects.size(); ++i) {
+            object_index[objects[i]] = i;
+        }
+
+        std::memcpy(header.magic, hit_cache_magic, sizeof(header.magic));
+        header.version = hit_cache_version;
+        header.height = height;
+        header.width = width;
+        header.samples = samples;
+        header.scene_hash = scene_hash;
+        size = file_bytes(height, width, samples);
+
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            std::cout << "hit cache: cannot open " << filename << std::endl;
+            close();
+            return;
+        }
+
+        HitCacheHeader stored;
+        bool complete = static_cast<size_t>(st.st_size) == size &&
+                        pread(fd, &stored, sizeof(stored), 0) == static_cast<ssize_t>(sizeof(stored)) &&
+                        std::memcmp(&stored, &header, sizeof(header)) == 0;
+        if (!complete) {
+            // the header is only written by save(), a render that stops early leaves no valid cache
+            if (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                std::cout << "hit cache: cannot grow " << filename << " to " << size << " bytes" << std::endl;
+                close();
+                return;
+            }
+        }
+
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            std::cout << "hit cache: cannot map " << filename << std::endl;
+            close();
+            return;
+        }
+        mapping = static_cast<uint8_t*>(ptr);
+        records = reinterpret_cast<HitRecord*>(mapping + sizeof(HitCacheHeader));
+        replaying = complete;
+
+        if (replaying) {
+            std::clog << "hit cache: reusing " << (size - sizeof(HitCacheHeader)) / sizeof(HitRecord) << " primary hits from " << filename << std::endl;
+        } else if (st.st_size == 0) {
+            std::clog << "hit cache: recording primary hits to " << filename << std::endl;
+        } else {
+            std::clog << "hit cache: scene, camera or sampling changed, or the file is incomplete, recording primary hits again" << std::endl;
+        }
+    }
+
+    HitCache(const HitCache&) = delete;
+    HitCache& operator=(const HitCache&) = delete;
+
+    ~HitCache() {
+        close();
+    }
+
+    // false if the file could not be opened or mapped, the render then traces every primary ray
+    bool good() const {
+        return mapping != nullptr;
+    }
+
+    bool replay() const {
+        return replaying && good();
+    }
+
+    static uint64_t index(int32_t h, int32_t w, int32_t sample, int32_t width, int32_t samples) {
+        return (static_cast<uint64_t>(h) * width + w) * samples + sample;
+    }
+
+    uint64_t index(int32_t h, int32_t w, int32_t sample) const {
+        return index(h, w, sample, header.width, header.samples);
+    }
+
+    void store(uint64_t i, const BVHHit &hit) {
+        HitRecord &record = records[i];
+        record.object = hit.is_hit ? object_index.at(hit.obj) : HitRecord::miss;
+        record.prim = hit.prim;
+        record.t = hit.t;
+        record.u = hit.u;
+        record.v = hit.v;
+    }
+
+    BVHHit load(uint64_t i) const {
+        const HitRecord &record = records[i];
+        BVHHit ret;
+        ret.is_hit = record.object != HitRecord::miss;
+        ret.t = record.t;
+        ret.obj = ret.is_hit ? objects[record.object] : nullptr;
+        ret.prim = record.prim;
+        ret.u = record.u;
+        ret.v = record.v;
+        return ret;
+    }
+
+    // marks the recorded hits complete, a replayed cache is already on disk
+    bool save() const {
+        if (replaying || !good()) {
+            return replaying;
+        }
+        RAY_TRACE_SCOPE("save hit cache");
+        std::memcpy(mapping, &header, sizeof(header));
+        if (msync(mapping, size, MS_SYNC) != 0) {
+            std::cout << "hit cache: cannot write " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void close() {
+        if (mapping != nullptr) {
+            munmap(mapping, size);
+            mapping = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <camera.h>
+#include <object.h>
+#include <bvh.h>
+#include <trace.h>
+
+/*
+streaming image output for renders too large to hold in memory
+
+the image is rendered in horizontal bands, and every finished band is appended to the file
+before the next one is traced, so memory holds one band's frame and its rgb rows no matter
+how tall the image is.
+
+files ending in .ppm are written as binary ppm. anything else is written as an 8 bit rgb png
+whose zlib stream is made of stored (uncompressed) deflate blocks: a real compressor would
+need deflate state carried across bands, which lodepng does not expose. the file is as large
+as the raw pixels, a later recompress (optipng, oxipng) shrinks it without loading this
+renderer's memory.
+*/
+
+class StreamingImageWriter {
+    std::FILE *file = nullptr;
+    bool png = true;
+    int32_t height = 0, width = 0;
+    int32_t rows_written = 0;
+
+    uint32_t adler_a = 1, adler_b = 0;
+    std::vector<uint8_t> chunk;
+
+    static constexpr size_t max_stored_block = 65535;
+
+public:
+    StreamingImageWriter(const std::string &filename, int32_t height, int32_t width) : height(height), width(width) {
+        png = !(filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".ppm") == 0);
+        file = std::fopen(filename.c_str(), "wb");
+        if (file == nullptr) {
+            std::cout << "cannot write " << filename << std::endl;
+            return;
+        }
+
+        if (!png) {
+            std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+            return;
+        }
+
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        std::fwrite(signature, 1, sizeof(signature), file);
+
+        chunk.clear();
+        put32(chunk, static_cast<uint32_t>(width));
+        put32(chunk, static_cast<uint32_t>(height));
+        chunk.push_back(8);     // bit depth
+        chunk.push_back(2);     // rgb
+        chunk.push_back(0);     // deflate
+        chunk.push_back(0);     // adaptive filtering, every row uses filter 0
+        chunk.push_back(0);     // not interlaced
+        write_chunk("IHDR");
+
+        // zlib header: deflate with a 32k window, no dictionary, fastest
+        chunk.clear();
+        chunk.push_back(0x78);
+        chunk.push_back(0x01);
+        write_chunk("IDAT");
+    }
+
+    StreamingImageWriter(const StreamingImageWriter&) = delete;
+    StreamingImageWriter& operator=(const StreamingImageWriter&) = delete;
+
+    ~StreamingImageWriter() {
+        close();
+    }
+
+    bool good() const {
+        return file != nullptr && !std::ferror(file);
+    }
+
+    // appends rows of rgb8 pixels, top to bottom, width * 3 bytes each
+    void write_rows(const uint8_t *rgb, int32_t rows) {
+        if (file == nullptr) {
+            return;
+        }
+        size_t row_bytes = static_cast<size_t>(width) * 3;
+        rows_written += rows;
+
+        if (!png) {
+            std::fwrite(rgb, 1, row_bytes * rows, file);
+            return;
+        }
+
+        // each row is preceded by its filter type, the rows then go into stored blocks
+        std::vector<uint8_t> filtered;
+        filtered.reserve((row_bytes + 1) * rows);
+        for (int32_t r = 0; r < rows; ++r) {
+            filtered.push_back(0);
+            filtered.insert(filtered.end(), rgb + r * row_bytes, rgb + (r + 1) * row_bytes);
+        }
+        adler(filtered.data(), filtered.size());
+
+        chunk.clear();
+        for (size_t begin = 0; begin < filtered.size(); begin += max_stored_block) {
+            size_t length = std::min(max_stored_block, filtered.size() - begin);
+            chunk.push_back(0); // not the final block, stored
+            chunk.push_back(static_cast<uint8_t>(length));
+            chunk.push_back(static_cast<uint8_t>(length >> 8));
+            chunk.push_back(static_cast<uint8_t>(~length));
+            chunk.push_back(static_cast<uint8_t>(~length >> 8));
+            chunk.insert(chunk.end(), filtered.begin() + begin, filtered.begin() + begin + length);
+        }
+        write_chunk("IDAT");
+    }
+
+    // ends the zlib stream and the png, true if every row arrived and was written
+    bool close() {
+        if (file == nullptr) {
+            return false;
+        }
+
+        if (png) {
+            // an empty final stored block, then the adler32 of everything before it
+            chunk.assign({1, 0x00, 0x00, 0xff, 0xff});
+            put32(chunk, (adler_b << 16) | adler_a);
+            write_chunk("IDAT");
+
+            chunk.clear();
+            write_chunk("IEND");
+        }
+
+        bool ok = !std::ferror(file) && rows_written == height;
+        ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+        if (rows_written != height) {
+            std::cout << "image writer: " << rows_written << " of " << height << " rows written" << std::endl;
+        }
+        return ok;
+    }
+
+private:
+    static void put32(std::vector<uint8_t> &out, uint32_t value) {
+        out.push_back(static_cast<uint8_t>(value >> 24));
+        out.push_back(static_cast<uint8_t>(value >> 16));
+        out.push_back(static_cast<uint8_t>(value >> 8));
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+        static const std::array<uint32_t, 256> table = [] {
+            std::array<uint32_t, 256> t;
+            for (uint32_t n = 0; n < 256; ++n) {
+                uint32_t c = n;
+                for (int32_t k = 0; k < 8; ++k) {
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                }
+                t[n] = c;
+            }
+            return t;
+        }();
+
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+    void adler(const uint8_t *data, size_t size) {
+        // 5552 bytes is the most that can be summed before b overflows 32 bits
+        while (size > 0) {
+            size_t n = std::min<size_t>(size, 5552);
+            for (size_t i = 0; i < n; ++i) {
+                adler_a += data[i];
+                adler_b += adler_a;
+            }
+            adler_a %= 65521;
+            adler_b %= 65521;
+            data += n;
+            size -= n;
+        }
+    }
+
+    // writes chunk as the data of a png chunk of type
+    void write_chunk(const char type[4]) {
+        std::vector<uint8_t> header;
+        put32(header, static_cast<uint32_t>(chunk.size()));
+        header.insert(header.end(), type, type + 4);
+
+        uint32_t crc = crc32(0xffffffffu, header.data() + 4, 4);
+        crc = crc32(crc, chunk.data(), chunk.size());
+        std::vector<uint8_t> footer;
+        put32(footer, crc ^ 0xffffffffu);
+
+        std::fwrite(header.data(), 1, header.size(), file);
+        std::fwrite(chunk.data(), 1, chunk.size(), file);
+        std::fwrite(footer.data(), 1, footer.size(), file);
+    }
+};
+
+/*
+renders the image band_rows rows at a time and streams each band to filename. only the band's
+frame is ever in memory, so the post-processing that needs the whole frame (denoising, the
+heatmap's normalization) is not available here.
+*/
+inline bool render_streaming(
+    PerspectiveCamera &camera,
+    const World &world,
+    const BVH &bvh,
+    const std::string &filename,
+    int32_t band_rows,
+    int32_t num_process
+) {
+    int32_t height = camera.getHeight();
+    int32_t width = camera.getWidth();
+    band_rows = std::clamp(band_rows, 1, height);
+
+    StreamingImageWriter writer(filename, height, width);
+    if (!writer.good()) {
+        return false;
+    }
+
+    FrameBuffer frame(band_rows, width, false);
+    std::vector<uint8_t> rgba(static_cast<size_t>(band_rows) * width * 4);
+    std::vector<uint8_t> rgb(static_cast<size_t>(band_rows) * width * 3);
+
+    int32_t bands = (height + band_rows - 1) / band_rows;
+    for (int32_t band = 0; band < bands; ++band) {
+        Region region{band * band_rows, std::min(height, (band + 1) * band_rows), 0, width};
+        if (region.height() != frame.height) {
+            // the last band is shorter
+            frame = FrameBuffer(region.height(), width, false);
+        }
+
+        camera.render(frame, world, bvh, num_process, region);
+        camera.finish(frame, rgba, num_process);
+
+        RAY_TRACE_SCOPE_ARG("write band", "band", band);
+        size_t pixels = static_cast<size_t>(region.height()) * width;
+        for (size_t i = 0; i < pixels; ++i) {
+            rgb[i * 3 + 0] = rgba[i * 4 + 0];
+            rgb[i * 3 + 1] = rgba[i * 4 + 1];
+            rgb[i * 3 + 2] = rgba[i * 4 + 2];
+        }
+        writer.write_rows(rgb.data(), region.height());
+
+        std::clog << "band " << band + 1 << " / " << bands << " -> rows " << region.h_begin << " to " << region.h_end - 1 << std::endl;
+    }
+
+    return writer.close();
+}
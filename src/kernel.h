@@ -0,0 +1,134 @@
+#pragma once
+
+#include <tuple>
+#include <utility>
+
+#include <glm/glm.hpp>
+
+#include <object.h>
+#include <material.h>
+
+/*
+compile-time render kernels
+
+the integrator and camera are templated on a RenderKernel. the renderer inspects the scene
+once, picks the instantiation matching it, and inside the kernel every per-sample branch on
+those settings is a constant: no lens sampling without defocus, no virtual texture lookups
+when every texture is a SolidTexture, and materials are dispatched with a switch over the
+kinds that occur in the scene instead of a virtual call.
+
+GenericKernel keeps the runtime checks and virtual calls, it is correct for any scene.
+*/
+
+constexpr uint32_t all_material_kinds =
+    material_bit(MaterialKind::Lambertian) |
+    material_bit(MaterialKind::Metal) |
+    material_bit(MaterialKind::Dielectric) |
+    material_bit(MaterialKind::DiffuseLight);
+
+template <bool Specialized, bool Defocus, bool Textures, uint32_t Materials>
+struct RenderKernel {
+    static constexpr bool specialized = Specialized;
+    static constexpr bool defocus = Defocus;
+    static constexpr bool textures = Textures;
+    static constexpr uint32_t materials = Materials;
+
+    static constexpr bool has(MaterialKind kind) {
+        return (materials & material_bit(kind)) != 0;
+    }
+};
+
+using GenericKernel = RenderKernel<false, true, true, all_material_kinds>;
+
+// what a scene needs from its kernel
+struct KernelFeatures {
+    bool defocus = false;
+    bool textures = false;
+    uint32_t materials = 0;
+
+    static KernelFeatures detect(const World &world, float defocus_angle) {
+        KernelFeatures ret;
+        ret.defocus = defocus_angle > 0;
+        for (const Object *obj : world.get_objects()) {
+            const Material *mat = obj->material();
+            ret.materials |= material_bit(mat->kind);
+            ret.textures = ret.textures || mat->has_texture();
+        }
+        return ret;
+    }
+};
+
+template <typename K>
+inline std::tuple<bool, glm::vec3, Ray> kernel_scatter(const Material *mat, const Ray &r, const ColorHit &hit) {
+    if constexpr (K::specialized) {
+        switch (mat->kind) {
+        case MaterialKind::Lambertian:
+            if constexpr (K::has(MaterialKind::Lambertian)) {
+                return static_cast<const Lambertian*>(mat)->template scatter_kernel<K::textures>(r, hit);
+            }
+            break;
+        case MaterialKind::Metal:
+            if constexpr (K::has(MaterialKind::Metal)) {
+                return static_cast<const Metal*>(mat)->scatter(r, hit);
+            }
+            break;
+        case MaterialKind::Dielectric:
+            if constexpr (K::has(MaterialKind::Dielectric)) {
+                return static_cast<const Dielectric*>(mat)->scatter(r, hit);
+            }
+            break;
+        case MaterialKind::DiffuseLight:
+            if constexpr (K::has(MaterialKind::DiffuseLight)) {
+                return std::make_tuple(false, glm::vec3(0, 0, 0), Ray());
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return mat->scatter(r, hit);
+}
+
+template <typename K>
+inline glm::vec3 kernel_emitted(const Material *mat, const ColorHit &hit) {
+    if constexpr (K::specialized) {
+        if constexpr (K::has(MaterialKind::DiffuseLight)) {
+            if (mat->kind == MaterialKind::DiffuseLight) {
+                return static_cast<const DiffuseLight*>(mat)->template emitted_kernel<K::textures>(hit);
+            }
+        }
+        // only the four known kinds reach a specialized kernel, and only lights emit
+        return glm::vec3(0, 0, 0);
+    } else {
+        return mat->emitted(hit);
+    }
+}
+
+template <bool Defocus, bool Textures, uint32_t... Materials, typename F>
+inline bool dispatch_materials(uint32_t materials, std::integer_sequence<uint32_t, Materials...>, F &&f) {
+    return ((materials == Materials ? (f.template operator()<RenderKernel<true, Defocus, Textures, Materials>>(), true) : false) || ...);
+}
+
+// calls f.template operator()<K>() with the kernel specialized for `features`
+template <typename F>
+inline void dispatch_kernel(const KernelFeatures &features, F &&f) {
+    // every subset of the four known kinds; scenes with other materials use the generic kernel
+    using material_sets = std::integer_sequence<uint32_t, 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30>;
+
+    bool dispatched = false;
+    if ((features.materials & material_bit(MaterialKind::Other)) == 0) {
+        if (features.defocus && features.textures) {
+            dispatched = dispatch_materials<true, true>(features.materials, material_sets(), f);
+        } else if (features.defocus) {
+            dispatched = dispatch_materials<true, false>(features.materials, material_sets(), f);
+        } else if (features.textures) {
+            dispatched = dispatch_materials<false, true>(features.materials, material_sets(), f);
+        } else {
+            dispatched = dispatch_materials<false, false>(features.materials, material_sets(), f);
+        }
+    }
+
+    if (!dispatched) {
+        f.template operator()<GenericKernel>();
+    }
+}
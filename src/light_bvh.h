@@ -0,0 +1,495 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numbers>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <object.h>
+#include <material.h>
+
+/*
+a light BVH over the emitting primitives of a scene, for next event estimation
+
+every node bounds its lights' positions, total power and the cone their normals lie in.
+diffuse vertices walk the tree from the root and go left or right in proportion to an
+estimate of what each child can contribute at the shading point, so one light is picked in
+O(log n) and close, bright lights that face the point are picked most often. a bounce that
+hits a light finds the probability of the same pick by walking back up from its leaf, which
+weights the two strategies against each other (see PerspectiveCamera::shade).
+
+the bounds, importance and build cost follow Conty Estevez and Kulla, "Importance Sampling
+of Many Lights with Adaptive Tree Splitting", and pbrt-v4's BVHLightSampler
+https://pbr-book.org/4ed/Light_Sources/Light_Sampling
+*/
+
+// directions within acos(cos_theta) of w
+struct DirectionCone {
+    glm::vec3 w = glm::vec3(0.0, 0.0, 1.0);
+    float cos_theta = 1.0f;
+
+    static DirectionCone entire_sphere() {
+        return DirectionCone{glm::vec3(0.0, 0.0, 1.0), -1.0f};
+    }
+};
+
+inline float safe_acos(float x) {
+    return std::acos(std::clamp(x, -1.0f, 1.0f));
+}
+
+inline float safe_sqrt(float x) {
+    return std::sqrt(std::max(0.0f, x));
+}
+
+// the smallest cone around both
+inline DirectionCone cone_union(const DirectionCone &a, const DirectionCone &b) {
+    float theta_a = safe_acos(a.cos_theta);
+    float theta_b = safe_acos(b.cos_theta);
+    float theta_d = safe_acos(glm::dot(a.w, b.w));
+    if (std::min(theta_d + theta_b, std::numbers::pi_v<float>) <= theta_a) {
+        return a;
+    }
+    if (std::min(theta_d + theta_a, std::numbers::pi_v<float>) <= theta_b) {
+        return b;
+    }
+
+    float theta_o = (theta_a + theta_d + theta_b) / 2.0f;
+    if (theta_o >= std::numbers::pi_v<float>) {
+        return DirectionCone::entire_sphere();
+    }
+
+    // turn a's axis towards b's until the cone reaches both
+    glm::vec3 axis = glm::cross(a.w, b.w);
+    float axis_length = glm::length(axis);
+    if (axis_length < 1e-6f) {
+        return DirectionCone::entire_sphere();
+    }
+    axis /= axis_length;
+    float theta_r = theta_o - theta_a;
+    glm::vec3 w = a.w * std::cos(theta_r) + glm::cross(axis, a.w) * std::sin(theta_r);
+    return DirectionCone{glm::normalize(w), std::cos(theta_o)};
+}
+
+struct LightBounds {
+    AABB box;
+    float phi = 0.0f;           // emitted power
+    DirectionCone normals;
+    float cos_theta_e = 0.0f;   // how far past its normals a light emits, pi / 2 for diffuse
+    bool two_sided = false;
+
+    // estimated contribution at p to a surface with normal n, 0 if the lights cannot reach it
+    float importance(const glm::vec3 &p, const glm::vec3 &n) const {
+        glm::vec3 center = 0.5f * (box.box_aa + box.box_bb);
+        float radius = 0.5f * glm::length(box.box_bb - box.box_aa);
+        glm::vec3 offset = p - center;
+        float distance2 = glm::dot(offset, offset);
+        // inside or close to the box the distance says little, keep it from blowing up
+        float d2 = std::max(distance2, radius);
+
+        // cos(a - b) and sin(a - b) from the sines and cosines, 0 when b covers a
+        auto cos_sub_clamped = [](float sin_a, float cos_a, float sin_b, float cos_b) {
+            return cos_a > cos_b ? 1.0f : cos_a * cos_b + sin_a * sin_b;
+        };
+        auto sin_sub_clamped = [](float sin_a, float cos_a, float sin_b, float cos_b) {
+            return cos_a > cos_b ? 0.0f : sin_a * cos_b - cos_a * sin_b;
+        };
+
+        glm::vec3 wi = distance2 > 0.0f ? offset / std::sqrt(distance2) : normals.w;
+        float cos_theta_w = glm::dot(normals.w, wi);
+        if (two_sided) {
+            cos_theta_w = std::fabs(cos_theta_w);
+        }
+        float sin_theta_w = safe_sqrt(1.0f - cos_theta_w * cos_theta_w);
+
+        // half the angle the box's bounding sphere covers, seen from p
+        float cos_theta_b = distance2 < radius * radius ? -1.0f : safe_sqrt(1.0f - radius * radius / distance2);
+        float sin_theta_b = safe_sqrt(1.0f - cos_theta_b * cos_theta_b);
+
+        // the smallest angle between p and any normal of any light
+        float sin_theta_o = safe_sqrt(1.0f - normals.cos_theta * normals.cos_theta);
+        float cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, normals.cos_theta);
+        float sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, normals.cos_theta);
+        float cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+        if (cos_theta_p <= cos_theta_e) {
+            return 0.0f;
+        }
+
+        float ret = phi * cos_theta_p / d2;
+
+        // the surface only receives from above its normal
+        float cos_theta_i = glm::dot(-wi, n);
+        float sin_theta_i = safe_sqrt(1.0f - cos_theta_i * cos_theta_i);
+        return ret * std::max(0.0f, cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b));
+    }
+};
+
+inline LightBounds light_bounds_union(const LightBounds &a, const LightBounds &b) {
+    if (a.phi <= 0.0f) {
+        return b;
+    }
+    if (b.phi <= 0.0f) {
+        return a;
+    }
+    LightBounds ret;
+    ret.box = AABB(a.box, b.box);
+    ret.phi = a.phi + b.phi;
+    ret.normals = cone_union(a.normals, b.normals);
+    ret.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+    ret.two_sided = a.two_sided || b.two_sided;
+    return ret;
+}
+
+// a direction from a shading point towards a light, and the density of picking it
+struct LightSample {
+    const Emitter *emitter;
+    glm::vec3 direction;
+    float distance;     // to the sampled point, infinity for spheres which are sampled by direction
+    float pdf;          // per solid angle, including the choice of the light
+};
+
+class LightBVH {
+    struct Node {
+        LightBounds bounds;
+        uint32_t child;     // the second child of an interior node, the first follows it. the light of a leaf
+        uint32_t parent;
+        bool leaf;
+    };
+
+    std::vector<Emitter> lights;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> leaf_of;  // light -> its leaf, none for lights that do not emit
+    std::unordered_map<const Object*, uint32_t> first_light;
+
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+    static constexpr int32_t buckets = 12;
+
+public:
+    // a tree over the emitters of every DiffuseLight object of world, nullptr if there are none
+    static std::shared_ptr<const LightBVH> build(const World &world) {
+        std::shared_ptr<LightBVH> ret = std::make_shared<LightBVH>();
+
+        std::vector<std::pair<LightBounds, uint32_t>> bounded;
+        for (const Object *obj : world.get_objects()) {
+            const Material *mat = obj->material();
+            if (mat == nullptr || mat->kind != MaterialKind::DiffuseLight) {
+                continue;
+            }
+            glm::vec3 emit = static_cast<const DiffuseLight*>(mat)->average_emit();
+            float radiance = 0.2126f * emit.x + 0.7152f * emit.y + 0.0722f * emit.z;
+            if (radiance <= 0.0f) {
+                continue;
+            }
+
+            size_t first = ret->lights.size();
+            obj->emitters(ret->lights);
+            if (ret->lights.size() == first) {
+                continue;
+            }
+            ret->first_light[obj] = static_cast<uint32_t>(first);
+            for (size_t i = first; i < ret->lights.size(); ++i) {
+                LightBounds bounds = bounds_of(ret->lights[i], radiance);
+                if (bounds.phi > 0.0f) {
+                    bounded.emplace_back(bounds, static_cast<uint32_t>(i));
+                }
+            }
+        }
+
+        if (bounded.empty()) {
+            return nullptr;
+        }
+
+        ret->leaf_of.assign(ret->lights.size(), none);
+        ret->nodes.reserve(2 * bounded.size() - 1);
+        ret->build_node(bounded, 0, bounded.size(), none);
+
+        std::clog << "lights: " << bounded.size() << " emitters in a tree of " << ret->nodes.size() << " nodes" << std::endl;
+        return ret;
+    }
+
+    // picks a light for a diffuse point p with normal n, false if no light can reach it
+    bool sample(const glm::vec3 &p, const glm::vec3 &n, const glm::vec2 &u_light, const glm::vec2 &u_point, LightSample &out) const {
+        float u = u_light.x;
+        float pmf = 1.0f;
+        uint32_t node = 0;
+        while (!nodes[node].leaf) {
+            uint32_t first = node + 1, second = nodes[node].child;
+            float importance_first = nodes[first].bounds.importance(p, n);
+            float importance_second = nodes[second].bounds.importance(p, n);
+            if (importance_first <= 0.0f && importance_second <= 0.0f) {
+                return false;
+            }
+
+            // u is stretched over the chosen child, so it stays uniform for the next decision
+            float p_first = importance_first / (importance_first + importance_second);
+            if (u < p_first) {
+                node = first;
+                u = std::min(u / p_first, 0x1.fffffep-1f);
+                pmf *= p_first;
+            } else {
+                node = second;
+                u = std::min((u - p_first) / (1.0f - p_first), 0x1.fffffep-1f);
+                pmf *= 1.0f - p_first;
+            }
+        }
+        if (node == 0 && nodes[0].bounds.importance(p, n) <= 0.0f) {
+            return false;
+        }
+
+        const Emitter &emitter = lights[nodes[node].child];
+        float pdf;
+        if (!sample_emitter(emitter, p, u_point, out.direction, out.distance, pdf)) {
+            return false;
+        }
+        out.emitter = &emitter;
+        out.pdf = pmf * pdf;
+        return true;
+    }
+
+    // the pdf of sample() at p, n choosing the direction of a ray that hit a light at point
+    float pdf(const glm::vec3 &p, const glm::vec3 &n, const BVHHit &hit, const glm::vec3 &point) const {
+        auto it = first_light.find(hit.obj);
+        if (it == first_light.end() || it->second + hit.prim >= lights.size()) {
+            return 0.0f;
+        }
+        uint32_t light = it->second + hit.prim;
+        float pmf = pick_probability(p, n, light);
+        return pmf > 0.0f ? pmf * emitter_pdf(lights[light], p, point) : 0.0f;
+    }
+
+    // whether a shadow ray towards sample reached the sampled light first
+    static bool reached(const LightSample &sample, const BVHHit &hit) {
+        return hit.is_hit && hit.obj == sample.emitter->object && (sample.emitter->sphere || hit.t > sample.distance * 0.999f);
+    }
+
+private:
+    static LightBounds bounds_of(const Emitter &emitter, float radiance) {
+        LightBounds ret;
+        if (emitter.sphere) {
+            glm::vec3 r(emitter.radius, emitter.radius, emitter.radius);
+            ret.box = AABB(emitter.p0 - r, emitter.p0 + r);
+            ret.phi = radiance * std::numbers::pi_v<float> * 4.0f * std::numbers::pi_v<float> * emitter.radius * emitter.radius;
+            ret.normals = DirectionCone::entire_sphere();
+            return ret;
+        }
+
+        glm::vec3 cross = glm::cross(emitter.p1 - emitter.p0, emitter.p2 - emitter.p0);
+        float area = 0.5f * glm::length(cross);
+        if (area <= 0.0f) {
+            return ret;
+        }
+        ret.box = AABB(glm::min(emitter.p0, glm::min(emitter.p1, emitter.p2)), glm::max(emitter.p0, glm::max(emitter.p1, emitter.p2)));
+        // DiffuseLight emits from both faces
+        ret.phi = radiance * std::numbers::pi_v<float> * 2.0f * area;
+        ret.normals = DirectionCone{glm::normalize(cross), 1.0f};
+        ret.two_sided = true;
+        return ret;
+    }
+
+    // estimated cost of a node with bounds b, splitting a parent bounded by parent along axis
+    static float split_cost(const LightBounds &b, const AABB &parent, int32_t axis) {
+        float theta_o = safe_acos(b.normals.cos_theta);
+        float theta_e = safe_acos(b.cos_theta_e);
+        float theta_w = std::min(theta_o + theta_e, std::numbers::pi_v<float>);
+        float sin_theta_o = safe_sqrt(1.0f - b.normals.cos_theta * b.normals.cos_theta);
+        // solid angle the cone spreads its power over, cosine weighted past theta_o
+        float m_omega = 2.0f * std::numbers::pi_v<float> * (1.0f - b.normals.cos_theta) +
+            std::numbers::pi_v<float> / 2.0f * (2.0f * theta_w * sin_theta_o - std::cos(theta_o - 2.0f * theta_w) - 2.0f * theta_o * sin_theta_o + b.normals.cos_theta);
+
+        // splits across a thin axis are penalized, they leave boxes that are long in the others
+        glm::vec3 diagonal = parent.box_bb - parent.box_aa;
+        float k_r = std::max({diagonal.x, diagonal.y, diagonal.z}) / std::max(diagonal[axis], 1e-6f);
+
+        glm::vec3 d = b.box.box_bb - b.box.box_aa;
+        float area = 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+        return b.phi * m_omega * k_r * area;
+    }
+
+    uint32_t build_node(std::vector<std::pair<LightBounds, uint32_t>> &bounded, size_t begin, size_t end, uint32_t parent) {
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(Node{});
+        nodes[index].parent = parent;
+
+        if (end - begin == 1) {
+            nodes[index].bounds = bounded[begin].first;
+            nodes[index].child = bounded[begin].second;
+            nodes[index].leaf = true;
+            leaf_of[bounded[begin].second] = index;
+            return index;
+        }
+
+        LightBounds bounds;
+        glm::vec3 centroid_min(std::numeric_limits<float>::max());
+        glm::vec3 centroid_max(-std::numeric_limits<float>::max());
+        for (size_t i = begin; i < end; ++i) {
+            const LightBounds &b = bounded[i].first;
+            bounds = light_bounds_union(bounds, b);
+            glm::vec3 centroid = 0.5f * (b.box.box_aa + b.box.box_bb);
+            centroid_min = glm::min(centroid_min, centroid);
+            centroid_max = glm::max(centroid_max, centroid);
+        }
+
+        auto bucket_of = [&](const LightBounds &b, int32_t axis) {
+            float centroid = 0.5f * (b.box.box_aa[axis] + b.box.box_bb[axis]);
+            int32_t bucket = static_cast<int32_t>(buckets * (centroid - centroid_min[axis]) / (centroid_max[axis] - centroid_min[axis]));
+            return std::clamp(bucket, 0, buckets - 1);
+        };
+
+        // binned over the centroids of each axis, the split of least cost between two buckets
+        float best_cost = std::numeric_limits<float>::max();
+        int32_t best_axis = -1, best_bucket = -1;
+        for (int32_t axis = 0; axis < 3; ++axis) {
+            if (centroid_max[axis] <= centroid_min[axis]) {
+                continue;
+            }
+
+            LightBounds bucket_bounds[buckets];
+            for (size_t i = begin; i < end; ++i) {
+                LightBounds &b = bucket_bounds[bucket_of(bounded[i].first, axis)];
+                b = light_bounds_union(b, bounded[i].first);
+            }
+
+            for (int32_t split = 0; split < buckets - 1; ++split) {
+                LightBounds below, above;
+                for (int32_t b = 0; b <= split; ++b) {
+                    below = light_bounds_union(below, bucket_bounds[b]);
+                }
+                for (int32_t b = split + 1; b < buckets; ++b) {
+                    above = light_bounds_union(above, bucket_bounds[b]);
+                }
+                if (below.phi <= 0.0f || above.phi <= 0.0f) {
+                    continue;
+                }
+                float cost = split_cost(below, bounds.box, axis) + split_cost(above, bounds.box, axis);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bucket = split;
+                }
+            }
+        }
+
+        size_t mid = begin + (end - begin) / 2;
+        if (best_axis >= 0) {
+            auto it = std::partition(bounded.begin() + begin, bounded.begin() + end, [&](const std::pair<LightBounds, uint32_t> &light) {
+                return bucket_of(light.first, best_axis) <= best_bucket;
+            });
+            mid = static_cast<size_t>(it - bounded.begin());
+        }
+
+        build_node(bounded, begin, mid, index);
+        uint32_t second = build_node(bounded, mid, end, index);
+        nodes[index].bounds = bounds;
+        nodes[index].child = second;
+        nodes[index].leaf = false;
+        return index;
+    }
+
+    // the probability of sample() descending from the root to light's leaf
+    float pick_probability(const glm::vec3 &p, const glm::vec3 &n, uint32_t light) const {
+        uint32_t node = leaf_of[light];
+        if (node == none) {
+            return 0.0f;
+        }
+        if (node == 0) {
+            return nodes[0].bounds.importance(p, n) > 0.0f ? 1.0f : 0.0f;
+        }
+
+        float pmf = 1.0f;
+        while (node != 0) {
+            uint32_t parent = nodes[node].parent;
+            float importance_first = nodes[parent + 1].bounds.importance(p, n);
+            float importance_second = nodes[nodes[parent].child].bounds.importance(p, n);
+            float importance = node == parent + 1 ? importance_first : importance_second;
+            if (importance <= 0.0f) {
+                return 0.0f;
+            }
+            pmf *= importance / (importance_first + importance_second);
+            node = parent;
+        }
+        return pmf;
+    }
+
+    static glm::vec3 perpendicular(const glm::vec3 &w) {
+        glm::vec3 a = std::fabs(w.x) > 0.9f ? glm::vec3(0.0, 1.0, 0.0) : glm::vec3(1.0, 0.0, 0.0);
+        return glm::normalize(glm::cross(w, a));
+    }
+
+    // spheres are sampled uniformly in the cone they cover, triangles uniformly in area
+    static bool sample_emitter(const Emitter &emitter, const glm::vec3 &p, const glm::vec2 &u, glm::vec3 &direction, float &distance, float &pdf) {
+        if (emitter.sphere) {
+            glm::vec3 offset = emitter.p0 - p;
+            float d2 = glm::dot(offset, offset);
+            float r2 = emitter.radius * emitter.radius;
+            if (d2 <= r2) {
+                return false;
+            }
+            float sin2_max = r2 / d2;
+            float cos_max = safe_sqrt(1.0f - sin2_max);
+            // 1 - cos_max without the cancellation for small, distant spheres
+            float one_minus_cos_max = sin2_max / (1.0f + cos_max);
+
+            float cos_theta = 1.0f - u.x * one_minus_cos_max;
+            float sin_theta = safe_sqrt(1.0f - cos_theta * cos_theta);
+            float phi = 2.0f * std::numbers::pi_v<float> * u.y;
+
+            glm::vec3 w = offset / std::sqrt(d2);
+            glm::vec3 t = perpendicular(w);
+            glm::vec3 b = glm::cross(w, t);
+            direction = glm::normalize(t * (sin_theta * std::cos(phi)) + b * (sin_theta * std::sin(phi)) + w * cos_theta);
+            distance = std::numeric_limits<float>::infinity();
+            pdf = 1.0f / (2.0f * std::numbers::pi_v<float> * one_minus_cos_max);
+            return true;
+        }
+
+        float su = std::sqrt(u.x);
+        float b0 = 1.0f - su, b1 = u.y * su;
+        glm::vec3 point = emitter.p0 * b0 + emitter.p1 * b1 + emitter.p2 * (1.0f - b0 - b1);
+        glm::vec3 offset = point - p;
+        float d2 = glm::dot(offset, offset);
+        if (d2 <= 0.0f) {
+            return false;
+        }
+        distance = std::sqrt(d2);
+        direction = offset / distance;
+        pdf = triangle_pdf(emitter, direction, d2);
+        return pdf > 0.0f;
+    }
+
+    static float emitter_pdf(const Emitter &emitter, const glm::vec3 &p, const glm::vec3 &point) {
+        if (emitter.sphere) {
+            glm::vec3 offset = emitter.p0 - p;
+            float d2 = glm::dot(offset, offset);
+            float r2 = emitter.radius * emitter.radius;
+            if (d2 <= r2) {
+                return 0.0f;
+            }
+            float sin2_max = r2 / d2;
+            float one_minus_cos_max = sin2_max / (1.0f + safe_sqrt(1.0f - sin2_max));
+            return 1.0f / (2.0f * std::numbers::pi_v<float> * one_minus_cos_max);
+        }
+
+        glm::vec3 offset = point - p;
+        float d2 = glm::dot(offset, offset);
+        return d2 > 0.0f ? triangle_pdf(emitter, offset / std::sqrt(d2), d2) : 0.0f;
+    }
+
+    // area density converted to solid angle at distance^2 d2 along direction
+    static float triangle_pdf(const Emitter &emitter, const glm::vec3 &direction, float d2) {
+        glm::vec3 cross = glm::cross(emitter.p1 - emitter.p0, emitter.p2 - emitter.p0);
+        float double_area = glm::length(cross);
+        if (double_area <= 0.0f) {
+            return 0.0f;
+        }
+        float cos_light = std::fabs(glm::dot(cross, direction)) / double_area;
+        if (cos_light < 1e-6f) {
+            return 0.0f;
+        }
+        return d2 / (0.5f * double_area * cos_light);
+    }
+};
@@ -11,228 +11,390 @@
 #include <lodepng.h>
 #include <glm/glm.hpp>
 
-#define GLM_ENABLE_EXPERIMENTAL
-#include <glm/gtx/transform.hpp>
-
-
-
 #include <ray.h>
 #include <camera.h>
 #include <object.h>
-#include <material.h>
-#include <sphere.h>
-#include <triangle.h>
-#include <texture.h>
-
-void add_object(
-    World &world,
-    const std::string &filename,
-    const glm::vec3 &translate,
-    const glm::vec3 &rotate_axis,
-    const float rotate_angle, //degree
-    const glm::vec3 &scale,
-    std::shared_ptr<Material> &material
-) {
-    std::vector<glm::vec3> vertices;
-
-    std::ifstream ifs(filename);
-
-    std::string line;
-    while (getline(ifs, line)) {
-        std::istringstream iss(line);
-        std::string type;
-        iss >> type;
-        if (type == "v") {
-            glm::vec3 v;
-            iss >> v.x >> v.y >> v.z;
-            vertices.push_back(v);
-        } else if (type == "f") {
-            int32_t f[3];
-            iss >> f[0] >> f[1] >> f[2];
-
-            glm::mat4 transform_matrix = glm::mat4(1.0f);
-            transform_matrix = glm::translate(transform_matrix, translate);
-            transform_matrix = glm::rotate(transform_matrix, glm::radians(rotate_angle), rotate_axis);
-            transform_matrix = glm::scale(transform_matrix, scale);
-
-            auto apply_transform = [&](const glm::vec3& vertex) -> glm::vec3 {
-                glm::vec4 transformed_vertex = transform_matrix * glm::vec4(vertex, 1.0f);
-                return glm::vec3(transformed_vertex); // Convert back to 3D vector
-            };
-
-            Triangle triangle(
-                apply_transform(vertices[f[0]-1]),
-                apply_transform(vertices[f[1]-1]),
-                apply_transform(vertices[f[2]-1]),
-                material
-            );
-            world.add(triangle);
-        } else {
-            std::cout << "object parser error" << std::endl;
-        }
-    }
+#include <scene.h>
+#include <stats.h>
+#include <trace.h>
+#include <distributed.h>
+#include <animation.h>
+#include <image_writer.h>
+#include <multiview.h>
+
+void print_usage(const char *program) {
+    std::cout << "usage: " << program << " [options]" << std::endl
+              << "  --scene name              scene1, scene2, outdoor, lights, bunny, dragon, teapot or cow (default scene2)," << std::endl
+              << "                            or a .pmesh file written by --convert-mesh" << std::endl
+              << "  --width n --height n      image resolution (default 1280x720)" << std::endl
+              << "  --samples n               samples per pixel, overrides the scene's" << std::endl
+              << "  --max-depth n             bounces per path, overrides the scene's" << std::endl
+              << "  --output file             png to write (default outputs/output-<time>.png)" << std::endl
+              << "  --band-rows n             render n rows at a time and stream them to --output, memory is bound" << std::endl
+              << "                            by the band, not the image (.ppm output is also understood)" << std::endl
+              << "  --heatmap                 render traversal cost instead of radiance (make stats)" << std::endl
+              << "  --denoise                 filter the frame guided by first-hit features" << std::endl
+              << "  --sampler name            random, sobol or bluenoise (default sobol)" << std::endl
+              << "  --hit-cache file          reuse first hits from file while only materials change" << std::endl
+              << "  --hit-cache-mb n          largest hit cache file to create, 20 bytes per sample (default 4096)" << std::endl
+              << "                            (records them when the scene changed, needs sobol or bluenoise)" << std::endl
+              << "  --stats-file file         keep a json progress snapshot in file" << std::endl
+              << "  --trace file              write a chrome trace of loading, building and rendering (make trace)" << std::endl
+              << "  --progress-interval s     seconds between progress reports" << std::endl
+              << "  --quiet                   no progress line" << std::endl
+              << "  --pin                     pin each worker thread to one cpu" << std::endl
+              << "  --numa-replicate          pin, and keep a copy of the BVH and mesh BVHs on every NUMA node" << std::endl
+              << "                            (.pmesh scenes stay in their one page cache)" << std::endl
+              << "  --page-cache-mb n         memory for the pages of a .pmesh scene (default 256)" << std::endl
+              << "  --convert-mesh name file  write mesh scene name (bunny, dragon, ...) as a .pmesh file and exit" << std::endl
+              << "  --keyframes file          render every frame of a camera path (see animation.h)" << std::endl
+              << "  --turntable n             render n frames orbiting the scene's camera target" << std::endl
+              << "                            batch renders write to --output as a printf pattern" << std::endl
+              << "                            (default outputs/frame-%04d.png)" << std::endl
+              << "  --views file              render every view in a view file together (see multiview.h)" << std::endl
+              << "  --stereo d                render the left and right eye, d apart, together" << std::endl
+              << "                            views write to --output as a printf pattern" << std::endl
+              << "                            (default outputs/view-%d.png)" << std::endl
+              << "  --coordinator port        hand out tiles to workers connecting on port" << std::endl
+              << "  --worker host:port        render tiles for the coordinator at host:port" << std::endl
+              << "  --tile-size n             tile edge length for --coordinator (default 32)" << std::endl
+              << "  --tile-timeout s          hand a tile out again after s seconds (default off)" << std::endl;
 }
 
-void scene1(World &world, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width){
-    // Camera
-    glm::vec3 center(13.0, 2.0, 3.0);
-    glm::vec3 direction(-13.0, -2.0, -3.0);
-    direction = glm::normalize(direction);
-    glm::vec3 up(0.0, 1.0, 0.0);
-    //float fov = 80.00f / 360.0f * 2.0f * std::numbers::pi_v<float>;
-    float fov = 0.607537f;
-    int32_t samples = 50;
-    int32_t max_depth = 25;
-    float focal_distance = 10.0f;
-    float defocus_angle = 0.6f / 180.0f * std::numbers::pi_v<float>;
-
-    perspectiveCamera.setCamera(
-        center,
-        direction,
-        up,
-        height,
-        width,
-        fov,
-        focal_distance,
-        defocus_angle,
-        samples,
-        max_depth
-    );
+int32_t main(int32_t argc, char *argv[]) {
+    auto start = std::chrono::high_resolution_clock::now();
 
-    // World
-    // std::shared_ptr<ImageTexture> earth_texture = std::make_shared<ImageTexture>("data/earthmap.png");
-    std::shared_ptr<CheckerTexture> checker = std::make_shared<CheckerTexture>(0.32, glm::vec3(0.2, 0.3, 0.1), glm::vec3(0.9, 0.9, 0.9));
-
-    std::shared_ptr<Material> material_ground = std::make_shared<Lambertian>(checker);
-    Sphere sphere_ground(glm::vec3(0.0, -1000.0, 0.0), 1000.0, material_ground);
-    world.add(sphere_ground);
-
-    std::shared_ptr<Material> material1 = std::make_shared<Dielectric>(1.5f);
-    std::shared_ptr<Material> material2 = std::make_shared<Metal>(glm::vec3(0.7, 0.6, 0.5), 0.0);
-    // std::shared_ptr<Material> material3 = std::make_shared<Metal>(glm::vec3(0.1, 0.6, 0.1), 0.0);
-    std::shared_ptr<Material> material_light_yellow = std::make_shared<DiffuseLight>(glm::vec3(0.7, 0.7, 0.0));
-    std::shared_ptr<Material> material_light_purple = std::make_shared<DiffuseLight>(glm::vec3(0.7, 0.0, 0.7));
-    
-    // std::shared_ptr<Material> material3 = std::make_shared<Lambertian>(earth_texture);
-    Sphere sphere1(glm::vec3(-4.0, 1.0, 0.0), 1.0, material_light_yellow);
-    Sphere sphere2(glm::vec3(0.0, 1.0, 0.0), 1.0, material_light_purple);
-    Sphere sphere3(glm::vec3(4.0, 1.0, 0.0), 1.0, material_light_yellow);
-    world.add(sphere1);
-    world.add(sphere2);
-    world.add(sphere3);
-    // add_object(world, "data/prism.obj", glm::vec3(4.0, 1.0, 0.0), glm::vec3(0.0, 1.0, 0.0), 180.0f, glm::vec3(0.8, 0.8, 0.8), material1);    
-
-    for (float a = -11.0f; a < 11.0f; a = a + 1.0f) {
-        for (float b = -11.0f; b < 11.0f; b = b + 1.0f) {
-            float material_choice = random_float();
-
-            glm::vec3 sphere_center(a + 0.9f * random_float(), 0.2f, b + 0.9f * random_float());
-
-            if (glm::length(sphere_center - glm::vec3(4, 0.2, 0.0)) > 0.9f) {
-                std::shared_ptr<Material> material;
-
-                if (material_choice < 0.8f) {
-                    // diffuse
-                    glm::vec3 albedo = glm::vec3(random_float() * random_float(), random_float() * random_float(), random_float() * random_float());
-                    material = std::make_shared<Lambertian>(albedo);
-                } else if (material_choice < 0.95f) {
-                    // metal
-                    glm::vec3 albedo = glm::vec3(0.5f + 0.5f * random_float(), 0.5f + 0.5f * random_float(), 0.5f + 0.5f * random_float());
-                    float fuzz = random_float() * 0.5f;
-                    material = std::make_shared<Metal>(albedo, fuzz);
-                } else {
-                    // dielectric
-                    material = std::make_shared<Dielectric>(1.5f);
-                }
-                Sphere sphere(sphere_center, 0.2, material);
-                world.add(sphere);
+    std::string scene = "scene2";
+    std::string filename;
+    // image resolution
+    int32_t width = 2560/2;
+    int32_t height = 1440/2;
+    int32_t samples = -1;
+    int32_t max_depth = -1;
+    bool heatmap = false;
+    bool denoise = false;
+    SamplerMode sampler = SamplerMode::Sobol;
+    TelemetryConfig telemetry;
+    bool pin = false;
+    bool numa_replicate = false;
+    bool coordinator = false;
+    CoordinatorConfig coordinator_config;
+    std::string worker_address;
+    std::string keyframes;
+    int32_t turntable = 0;
+    size_t page_cache_bytes = 256 * 1024 * 1024;
+    std::string convert_mesh;
+    std::string convert_filename;
+    std::string hit_cache_filename;
+    uint64_t hit_cache_bytes = 4096ull * 1024 * 1024;
+    int32_t band_rows = 0;
+    std::string views_filename;
+    float stereo = 0.0f;
+    std::string trace_filename;
+
+    for (int32_t i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--scene" && i + 1 < argc) {
+            scene = argv[++i];
+        } else if (arg == "--width" && i + 1 < argc) {
+            width = std::stoi(argv[++i]);
+        } else if (arg == "--height" && i + 1 < argc) {
+            height = std::stoi(argv[++i]);
+        } else if (arg == "--samples" && i + 1 < argc) {
+            samples = std::stoi(argv[++i]);
+        } else if (arg == "--max-depth" && i + 1 < argc) {
+            max_depth = std::stoi(argv[++i]);
+        } else if (arg == "--output" && i + 1 < argc) {
+            filename = argv[++i];
+        } else if (arg == "--band-rows" && i + 1 < argc) {
+            band_rows = std::stoi(argv[++i]);
+        } else if (arg == "--heatmap") {
+            heatmap = true;
+        } else if (arg == "--denoise") {
+            denoise = true;
+        } else if (arg == "--sampler" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "random") {
+                sampler = SamplerMode::Random;
+            } else if (name == "sobol") {
+                sampler = SamplerMode::Sobol;
+            } else if (name == "bluenoise") {
+                sampler = SamplerMode::BlueNoise;
+            } else {
+                print_usage(argv[0]);
+                return 2;
             }
+        } else if (arg == "--hit-cache" && i + 1 < argc) {
+            hit_cache_filename = argv[++i];
+        } else if (arg == "--hit-cache-mb" && i + 1 < argc) {
+            hit_cache_bytes = static_cast<uint64_t>(std::stod(argv[++i]) * 1024 * 1024);
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_filename = argv[++i];
+        } else if (arg == "--stats-file" && i + 1 < argc) {
+            telemetry.stats_filename = argv[++i];
+        } else if (arg == "--progress-interval" && i + 1 < argc) {
+            telemetry.interval = std::stod(argv[++i]);
+        } else if (arg == "--quiet") {
+            telemetry.terminal = false;
+        } else if (arg == "--pin") {
+            pin = true;
+        } else if (arg == "--numa-replicate") {
+            pin = true;
+            numa_replicate = true;
+        } else if (arg == "--page-cache-mb" && i + 1 < argc) {
+            page_cache_bytes = static_cast<size_t>(std::stod(argv[++i]) * 1024 * 1024);
+        } else if (arg == "--convert-mesh" && i + 2 < argc) {
+            convert_mesh = argv[++i];
+            convert_filename = argv[++i];
+        } else if (arg == "--keyframes" && i + 1 < argc) {
+            keyframes = argv[++i];
+        } else if (arg == "--turntable" && i + 1 < argc) {
+            turntable = std::stoi(argv[++i]);
+        } else if (arg == "--views" && i + 1 < argc) {
+            views_filename = argv[++i];
+        } else if (arg == "--stereo" && i + 1 < argc) {
+            stereo = std::stof(argv[++i]);
+        } else if (arg == "--coordinator" && i + 1 < argc) {
+            coordinator = true;
+            coordinator_config.port = static_cast<uint16_t>(std::stoi(argv[++i]));
+        } else if (arg == "--worker" && i + 1 < argc) {
+            worker_address = argv[++i];
+        } else if (arg == "--tile-size" && i + 1 < argc) {
+            coordinator_config.tile_size = std::stoi(argv[++i]);
+        } else if (arg == "--tile-timeout" && i + 1 < argc) {
+            coordinator_config.tile_timeout = std::stod(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 2;
         }
     }
 
-}
+    if (heatmap && !ray_stats_enabled) {
+        std::cout << "--heatmap needs traversal statistics, build with `make stats`" << std::endl;
+        return 2;
+    }
 
-void scene2(World &world, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width){
-    // Camera
-    glm::vec3 center(0.0, 0.0, 10.0);
-    glm::vec3 direction(0.0, 0.0, -10.0);
-    direction = glm::normalize(direction);
-    glm::vec3 up(0.0, 1.0, 0.0);
-    float fov = 100.00f / 360.0f * 2.0f * std::numbers::pi_v<float>;
-    // float fov = 0.607537f;
-    int32_t samples = 1000;
-    int32_t max_depth = 50;
-    float focal_distance = 10.0f;
-    float defocus_angle = 0.6f / 180.0f * std::numbers::pi_v<float>;
-
-    perspectiveCamera.setCamera(
-        center,
-        direction,
-        up,
-        height,
-        width,
-        fov,
-        focal_distance,
-        defocus_angle,
-        samples,
-        max_depth
-    );
+    if (!trace_filename.empty() && !ray_trace_enabled) {
+        std::cout << "--trace needs phase timers, build with `make trace`" << std::endl;
+        return 2;
+    }
+
+    // written on the way out, after every pool below has stopped
+    TraceExport trace_export(trace_filename);
+    RAY_TRACE_THREAD_NAME("main");
 
-    // World
+    if (!convert_mesh.empty()) {
+        const MeshScene *mesh = find_mesh_scene(convert_mesh);
+        if (mesh == nullptr) {
+            std::cout << "unknown mesh scene " << convert_mesh << std::endl;
+            return 2;
+        }
+        return write_paged_mesh(load_mesh_scene_triangles(*mesh), convert_filename) ? 0 : 1;
+    }
 
-    std::shared_ptr<Material> material_left_wall = std::make_shared<Lambertian>(glm::vec3(0.0, 0.8, 0.0)); // g
-    std::shared_ptr<Material> material_right_wall = std::make_shared<Lambertian>(glm::vec3(0.8, 0.0, 0.0)); // r
-    std::shared_ptr<Material> material_wall = std::make_shared<Lambertian>(glm::vec3(1.0, 1.0, 1.0));
+    if (!hit_cache_filename.empty() && sampler == SamplerMode::Random) {
+        std::cout << "--hit-cache needs a sample sequence that can be replayed, use --sampler sobol or bluenoise" << std::endl;
+        return 2;
+    }
 
-    std::shared_ptr<Material> material_light = std::make_shared<DiffuseLight>(glm::vec3(7.0, 7.0, 7.0));
+    int32_t num_process = std::thread::hardware_concurrency();
 
-    std::shared_ptr<Material> material_glass = std::make_shared<Dielectric>(1.5f);
+    if (!worker_address.empty()) {
+        size_t colon = worker_address.rfind(':');
+        if (colon == std::string::npos) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        std::string host = worker_address.substr(0, colon);
+        uint16_t port = static_cast<uint16_t>(std::stoi(worker_address.substr(colon + 1)));
+        return RenderWorker::run(host, port, num_process);
+    }
 
-    add_object(world, "data/plate.obj", glm::vec3(0.0, -5.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 0.0f, glm::vec3(10.0, 10.0, 10.0), material_wall); // down
-    add_object(world, "data/plate.obj", glm::vec3(0.0, 5.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 180.0f, glm::vec3(10.0, 10.0, 10.0), material_wall); // up
-    add_object(world, "data/plate.obj", glm::vec3(5.0, 0.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 90.0f, glm::vec3(10.0, 10.0, 10.0), material_left_wall); // left
-    add_object(world, "data/plate.obj", glm::vec3(-5.0, 0.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 270.0f, glm::vec3(10.0, 10.0, 10.0), material_right_wall); // right
-    add_object(world, "data/plate.obj", glm::vec3(0.0, 0.0, -5.0), glm::vec3(1.0, 0.0, 0.0), 90.0f, glm::vec3(10.0, 10.0, 10.0), material_wall); // back
+    bool batch = !keyframes.empty() || turntable > 0;
 
-    add_object(world, "data/plate.obj", glm::vec3(0.0, 5.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 180.0f, glm::vec3(3.0, 3.0, 3.0), material_light); // up
+    if (!hit_cache_filename.empty() && (batch || coordinator)) {
+        std::cout << "--hit-cache only applies to single frames rendered here" << std::endl;
+        return 2;
+    }
 
-    add_object(world, "data/dragon.obj", glm::vec3(0.0, 0.0, 0.0), glm::vec3(0.0, 1.0, 0.0), 90.0f, glm::vec3(2.5, 2.5, 2.5), material_glass);
+    if (heatmap && !hit_cache_filename.empty()) {
+        std::cout << "--heatmap counts the traversal of every ray, --hit-cache skips tracing primary rays" << std::endl;
+        return 2;
+    }
 
-}
+    if (heatmap && coordinator) {
+        std::cout << "--heatmap only applies to frames rendered here, workers trace radiance" << std::endl;
+        return 2;
+    }
 
-int32_t main(int32_t argc, char *argv[]) {
-    auto start = std::chrono::high_resolution_clock::now();
+    if (band_rows > 0 && (batch || coordinator || denoise || heatmap || !hit_cache_filename.empty())) {
+        std::cout << "--band-rows renders a single frame here, without --denoise, --heatmap or --hit-cache" << std::endl;
+        return 2;
+    }
 
-    auto now = std::chrono::system_clock::now();
-    std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-    std::stringstream ss;
-    ss << "outputs/output-" << std::put_time(std::localtime(&now_c), "%FT%T") << ".png";
-    std::string filename = ss.str();
+    bool multiview = !views_filename.empty() || stereo > 0.0f;
 
-    // image resolution
-    int32_t width = 2560/2;
-    int32_t height = 1440/2;
-    std::vector<uint8_t> image(height * width * 4); // rgba
+    if (multiview && (batch || coordinator || band_rows > 0 || heatmap || !hit_cache_filename.empty() || (!views_filename.empty() && stereo > 0.0f))) {
+        std::cout << "--views or --stereo renders one set of views here, without --heatmap, --hit-cache, --band-rows or batch renders" << std::endl;
+        return 2;
+    }
+
+    if (filename.empty() && batch) {
+        filename = "outputs/frame-%04d.png";
+    } else if (filename.empty() && multiview) {
+        filename = "outputs/view-%d.png";
+    } else if (filename.empty()) {
+        auto now = std::chrono::system_clock::now();
+        std::time_t now_c = std::chrono::system_clock::to_time_t(now);
+        std::stringstream ss;
+        ss << "outputs/output-" << std::put_time(std::localtime(&now_c), "%FT%T") << ".png";
+        filename = ss.str();
+    }
 
     // materials
     World world;
     PerspectiveCamera perspectiveCamera;
 
-    scene2(world, perspectiveCamera, height, width); // lots of balls
+    // loads the scene, then renders
+    ThreadPool pool(num_process);
+    perspectiveCamera.setThreadPool(&pool);
+
+    // scenes with random placement must come out as they do on remote workers, see RenderWorker::run
+    seed_random(0);
+
+    SceneOptions scene_options;
+    scene_options.page_cache_bytes = page_cache_bytes;
+    scene_options.pool = &pool;
+    if (!load_scene(scene, world, perspectiveCamera, height, width, scene_options)) {
+        std::cout << "unknown scene " << scene << std::endl;
+        return 2;
+    }
+
+    perspectiveCamera.setSamples(
+        samples > 0 ? samples : perspectiveCamera.getSamples(),
+        max_depth > 0 ? max_depth : perspectiveCamera.getMaxDepth()
+    );
 
     // render
-    perspectiveCamera.render(image, world);
+    perspectiveCamera.setHeatmap(heatmap);
+    perspectiveCamera.setDenoise(denoise);
+    perspectiveCamera.setSampler(sampler);
+    perspectiveCamera.setTelemetry(telemetry);
+
+    std::unique_ptr<WorkerPlacement> placement;
+    if (pin) {
+        placement = std::make_unique<WorkerPlacement>(NumaTopology::detect(), num_process, true);
+        perspectiveCamera.setPlacement(placement.get());
+        std::clog << "pinning " << num_process << " workers over " << placement->node_count() << " NUMA node(s)" << std::endl;
+    }
 
-    uint32_t error = lodepng::encode(filename, image, width, height);
-    if (error) {
-        std::cout << "encoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
+    // the scene's BVH, with a copy on every NUMA node if asked
+    auto build_bvh = [&]() {
+        BVH bvh(world);
+        if (numa_replicate) {
+            placement->replicate(bvh);
+        }
+        return bvh;
+    };
+
+    // the end of every mode: page cache and traversal statistics, then the time since start
+    auto finish_run = [&](int32_t status) {
+        print_page_cache_stats(world);
+        world.destroy();
+
+        if (ray_stats_enabled && !coordinator) {
+            std::cout << std::endl;
+            GlobalStats::instance().get().print(std::cout);
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << std::endl << "Execution time: " << elapsed.count() << " seconds" << std::endl;
+        return status;
+    };
+
+    if (batch) {
+        CameraPath path;
+        if (!keyframes.empty() && !path.load(keyframes)) {
+            std::cout << "cannot read keyframes from " << keyframes << std::endl;
+            return 2;
+        } else if (keyframes.empty()) {
+            path = CameraPath::turntable(perspectiveCamera.getPose(), turntable);
+        }
+
+        BVH bvh = build_bvh();
+        render_animation(perspectiveCamera, world, bvh, path, filename, pool);
+        return finish_run(0);
     }
 
-    world.destroy();
+    if (multiview) {
+        std::vector<CameraPose> poses = stereo > 0.0f ? perspectiveCamera.stereoPoses(stereo) : load_views(views_filename);
+        if (poses.empty()) {
+            std::cout << "cannot read views from " << views_filename << std::endl;
+            return 2;
+        }
 
-    auto finish = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed = finish - start;
-    std::cout << std::endl << "Execution time: " << elapsed.count() << " seconds" << std::endl;
-}
+        BVH bvh = build_bvh();
+        bool written = render_multiview(perspectiveCamera, world, bvh, poses, filename, num_process);
+        return finish_run(written ? 0 : 1);
+    }
+
+    if (band_rows > 0) {
+        BVH bvh = build_bvh();
+        bool written = render_streaming(perspectiveCamera, world, bvh, filename, band_rows, num_process);
+        return finish_run(written ? 0 : 1);
+    }
+
+    std::vector<uint8_t> image(height * width * 4); // rgba
+
+    if (coordinator) {
+        // workers load their own copy, the coordinator only merges
+        world.destroy();
+
+        JobMessage job = {};
+        std::snprintf(job.scene, sizeof(job.scene), "%s", scene.c_str());
+        job.height = height;
+        job.width = width;
+        job.samples = perspectiveCamera.getSamples();
+        job.max_depth = perspectiveCamera.getMaxDepth();
+        job.seed = 0;
+        job.has_features = perspectiveCamera.needsFeatures();
+        job.sampler = static_cast<int32_t>(sampler);
+
+        FrameBuffer frame(height, width, perspectiveCamera.needsFeatures());
+        if (!Coordinator(coordinator_config, job).run(frame)) {
+            return 1;
+        }
+        perspectiveCamera.finish(frame, image, num_process);
+    } else {
+        std::unique_ptr<HitCache> hit_cache;
+        if (!hit_cache_filename.empty()) {
+            uint64_t bytes = HitCache::file_bytes(height, width, perspectiveCamera.getSamples());
+            if (bytes > hit_cache_bytes) {
+                std::cout << "hit cache: " << height << "x" << width << " at " << perspectiveCamera.getSamples() << " samples needs "
+                          << bytes / (1024 * 1024) << " MiB, over the --hit-cache-mb limit of " << hit_cache_bytes / (1024 * 1024) << " MiB" << std::endl;
+                return 2;
+            }
+            hit_cache = std::make_unique<HitCache>(hit_cache_filename, world, perspectiveCamera.primaryHitHash(world), height, width, perspectiveCamera.getSamples());
+            if (hit_cache->good()) {
+                perspectiveCamera.setHitCache(hit_cache.get());
+            }
+        }
 
+        BVH bvh = build_bvh();
+        perspectiveCamera.render(image, world, bvh);
+        if (hit_cache) {
+            hit_cache->save();
+        }
+    }
 
+    uint32_t error;
+    {
+        RAY_TRACE_SCOPE("encode png");
+        error = lodepng::encode(filename, image, width, height);
+    }
+    if (error) {
+        std::cout << "encoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
+    }
+
+    return finish_run(0);
+}
@@ -4,8 +4,31 @@
 #include <object.h>
 #include <texture.h>
 
+// lets the render kernels dispatch to the concrete material without a virtual call
+enum class MaterialKind : uint32_t {
+    Other = 0,
+    Lambertian = 1,
+    Metal = 2,
+    Dielectric = 3,
+    DiffuseLight = 4
+};
+
+constexpr uint32_t material_bit(MaterialKind kind) {
+    return 1u << static_cast<uint32_t>(kind);
+}
+
 class Material {
 public:
+    const MaterialKind kind;
+
+    Material(MaterialKind kind = MaterialKind::Other) : kind(kind) {}
+    virtual ~Material() = default;
+
+    // whether shading looks up a texture other than a SolidTexture
+    virtual bool has_texture() const {
+        return false;
+    }
+
     virtual std::tuple<bool, glm::vec3, Ray> scatter(const Ray &r, const ColorHit &hit) const {
         return std::make_tuple(false, glm::vec3(0, 0, 0), Ray());
     }
@@ -13,20 +36,43 @@ public:
     virtual glm::vec3 emitted(const ColorHit &hit) const {
         return glm::vec3(0, 0, 0);
     }
+
+    // surface colour for the denoiser's feature buffer
+    virtual glm::vec3 surface_albedo(const ColorHit &hit) const {
+        return glm::vec3(1, 1, 1);
+    }
 };
 
 
-class Lambertian : public Material {
+class Lambertian final : public Material {
     std::shared_ptr<Texture> texture;
+    bool solid;
+    glm::vec3 solid_albedo;
 
 public:
-    Lambertian(const glm::vec3 albedo) :  texture(std::make_shared<SolidTexture>(albedo)) {}
-    Lambertian(const std::shared_ptr<Texture> &texture) :  texture(texture) {}
+    Lambertian(const glm::vec3 albedo) : Lambertian(std::make_shared<SolidTexture>(albedo)) {}
+    Lambertian(const std::shared_ptr<Texture> &texture) : Material(MaterialKind::Lambertian), texture(texture) {
+        solid = dynamic_cast<const SolidTexture*>(texture.get()) != nullptr;
+        solid_albedo = solid ? texture->value(0.0f, 0.0f, glm::vec3(0.0, 0.0, 0.0)) : glm::vec3(0.0, 0.0, 0.0);
+    }
+
+    bool has_texture() const override {
+        return !solid;
+    }
 
     std::tuple<bool, glm::vec3, Ray> scatter(
         const Ray &r,
         const ColorHit &hit
     ) const override {
+        return scatter_kernel<true>(r, hit);
+    }
+
+    // Textures = false skips the texture lookup, only valid if !has_texture()
+    template <bool Textures>
+    std::tuple<bool, glm::vec3, Ray> scatter_kernel(
+        const Ray &r,
+        const ColorHit &hit
+    ) const {
         glm::vec3 scattered_direction = hit.normal + random_sphere();
 
         // Catch bad scatter direction
@@ -37,17 +83,21 @@ public:
         }
 
         Ray scattered = Ray(hit.point, glm::normalize(scattered_direction));
-        glm::vec3 attenuation = texture->value(hit.u, hit.v, hit.point);
+        glm::vec3 attenuation = Textures ? texture->value(hit.u, hit.v, hit.point) : solid_albedo;
         return std::make_tuple(true, attenuation, scattered);
     }
+
+    glm::vec3 surface_albedo(const ColorHit &hit) const override {
+        return texture->value(hit.u, hit.v, hit.point);
+    }
 };
 
-class Metal : public Material {
+class Metal final : public Material {
     glm::vec3 albedo;
     float fuzz;
 
 public:
-    Metal(const glm::vec3 albedo, float fuzz) : albedo(albedo), fuzz(fuzz) {}
+    Metal(const glm::vec3 albedo, float fuzz) : Material(MaterialKind::Metal), albedo(albedo), fuzz(fuzz) {}
 
     std::tuple<bool, glm::vec3, Ray> scatter(
         const Ray &r,
@@ -61,17 +111,21 @@ public:
         return std::make_tuple(is_scattered, attenuation, scattered);
     }
 
+    glm::vec3 surface_albedo(const ColorHit &hit) const override {
+        return albedo;
+    }
+
 private:
     inline glm::vec3 reflect(const glm::vec3 &direction, const glm::vec3 &normal) const {
         return direction - 2 * glm::dot(direction, normal) * normal;
     }
 };
 
-class Dielectric : public Material {
+class Dielectric final : public Material {
     float refractive_index;
 
 public:
-    Dielectric(float refractive_index) : refractive_index(refractive_index) {}
+    Dielectric(float refractive_index) : Material(MaterialKind::Dielectric), refractive_index(refractive_index) {}
 
     std::tuple<bool, glm::vec3, Ray> scatter(
         const Ray &r,
@@ -83,7 +137,7 @@ public:
         float sin_theta = std::sqrt(1.0f - cos_theta * cos_theta);
 
         glm::vec3 direction;
-        if (refractive_index_face * sin_theta > 1.0f || schlick_reflectance(cos_theta, refractive_index_face) > random_float()) {
+        if (refractive_index_face * sin_theta > 1.0f || schlick_reflectance(cos_theta, refractive_index_face) > random_2d().x) {
             direction = reflect(r.direction, hit.normal);
         } else {
             direction = refract(r.direction, hit.normal, refractive_index_face);
@@ -110,14 +164,46 @@ private:
     }
 };
 
-class DiffuseLight : public Material {
+class DiffuseLight final : public Material {
     std::shared_ptr<Texture> texture;
+    bool solid;
+    glm::vec3 solid_emit;
 
 public:
-    DiffuseLight(std::shared_ptr<Texture> texture) : texture(texture) {}
-    DiffuseLight(const glm::vec3& emit) : texture(std::make_shared<SolidTexture>(emit)) {}
+    DiffuseLight(std::shared_ptr<Texture> texture) : Material(MaterialKind::DiffuseLight), texture(texture) {
+        solid = dynamic_cast<const SolidTexture*>(texture.get()) != nullptr;
+        solid_emit = solid ? texture->value(0.0f, 0.0f, glm::vec3(0.0, 0.0, 0.0)) : glm::vec3(0.0, 0.0, 0.0);
+    }
+    DiffuseLight(const glm::vec3& emit) : DiffuseLight(std::make_shared<SolidTexture>(emit)) {}
+
+    bool has_texture() const override {
+        return !solid;
+    }
 
     glm::vec3 emitted(const ColorHit &hit) const override {
-        return texture->value(hit.u, hit.v, hit.point);
+        return emitted_kernel<true>(hit);
+    }
+
+    template <bool Textures>
+    glm::vec3 emitted_kernel(const ColorHit &hit) const {
+        return Textures ? texture->value(hit.u, hit.v, hit.point) : solid_emit;
+    }
+
+    // mean emitted radiance, a textured light is estimated from an 8x8 grid of its uv space
+    glm::vec3 average_emit() const {
+        if (solid) {
+            return solid_emit;
+        }
+        glm::vec3 sum(0.0, 0.0, 0.0);
+        for (int32_t j = 0; j < 8; ++j) {
+            for (int32_t i = 0; i < 8; ++i) {
+                sum += texture->value((static_cast<float>(i) + 0.5f) / 8.0f, (static_cast<float>(j) + 0.5f) / 8.0f, glm::vec3(0.0, 0.0, 0.0));
+            }
+        }
+        return sum / 64.0f;
+    }
+
+    glm::vec3 surface_albedo(const ColorHit &hit) const override {
+        return glm::min(texture->value(hit.u, hit.v, hit.point), glm::vec3(1, 1, 1));
     }
 };
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <object.h>
+#include <triangle.h>
+#include <bvh.h>
+
+/*
+a triangle mesh as one object with its own BVH
+
+the scene's BVH only sees the mesh's box, and a ray that enters it continues in the mesh's
+tree. every mesh is built on its own, so a scene's meshes can be built in parallel, and as
+soon as each is parsed (see SceneLoader).
+*/
+
+/*
+inside a single mesh spatial splits are only worth it where children overlap a lot: the long
+walls around small detailed objects that made them pay off for whole scenes are now apart in
+different meshes. this also builds the dragon in about half the time
+*/
+inline BVHConfig mesh_bvh_config() {
+    BVHConfig config;
+    config.split_alpha = 1e-3f;
+    return config;
+}
+
+struct MeshData {
+    std::vector<Triangle> triangles;
+    BVH bvh;
+    AABB box;
+    double build_s = 0.0;   // spent building bvh, for the benchmark
+
+    MeshData(const std::vector<std::array<glm::vec3, 3>> &vertices, std::shared_ptr<Material> mat, const BVHConfig &config = mesh_bvh_config()) {
+        triangles.reserve(vertices.size());
+        for (const std::array<glm::vec3, 3> &v : vertices) {
+            triangles.emplace_back(v[0], v[1], v[2], mat);
+        }
+
+        std::vector<const Object*> primitives;
+        for (const Triangle &triangle : triangles) {
+            primitives.push_back(&triangle);
+            box = primitives.size() == 1 ? triangle.aabb() : AABB(box, triangle.aabb());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bvh = BVH(primitives, config);
+        build_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // a copy of other in memory first touched by the calling thread, the tree is copied, not rebuilt
+    MeshData(const MeshData &other, const std::vector<Triangle> &triangles) : triangles(triangles), bvh(other.bvh), box(other.box) {
+        const Triangle *from = other.triangles.data();
+        const Triangle *to = this->triangles.data();
+        bvh.remap_objects([from, to](const Object *object) -> const Object* {
+            return to + (static_cast<const Triangle*>(object) - from);
+        });
+    }
+
+    MeshData(const MeshData&) = delete;
+    MeshData& operator=(const MeshData&) = delete;
+};
+
+class Mesh : public Object {
+    std::shared_ptr<const MeshData> data;
+    std::shared_ptr<Material> mat;
+
+    // per NUMA node copies of data, filled before rendering by replicate_to_node
+    mutable std::vector<std::shared_ptr<const MeshData>> node_data;
+
+    // the copy of the calling worker's node, or the shared one
+    const MeshData &local() const {
+        int32_t node = thread_numa_node();
+        if (node >= 0 && static_cast<size_t>(node) < node_data.size() && node_data[node] != nullptr) {
+            return *node_data[node];
+        }
+        return *data;
+    }
+
+public:
+    Mesh(std::shared_ptr<const MeshData> data, std::shared_ptr<Material> mat) : data(data), mat(mat) {}
+
+    AABB aabb() const override {
+        return data->box;
+    }
+
+    const Material* material() const override {
+        return mat.get();
+    }
+
+    const MeshData &mesh_data() const {
+        return *data;
+    }
+
+    size_t triangle_count() const {
+        return data->triangles.size();
+    }
+
+    BVHHit bvh_hit(const Ray &r, float tmin, float tmax) const override {
+        const MeshData &mesh = local();
+        BVHHit ret = mesh.bvh.hit(r, tmin, tmax);
+        if (ret.is_hit) {
+            ret.prim = static_cast<uint32_t>(static_cast<const Triangle*>(ret.obj) - mesh.triangles.data());
+        }
+        return ret;
+    }
+
+    ColorHit hit(const BVHHit &bvhhit, const Ray &r, float tmin, float tmax) const override {
+        return local().triangles[bvhhit.prim].hit(bvhhit, r, tmin, tmax);
+    }
+
+    void replicate_to_node(int32_t node) const override {
+        // copied on this thread so its pages land on the node, only the table is shared
+        std::shared_ptr<const MeshData> copy = std::make_shared<MeshData>(*data, data->triangles);
+
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (node_data.size() <= static_cast<size_t>(node)) {
+            node_data.resize(node + 1);
+        }
+        node_data[node] = copy;
+    }
+
+    void hash_geometry(GeometryHash &hash) const override {
+        for (const Triangle &triangle : data->triangles) {
+            triangle.hash_geometry(hash);
+        }
+    }
+
+    // every triangle, as the mesh's own emitters with prim its index
+    void emitters(std::vector<Emitter> &out) const override {
+        size_t first = out.size();
+        for (const Triangle &triangle : data->triangles) {
+            triangle.emitters(out);
+        }
+        for (size_t i = first; i < out.size(); ++i) {
+            out[i].object = this;
+            out[i].prim = static_cast<uint32_t>(i - first);
+        }
+    }
+};
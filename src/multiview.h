@@ -0,0 +1,68 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <lodepng.h>
+
+#include <camera.h>
+#include <animation.h>
+#include <bvh.h>
+#include <object.h>
+#include <trace.h>
+
+/*
+several views of one scene rendered together
+
+a view file uses the keyframe format of animation.h with the view's index in the frame column,
+views between two listed ones are interpolated like frames. --stereo makes the two eyes of the
+camera instead. all views are traced in one pass over the same BVH and workers, see
+PerspectiveCamera::render_views, then denoised, tonemapped and written one by one.
+*/
+
+// the views of a view file, as the frames of a camera path
+inline std::vector<CameraPose> load_views(const std::string &filename) {
+    CameraPath path;
+    std::vector<CameraPose> poses;
+    if (!path.load(filename)) {
+        return poses;
+    }
+    for (int32_t view = 0; view < path.frame_count(); ++view) {
+        poses.push_back(path.at(view));
+    }
+    return poses;
+}
+
+// renders every pose and writes view v to the printf style pattern filled with v
+inline bool render_multiview(
+    PerspectiveCamera &camera,
+    const World &world,
+    const BVH &bvh,
+    const std::vector<CameraPose> &poses,
+    const std::string &pattern,
+    int32_t num_process
+) {
+    int32_t height = camera.getHeight();
+    int32_t width = camera.getWidth();
+
+    std::vector<FrameBuffer> frames;
+    camera.render_views(frames, poses, world, bvh, num_process);
+
+    bool ok = true;
+    std::vector<uint8_t> image(height * width * 4);
+    for (size_t view = 0; view < frames.size(); ++view) {
+        camera.finish(frames[view], image, num_process);
+
+        std::string filename = frame_filename(pattern, static_cast<int32_t>(view));
+        RAY_TRACE_SCOPE_ARG("encode png", "view", view);
+        uint32_t error = lodepng::encode(filename, image, width, height);
+        if (error) {
+            std::cout << "encoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
+            ok = false;
+        }
+
+        std::clog << "view " << view + 1 << " / " << frames.size() << " -> " << filename << std::endl;
+    }
+    return ok;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <bvh.h>
+
+/*
+NUMA-aware placement of render workers
+
+workers always share one read-only World and BVH by reference. on multi-socket machines the
+BVH is traversed far more than anything else, so a WorkerPlacement can keep one copy of it per
+NUMA node: each copy is made by a thread pinned to that node, so the kernel's first-touch
+policy puts its pages in that node's memory, and a worker pinned to the node traverses the
+local copy. meshes, which carry a BVH of their own, copy their triangles and tree to every
+node as well; the remaining primitives stay shared.
+*/
+
+// "0-3,8,10-11", the format of /sys/devices/system/node/node*/cpulist
+inline std::vector<int32_t> parse_cpu_list(const std::string &list) {
+    std::vector<int32_t> ret;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int32_t first = std::stoi(range.substr(0, dash));
+        int32_t last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int32_t cpu = first; cpu <= last; ++cpu) {
+            ret.push_back(cpu);
+        }
+    }
+    return ret;
+}
+
+// binds the calling thread to one cpu
+inline bool pin_thread(int32_t cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+struct NumaTopology {
+    // cpus of every node that has any
+    std::vector<std::vector<int32_t>> node_cpus;
+
+    int32_t node_count() const {
+        return static_cast<int32_t>(node_cpus.size());
+    }
+
+    // reads sysfs, falls back to a single node holding every cpu
+    static NumaTopology detect() {
+        NumaTopology ret;
+
+        std::error_code error;
+        std::vector<int32_t> node_ids;
+        for (const auto &entry : std::filesystem::directory_iterator("/sys/devices/system/node", error)) {
+            std::string name = entry.path().filename().string();
+            if (name.rfind("node", 0) == 0 && name.size() > 4 && std::isdigit(static_cast<unsigned char>(name[4]))) {
+                node_ids.push_back(std::stoi(name.substr(4)));
+            }
+        }
+        std::sort(node_ids.begin(), node_ids.end());
+
+        for (int32_t node : node_ids) {
+            std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            std::getline(ifs, list);
+            std::vector<int32_t> cpus = parse_cpu_list(list);
+            // memory-only nodes have nothing to run workers on
+            if (!cpus.empty()) {
+                ret.node_cpus.push_back(cpus);
+            }
+        }
+
+        if (ret.node_cpus.empty()) {
+            std::vector<int32_t> cpus;
+            for (int32_t cpu = 0; cpu < static_cast<int32_t>(std::thread::hardware_concurrency()); ++cpu) {
+                cpus.push_back(cpu);
+            }
+            ret.node_cpus.push_back(cpus);
+        }
+        return ret;
+    }
+};
+
+class WorkerPlacement {
+    NumaTopology topology;
+    bool pin;
+    std::vector<int32_t> worker_cpu;
+    std::vector<int32_t> worker_node;
+    std::vector<std::unique_ptr<BVH>> replicas;
+
+public:
+    // workers are dealt round robin over the nodes, so every node gets its share of any count
+    WorkerPlacement(const NumaTopology &topology, int32_t num_workers, bool pin) : topology(topology), pin(pin) {
+        std::vector<size_t> next_cpu(topology.node_count(), 0);
+        for (int32_t worker_id = 0; worker_id < num_workers; ++worker_id) {
+            int32_t node = worker_id % topology.node_count();
+            const std::vector<int32_t> &cpus = topology.node_cpus[node];
+            worker_cpu.push_back(cpus[next_cpu[node]++ % cpus.size()]);
+            worker_node.push_back(node);
+        }
+    }
+
+    WorkerPlacement(const WorkerPlacement&) = delete;
+    WorkerPlacement& operator=(const WorkerPlacement&) = delete;
+
+    // one copy of bvh and of its objects' own trees per node, each written by a thread running
+    // on that node. a single node keeps using bvh itself
+    void replicate(const BVH &bvh) {
+        replicas.clear();
+        if (topology.node_count() < 2) {
+            std::clog << "numa: single node, workers share one BVH" << std::endl;
+            return;
+        }
+
+        replicas.resize(topology.node_count());
+        std::vector<const Object*> objects = bvh.unique_objects();
+        std::vector<std::thread> threads;
+        for (int32_t node = 0; node < topology.node_count(); ++node) {
+            threads.emplace_back([this, &bvh, &objects, node]() {
+                pin_thread(topology.node_cpus[node][0]);
+                replicas[node] = std::make_unique<BVH>(bvh);
+                for (const Object *object : objects) {
+                    object->replicate_to_node(node);
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        std::clog << "numa: one BVH per node on " << topology.node_count() << " nodes" << std::endl;
+    }
+
+    int32_t node_count() const {
+        return topology.node_count();
+    }
+
+    int32_t replica_count() const {
+        return static_cast<int32_t>(replicas.size());
+    }
+
+    // called by worker worker_id before it renders: pins it if asked, and returns the BVH it should use
+    const BVH &bind_worker(int32_t worker_id, const BVH &bvh) const {
+        size_t slot = static_cast<size_t>(worker_id) % worker_cpu.size();
+        if (pin) {
+            pin_thread(worker_cpu[slot]);
+        }
+        thread_numa_node() = replicas.empty() ? -1 : worker_node[slot];
+        return replicas.empty() ? bvh : *replicas[worker_node[slot]];
+    }
+};
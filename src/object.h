@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include <glm/glm.hpp>
 
@@ -9,11 +10,15 @@
 
 class Material;
 class Object;
+class EnvironmentMap;
+class LightBVH;
 
 struct BVHHit {
     bool is_hit;
     float t;
     const Object* obj;
+    uint32_t prim = 0; // which primitive of obj, for objects holding many
+    float u = 0.0f, v = 0.0f; // barycentrics, for primitives whose intersection test finds them
 };
 
 struct ColorHit {
@@ -26,6 +31,32 @@ struct ColorHit {
     bool is_front;
 };
 
+// one primitive of an object as the light BVH samples it, a sphere or a triangle (see light_bvh.h)
+struct Emitter {
+    const Object *object = nullptr;
+    uint32_t prim = 0;      // as bvh_hit reports it
+    bool sphere = false;
+    glm::vec3 p0, p1, p2;   // the triangle's vertices, or the sphere's center in p0
+    float radius = 0.0f;
+};
+
+// FNV-1a over the geometry of a scene, tells whether cached hits still match it
+struct GeometryHash {
+    uint64_t value = 14695981039346656037ull;
+
+    void add(const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            value = (value ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+
+    template <typename T>
+    void add(const T &v) {
+        add(&v, sizeof(T));
+    }
+};
+
 class AABB {
 public:
     glm::vec3 box_aa, box_bb;
@@ -81,6 +112,12 @@ public:
 };
 
 
+// NUMA node of the calling render worker, -1 unless a WorkerPlacement bound it (see numa.h)
+inline int32_t &thread_numa_node() {
+    thread_local int32_t node = -1;
+    return node;
+}
+
 class Object {
 public:
     virtual ~Object() = default;
@@ -90,11 +127,39 @@ public:
     virtual ColorHit hit(const BVHHit &bvhhit, const Ray &r, float tmin, float tmax) const = 0;
 
     virtual BVHHit bvh_hit(const Ray &r, float tmin, float tmax) const = 0;
+
+    virtual const Material* material() const = 0;
+
+    // everything that decides where rays hit the object, but not how it looks
+    virtual void hash_geometry(GeometryHash &hash) const {
+        AABB box = aabb();
+        hash.add(box.box_aa);
+        hash.add(box.box_bb);
+    }
+
+    // the object's primitives as light sources, in prim order. objects that cannot be sampled add none
+    virtual void emitters(std::vector<Emitter> &out) const {}
+
+    /*
+    copies data the object traverses on its own, such as a mesh's BVH, into memory of NUMA node
+    node. called before rendering by a thread running on that node, once per node and object;
+    workers bound to the node then use the copy. objects without such data share theirs
+    */
+    virtual void replicate_to_node(int32_t node) const {}
+
+    // bounds of the parts of the object below and above position on axis, for spatial splits
+    virtual void split_aabb(int32_t axis, float position, AABB &left, AABB &right) const {
+        left = right = aabb();
+        left.box_bb[axis] = std::min(left.box_bb[axis], position);
+        right.box_aa[axis] = std::max(right.box_aa[axis], position);
+    }
 };
 
 class World {
     std::vector<const Object*> objects;
     AABB box_aabb;
+    std::shared_ptr<const EnvironmentMap> environment_map;
+    std::shared_ptr<const LightBVH> light_bvh;
 
 public:
     World() {}
@@ -104,6 +169,7 @@ public:
         for (const Object* &obj_ptr : objects) {
             delete obj_ptr;
         }
+        objects.clear();
     }
 
     AABB aabb() const {
@@ -122,4 +188,22 @@ public:
     const std::vector<const Object*>& get_objects() const {
         return objects;
     }
+
+    // light arriving from outside the scene, rays that escape see black without one
+    void set_environment(std::shared_ptr<const EnvironmentMap> environment_map) {
+        this->environment_map = environment_map;
+    }
+
+    const EnvironmentMap* environment() const {
+        return environment_map.get();
+    }
+
+    // the emitting objects as a tree to pick lights from, nullptr if nothing in the scene emits
+    void set_lights(std::shared_ptr<const LightBVH> light_bvh) {
+        this->light_bvh = light_bvh;
+    }
+
+    const LightBVH* lights() const {
+        return light_bvh.get();
+    }
 };
@@ -0,0 +1,685 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <object.h>
+#include <triangle.h>
+#include <stats.h>
+
+/*
+out-of-core triangle meshes
+
+write_paged_mesh turns a triangle list into a file the renderer maps instead of loading.
+triangles are sorted into a BVH whose subtrees of at most page_bytes become pages: each page
+holds the nodes of one subtree and its triangles, so rays that meet in space also meet in
+the same page. the nodes above the pages form a small top tree that always stays in memory.
+
+a PageCache keeps at most its budget of pages resident. a page is faulted in when traversal
+first reaches it, and evicted with the CLOCK policy: pages carry a reference bit that
+eviction clears and skips once, so pages touched since the hand last passed survive. eviction
+drops the pages from memory with madvise; the mapping is read-only, so a thread still
+reading an evicted page just faults it in again and never sees wrong data.
+
+the mesh is one Object in the World, with its own traversal. rays are not deferred while
+pages load, a miss stalls only the thread that takes it.
+*/
+
+struct MeshNode {
+    float lo[3];
+    float hi[3];
+    uint32_t index;     // interior: first of two adjacent children. leaf: first triangle, or page in the top tree
+    uint32_t count;     // 0 for interior nodes
+};
+
+struct MeshPage {
+    uint32_t first_triangle;
+    uint32_t triangle_count;
+    uint32_t node_count;
+    uint32_t padding;
+};
+
+struct MeshFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_bytes;
+    uint64_t triangle_count;
+    uint32_t page_count;
+    uint32_t top_node_count;
+    float lo[3];
+    float hi[3];
+    uint64_t top_offset;
+    uint64_t pages_table_offset;
+    uint64_t pages_offset;
+};
+
+constexpr char mesh_file_magic[8] = {'R', 'T', 'P', 'M', 'E', 'S', 'H', '\0'};
+constexpr uint32_t mesh_file_version = 1;
+
+namespace paged_mesh_detail {
+
+struct Builder {
+    const std::vector<std::array<glm::vec3, 3>> &triangles;
+    std::vector<uint32_t> order;
+    std::vector<MeshNode> nodes;
+    std::vector<uint32_t> subtree_triangles;
+
+    explicit Builder(const std::vector<std::array<glm::vec3, 3>> &triangles) : triangles(triangles) {
+        order.resize(triangles.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        nodes.emplace_back();
+        subtree_triangles.emplace_back();
+        build(0, 0, static_cast<uint32_t>(order.size()), 0);
+    }
+
+    glm::vec3 centroid(uint32_t triangle) const {
+        const std::array<glm::vec3, 3> &t = triangles[triangle];
+        return (t[0] + t[1] + t[2]) / 3.0f;
+    }
+
+    void bounds(uint32_t begin, uint32_t end, glm::vec3 &lo, glm::vec3 &hi) const {
+        lo = glm::vec3(std::numeric_limits<float>::max());
+        hi = glm::vec3(-std::numeric_limits<float>::max());
+        for (uint32_t i = begin; i < end; ++i) {
+            for (const glm::vec3 &v : triangles[order[i]]) {
+                lo = glm::min(lo, v);
+                hi = glm::max(hi, v);
+            }
+        }
+    }
+
+    static float area(const glm::vec3 &lo, const glm::vec3 &hi) {
+        glm::vec3 d = glm::max(hi - lo, glm::vec3(0.0f));
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    /*
+    binned SAH, leaves of up to 4 triangles, children of a node stored next to each other. SAH
+    splits stop at depth 64 as in bvh.h, below that ranges are halved, which adds at most 32
+    levels: the tree stays within the 128 entry stacks of PagedMesh's traversal
+    */
+    void build(uint32_t node, uint32_t begin, uint32_t end, int32_t depth) {
+        constexpr int32_t bins = 16;
+        constexpr uint32_t max_leaf = 4;
+        constexpr int32_t max_sah_depth = 64;
+
+        glm::vec3 lo, hi;
+        bounds(begin, end, lo, hi);
+        for (int32_t axis = 0; axis < 3; ++axis) {
+            nodes[node].lo[axis] = lo[axis];
+            nodes[node].hi[axis] = hi[axis];
+        }
+        subtree_triangles[node] = end - begin;
+
+        uint32_t mid = begin;
+        if (end - begin > max_leaf && depth >= max_sah_depth) {
+            mid = begin + (end - begin) / 2;
+        } else if (end - begin > max_leaf) {
+            glm::vec3 c_lo(std::numeric_limits<float>::max()), c_hi(-std::numeric_limits<float>::max());
+            for (uint32_t i = begin; i < end; ++i) {
+                c_lo = glm::min(c_lo, centroid(order[i]));
+                c_hi = glm::max(c_hi, centroid(order[i]));
+            }
+
+            float best_cost = static_cast<float>(end - begin);
+            int32_t best_axis = -1, best_bin = 0;
+            for (int32_t axis = 0; axis < 3; ++axis) {
+                float extent = c_hi[axis] - c_lo[axis];
+                if (extent <= 0.0f) {
+                    continue;
+                }
+                glm::vec3 bin_lo[bins], bin_hi[bins];
+                uint32_t bin_count[bins] = {};
+                for (int32_t b = 0; b < bins; ++b) {
+                    bin_lo[b] = glm::vec3(std::numeric_limits<float>::max());
+                    bin_hi[b] = glm::vec3(-std::numeric_limits<float>::max());
+                }
+                for (uint32_t i = begin; i < end; ++i) {
+                    int32_t b = std::min(bins - 1, static_cast<int32_t>(bins * (centroid(order[i])[axis] - c_lo[axis]) / extent));
+                    ++bin_count[b];
+                    for (const glm::vec3 &v : triangles[order[i]]) {
+                        bin_lo[b] = glm::min(bin_lo[b], v);
+                        bin_hi[b] = glm::max(bin_hi[b], v);
+                    }
+                }
+
+                float right_area[bins];
+                uint32_t right_count[bins];
+                glm::vec3 r_lo(std::numeric_limits<float>::max()), r_hi(-std::numeric_limits<float>::max());
+                uint32_t r_count = 0;
+                for (int32_t b = bins - 1; b > 0; --b) {
+                    r_lo = glm::min(r_lo, bin_lo[b]);
+                    r_hi = glm::max(r_hi, bin_hi[b]);
+                    r_count += bin_count[b];
+                    right_area[b] = area(r_lo, r_hi);
+                    right_count[b] = r_count;
+                }
+
+                glm::vec3 l_lo(std::numeric_limits<float>::max()), l_hi(-std::numeric_limits<float>::max());
+                uint32_t l_count = 0;
+                float parent_area = std::max(area(lo, hi), 1e-30f);
+                for (int32_t b = 1; b < bins; ++b) {
+                    l_lo = glm::min(l_lo, bin_lo[b - 1]);
+                    l_hi = glm::max(l_hi, bin_hi[b - 1]);
+                    l_count += bin_count[b - 1];
+                    if (l_count == 0 || right_count[b] == 0) {
+                        continue;
+                    }
+                    float cost = 1.0f + (area(l_lo, l_hi) * static_cast<float>(l_count) + right_area[b] * static_cast<float>(right_count[b])) / parent_area;
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_bin = b;
+                    }
+                }
+            }
+
+            if (best_axis >= 0) {
+                float extent = c_hi[best_axis] - c_lo[best_axis];
+                uint32_t *split = std::partition(order.data() + begin, order.data() + end, [&](uint32_t t) {
+                    return std::min(bins - 1, static_cast<int32_t>(bins * (centroid(t)[best_axis] - c_lo[best_axis]) / extent)) < best_bin;
+                });
+                mid = static_cast<uint32_t>(split - order.data());
+            } else if (end - begin > max_leaf) {
+                // identical centroids or no split beats a leaf, but leaves must stay small enough for a page
+                mid = begin + (end - begin) / 2;
+            }
+        }
+
+        if (mid == begin || mid == end) {
+            nodes[node].index = begin;
+            nodes[node].count = end - begin;
+            return;
+        }
+
+        uint32_t left = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+        nodes.emplace_back();
+        subtree_triangles.resize(nodes.size());
+        nodes[node].index = left;
+        nodes[node].count = 0;
+        build(left, begin, mid, depth + 1);
+        build(left + 1, mid, end, depth + 1);
+    }
+};
+
+}  // namespace paged_mesh_detail
+
+/*
+writes triangles as a paged mesh file. page_bytes is rounded up to whole 4 KiB memory pages,
+every page holds as many triangles as fit with their nodes.
+*/
+inline bool write_paged_mesh(const std::vector<std::array<glm::vec3, 3>> &triangles, const std::string &filename, uint32_t page_bytes = 64 * 1024) {
+    using paged_mesh_detail::Builder;
+
+    if (triangles.empty()) {
+        std::cout << "paged mesh: no triangles to write" << std::endl;
+        return false;
+    }
+
+    page_bytes = (page_bytes + 4095) / 4096 * 4096;
+    // a subtree of n triangles has at most 2n - 1 nodes
+    uint32_t page_triangles = page_bytes / (2 * sizeof(MeshNode) + 9 * sizeof(float));
+
+    Builder builder(triangles);
+
+    std::vector<MeshNode> top;
+    std::vector<MeshPage> pages;
+    std::vector<std::vector<uint8_t>> page_data;
+    uint32_t next_triangle = 0;
+
+    // copies the subtree at node into a new page, with node and triangle indices local to the page
+    auto emit_page = [&](uint32_t root) {
+        std::vector<MeshNode> nodes{builder.nodes[root]};
+        std::vector<std::array<glm::vec3, 3>> page_triangles_data;
+        std::function<void(uint32_t)> copy = [&](uint32_t local) {
+            MeshNode &node = nodes[local];
+            if (node.count > 0) {
+                uint32_t first = static_cast<uint32_t>(page_triangles_data.size());
+                for (uint32_t i = node.index; i < node.index + node.count; ++i) {
+                    page_triangles_data.push_back(triangles[builder.order[i]]);
+                }
+                node.index = first;
+                return;
+            }
+            uint32_t children = node.index;
+            uint32_t left = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(builder.nodes[children]);
+            nodes.push_back(builder.nodes[children + 1]);
+            nodes[local].index = left;
+            copy(left);
+            copy(left + 1);
+        };
+        copy(0);
+
+        MeshPage page = {next_triangle, static_cast<uint32_t>(page_triangles_data.size()), static_cast<uint32_t>(nodes.size()), 0};
+        next_triangle += page.triangle_count;
+
+        std::vector<uint8_t> data(page_bytes, 0);
+        std::memcpy(data.data(), nodes.data(), nodes.size() * sizeof(MeshNode));
+        float *vertices = reinterpret_cast<float*>(data.data() + nodes.size() * sizeof(MeshNode));
+        for (const std::array<glm::vec3, 3> &t : page_triangles_data) {
+            for (const glm::vec3 &v : t) {
+                *vertices++ = v.x;
+                *vertices++ = v.y;
+                *vertices++ = v.z;
+            }
+        }
+
+        pages.push_back(page);
+        page_data.push_back(std::move(data));
+        return static_cast<uint32_t>(pages.size() - 1);
+    };
+
+    // the nodes above the pages, children again stored next to each other
+    top.push_back(builder.nodes[0]);
+    std::function<void(uint32_t, uint32_t)> emit_top = [&](uint32_t node, uint32_t top_node) {
+        if (builder.subtree_triangles[node] <= page_triangles) {
+            top[top_node].index = emit_page(node);
+            top[top_node].count = 1;
+            return;
+        }
+        uint32_t children = builder.nodes[node].index;
+        uint32_t left = static_cast<uint32_t>(top.size());
+        top.push_back(builder.nodes[children]);
+        top.push_back(builder.nodes[children + 1]);
+        top[top_node].index = left;
+        top[top_node].count = 0;
+        emit_top(children, left);
+        emit_top(children + 1, left + 1);
+    };
+    emit_top(0, 0);
+
+    MeshFileHeader header = {};
+    std::memcpy(header.magic, mesh_file_magic, sizeof(header.magic));
+    header.version = mesh_file_version;
+    header.page_bytes = page_bytes;
+    header.triangle_count = triangles.size();
+    header.page_count = static_cast<uint32_t>(pages.size());
+    header.top_node_count = static_cast<uint32_t>(top.size());
+    for (int32_t axis = 0; axis < 3; ++axis) {
+        header.lo[axis] = builder.nodes[0].lo[axis];
+        header.hi[axis] = builder.nodes[0].hi[axis];
+    }
+    header.top_offset = sizeof(MeshFileHeader);
+    header.pages_table_offset = header.top_offset + top.size() * sizeof(MeshNode);
+    // pages start on a page boundary, so they can be dropped from memory one by one
+    header.pages_offset = (header.pages_table_offset + pages.size() * sizeof(MeshPage) + page_bytes - 1) / page_bytes * page_bytes;
+
+    std::ofstream ofs(filename, std::ios::binary);
+    if (!ofs) {
+        std::cout << "paged mesh: cannot write " << filename << std::endl;
+        return false;
+    }
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(top.data()), top.size() * sizeof(MeshNode));
+    ofs.write(reinterpret_cast<const char*>(pages.data()), pages.size() * sizeof(MeshPage));
+    std::vector<char> padding(header.pages_offset - header.pages_table_offset - pages.size() * sizeof(MeshPage), 0);
+    ofs.write(padding.data(), padding.size());
+    for (const std::vector<uint8_t> &data : page_data) {
+        ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    std::clog << "paged mesh: " << triangles.size() << " triangles in " << pages.size() << " pages of "
+              << page_bytes / 1024 << " KiB, " << top.size() << " top nodes" << std::endl;
+    return static_cast<bool>(ofs);
+}
+
+struct PageCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    int64_t capacity = 0;
+
+    double hit_rate() const {
+        uint64_t accesses = hits + misses;
+        return accesses > 0 ? static_cast<double>(hits) / static_cast<double>(accesses) : 0.0;
+    }
+};
+
+class PageCache {
+    // counters split over cache lines, threads spread over them instead of fighting for one
+    struct alignas(64) Counters {
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+    };
+    static constexpr int32_t counter_shards = 16;
+
+    const uint8_t *base;
+    size_t page_bytes;
+    int64_t capacity;
+
+    std::vector<std::atomic<int32_t>> slot_of_page;
+    std::vector<int32_t> page_of_slot;
+    std::vector<std::atomic<uint8_t>> referenced;
+    int64_t used = 0;
+    int64_t hand = 0;
+    std::mutex mutex;
+
+    Counters counters[counter_shards];
+    std::atomic<uint64_t> evictions{0};
+
+public:
+    PageCache(const uint8_t *base, size_t page_bytes, uint32_t page_count, size_t budget_bytes) :
+        base(base),
+        page_bytes(page_bytes),
+        capacity(std::max<int64_t>(1, static_cast<int64_t>(budget_bytes / page_bytes))),
+        slot_of_page(page_count),
+        page_of_slot(std::min<int64_t>(capacity, page_count), -1),
+        referenced(page_of_slot.size())
+    {
+        for (std::atomic<int32_t> &slot : slot_of_page) {
+            slot.store(-1, std::memory_order_relaxed);
+        }
+        capacity = static_cast<int64_t>(page_of_slot.size());
+    }
+
+    const uint8_t *acquire(uint32_t page) {
+        Counters &shard = counters[shard_index()];
+        int32_t slot = slot_of_page[page].load(std::memory_order_acquire);
+        if (slot >= 0) {
+            referenced[slot].store(1, std::memory_order_relaxed);
+            shard.hits.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            shard.misses.fetch_add(1, std::memory_order_relaxed);
+            fault(page);
+        }
+        return base + static_cast<size_t>(page) * page_bytes;
+    }
+
+    PageCacheStats stats() const {
+        PageCacheStats ret;
+        for (const Counters &shard : counters) {
+            ret.hits += shard.hits.load(std::memory_order_relaxed);
+            ret.misses += shard.misses.load(std::memory_order_relaxed);
+        }
+        ret.evictions = evictions.load(std::memory_order_relaxed);
+        ret.capacity = capacity;
+        return ret;
+    }
+
+private:
+    static int32_t shard_index() {
+        thread_local int32_t index = static_cast<int32_t>(std::hash<std::thread::id>()(std::this_thread::get_id()) % counter_shards);
+        return index;
+    }
+
+    void fault(uint32_t page) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slot_of_page[page].load(std::memory_order_relaxed) >= 0) {
+            // another thread brought it in meanwhile
+            return;
+        }
+
+        int64_t slot;
+        if (used < capacity) {
+            slot = used++;
+        } else {
+            // CLOCK: clear reference bits until a page without one comes by
+            while (referenced[hand].exchange(0, std::memory_order_relaxed) != 0) {
+                hand = (hand + 1) % capacity;
+            }
+            slot = hand;
+            hand = (hand + 1) % capacity;
+
+            int32_t victim = page_of_slot[slot];
+            slot_of_page[victim].store(-1, std::memory_order_release);
+            madvise(const_cast<uint8_t*>(base + static_cast<size_t>(victim) * page_bytes), page_bytes, MADV_DONTNEED);
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        const uint8_t *data = base + static_cast<size_t>(page) * page_bytes;
+        madvise(const_cast<uint8_t*>(data), page_bytes, MADV_WILLNEED);
+        page_of_slot[slot] = static_cast<int32_t>(page);
+        referenced[slot].store(1, std::memory_order_relaxed);
+        slot_of_page[page].store(static_cast<int32_t>(slot), std::memory_order_release);
+    }
+};
+
+// a mapped paged mesh file, shared by the copies of its PagedMesh
+class MeshFile {
+    int fd = -1;
+    const uint8_t *mapping = nullptr;
+    size_t size = 0;
+
+public:
+    MeshFileHeader header;
+    const MeshNode *top = nullptr;
+    const MeshPage *pages = nullptr;
+    std::unique_ptr<PageCache> cache;
+
+    MeshFile() {}
+    MeshFile(const MeshFile&) = delete;
+    MeshFile& operator=(const MeshFile&) = delete;
+
+    ~MeshFile() {
+        if (mapping != nullptr) {
+            munmap(const_cast<uint8_t*>(mapping), size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool open(const std::string &filename, size_t cache_bytes) {
+        fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(MeshFileHeader)) {
+            std::cout << "paged mesh: cannot open " << filename << std::endl;
+            return false;
+        }
+        size = static_cast<size_t>(st.st_size);
+
+        void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            std::cout << "paged mesh: cannot map " << filename << std::endl;
+            return false;
+        }
+        mapping = static_cast<const uint8_t*>(ptr);
+        // traversal jumps between pages, read-ahead would only pull in pages nobody asked for
+        madvise(ptr, size, MADV_RANDOM);
+
+        std::memcpy(&header, mapping, sizeof(header));
+        if (std::memcmp(header.magic, mesh_file_magic, sizeof(header.magic)) != 0 || header.version != mesh_file_version) {
+            std::cout << "paged mesh: " << filename << " is not a paged mesh of version " << mesh_file_version << std::endl;
+            return false;
+        }
+        // a truncated or corrupt file must not make the cache divide by zero or reads leave the mapping
+        if (header.page_bytes == 0 || header.page_count == 0 || header.top_node_count == 0 ||
+            !in_file(header.top_offset, header.top_node_count, sizeof(MeshNode), alignof(MeshNode)) ||
+            !in_file(header.pages_table_offset, header.page_count, sizeof(MeshPage), alignof(MeshPage)) ||
+            !in_file(header.pages_offset, header.page_count, header.page_bytes, alignof(MeshNode))) {
+            std::cout << "paged mesh: " << filename << " is truncated or corrupt" << std::endl;
+            return false;
+        }
+
+        top = reinterpret_cast<const MeshNode*>(mapping + header.top_offset);
+        pages = reinterpret_cast<const MeshPage*>(mapping + header.pages_table_offset);
+        cache = std::make_unique<PageCache>(mapping + header.pages_offset, header.page_bytes, header.page_count, cache_bytes);
+        return true;
+    }
+
+private:
+    // whether count elements of element_bytes each at offset lie inside the mapping, suitably aligned
+    bool in_file(uint64_t offset, uint64_t count, uint64_t element_bytes, uint64_t alignment) const {
+        return offset % alignment == 0 && offset <= size && count <= (size - offset) / element_bytes;
+    }
+};
+
+class PagedMesh : public Object {
+    std::shared_ptr<MeshFile> file;
+    std::shared_ptr<Material> mat;
+
+public:
+    PagedMesh(std::shared_ptr<MeshFile> file, std::shared_ptr<Material> mat) : file(file), mat(mat) {}
+
+    AABB aabb() const override {
+        const MeshFileHeader &header = file->header;
+        return AABB(glm::vec3(header.lo[0], header.lo[1], header.lo[2]), glm::vec3(header.hi[0], header.hi[1], header.hi[2]));
+    }
+
+    const Material* material() const override {
+        return mat.get();
+    }
+
+    // the file is written once per mesh, its header and top tree stand in for all of it
+    void hash_geometry(GeometryHash &hash) const override {
+        hash.add(file->header);
+        hash.add(file->top, file->header.top_node_count * sizeof(MeshNode));
+    }
+
+    const PageCache &cache() const {
+        return *file->cache;
+    }
+
+    BVHHit bvh_hit(const Ray &r, float tmin, float tmax) const override {
+        BVHHit ret;
+        ret.is_hit = false;
+        ret.t = 0.0f;
+
+        glm::vec3 inverse_direction(1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z);
+
+        // top tree
+        uint32_t stack[128];
+        int32_t stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            const MeshNode &node = file->top[stack[--stack_size]];
+            RAY_STATS_ADD(nodes_visited, 1);
+            RAY_STATS_ADD(boxes_tested, 1);
+            if (!hit_box(node, r, inverse_direction, tmin, tmax)) {
+                continue;
+            }
+            if (node.count > 0) {
+                hit_page(node.index, r, inverse_direction, tmin, tmax, ret);
+                continue;
+            }
+            push_children(file->top, node, r, stack, stack_size);
+        }
+
+        return ret;
+    }
+
+    ColorHit hit(const BVHHit &bvhhit, const Ray &r, float tmin, float tmax) const override {
+        // the page whose triangles include bvhhit.prim
+        const MeshPage *pages_end = file->pages + file->header.page_count;
+        const MeshPage *page = std::upper_bound(file->pages, pages_end, bvhhit.prim, [](uint32_t prim, const MeshPage &p) {
+            return prim < p.first_triangle;
+        }) - 1;
+        uint32_t page_index = static_cast<uint32_t>(page - file->pages);
+
+        glm::vec3 v[3];
+        triangle_vertices(file->cache->acquire(page_index), *page, bvhhit.prim - page->first_triangle, v);
+        glm::vec3 normal = glm::normalize(glm::cross(v[1] - v[0], v[2] - v[0]));
+        return shade_triangle(normal, bvhhit, r, mat);
+    }
+
+private:
+    static bool hit_box(const MeshNode &node, const Ray &r, const glm::vec3 &inverse_direction, float tmin, float tmax) {
+        for (int32_t axis = 0; axis < 3; ++axis) {
+            float t0 = (node.lo[axis] - r.origin[axis]) * inverse_direction[axis];
+            float t1 = (node.hi[axis] - r.origin[axis]) * inverse_direction[axis];
+            if (inverse_direction[axis] < 0.0f) {
+                std::swap(t0, t1);
+            }
+            tmin = std::max(t0, tmin);
+            tmax = std::min(t1, tmax);
+            if (tmax < tmin) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // near child first: the axis the two child boxes are farthest apart on stands in for the split axis
+    static void push_children(const MeshNode *nodes, const MeshNode &node, const Ray &r, uint32_t *stack, int32_t &stack_size) {
+        uint32_t left = node.index;
+        const MeshNode &a = nodes[left], &b = nodes[left + 1];
+        int32_t axis = 0;
+        float best = -std::numeric_limits<float>::max();
+        for (int32_t i = 0; i < 3; ++i) {
+            float separation = std::abs((b.lo[i] + b.hi[i]) - (a.lo[i] + a.hi[i]));
+            if (separation > best) {
+                best = separation;
+                axis = i;
+            }
+        }
+        bool left_first = (a.lo[axis] + a.hi[axis] <= b.lo[axis] + b.hi[axis]) == (r.direction[axis] >= 0.0f);
+        stack[stack_size++] = left_first ? left + 1 : left;
+        stack[stack_size++] = left_first ? left : left + 1;
+    }
+
+    static void triangle_vertices(const uint8_t *data, const MeshPage &page, uint32_t triangle, glm::vec3 *v) {
+        const float *vertices = reinterpret_cast<const float*>(data + page.node_count * sizeof(MeshNode)) + triangle * 9;
+        for (int32_t i = 0; i < 3; ++i) {
+            v[i] = glm::vec3(vertices[i * 3], vertices[i * 3 + 1], vertices[i * 3 + 2]);
+        }
+    }
+
+    void hit_page(uint32_t page_index, const Ray &r, const glm::vec3 &inverse_direction, float tmin, float &tmax, BVHHit &ret) const {
+        const uint8_t *data = file->cache->acquire(page_index);
+        const MeshPage &page = file->pages[page_index];
+        const MeshNode *nodes = reinterpret_cast<const MeshNode*>(data);
+
+        uint32_t stack[128];
+        int32_t stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            const MeshNode &node = nodes[stack[--stack_size]];
+            RAY_STATS_ADD(nodes_visited, 1);
+            RAY_STATS_ADD(boxes_tested, 1);
+            if (!hit_box(node, r, inverse_direction, tmin, tmax)) {
+                continue;
+            }
+            if (node.count == 0) {
+                push_children(nodes, node, r, stack, stack_size);
+                continue;
+            }
+
+            for (uint32_t i = node.index; i < node.index + node.count; ++i) {
+                glm::vec3 v[3];
+                triangle_vertices(data, page, i, v);
+                RAY_STATS_ADD(primitive_tests, 1);
+                BVHHit triangle_hit = intersect_triangle(v[0], v[1], v[2], r, tmin, tmax);
+                if (triangle_hit.is_hit) {
+                    ret = triangle_hit;
+                    ret.prim = page.first_triangle + i;
+                    tmax = triangle_hit.t;
+                }
+            }
+        }
+    }
+};
+
+inline void print_page_cache_stats(const World &world) {
+    for (const Object *obj : world.get_objects()) {
+        const PagedMesh *mesh = dynamic_cast<const PagedMesh*>(obj);
+        if (mesh == nullptr) {
+            continue;
+        }
+        PageCacheStats stats = mesh->cache().stats();
+        std::cout << "page cache:       " << stats.hits << " hits, " << stats.misses << " misses ("
+                  << 100.0 * stats.hit_rate() << "% hit rate), " << stats.evictions << " evictions, "
+                  << stats.capacity << " pages resident at most" << std::endl;
+    }
+}
@@ -1,25 +1,75 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <numbers>
 #include <random>
 
-#include <glm/gtc/random.hpp>
+#include <glm/glm.hpp>
+
+#include <sampler.h>
+
+// one generator per thread, so workers neither race on it nor serialize on it
+inline std::mt19937 &random_generator() {
+    thread_local std::mt19937 generator;
+    return generator;
+}
+
+inline void seed_random(uint32_t seed) {
+    random_generator().seed(seed);
+}
 
 inline float random_float() {
-    static std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-    static std::mt19937 generator;
-    return distribution(generator);
+    thread_local std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+    return distribution(random_generator());
+}
+
+// next point of the thread's sampler (see sampler.h), or two independent draws without one
+inline glm::vec2 random_2d() {
+    Sampler *sampler = Sampler::current();
+    if (sampler != nullptr && sampler->get_mode() != SamplerMode::Random) {
+        return sampler->get_2d();
+    }
+    float x = random_float();
+    return glm::vec2(x, random_float());
+}
+
+// warps keep the stratification of u, so they must not reject samples
+inline glm::vec2 disk_from_square(const glm::vec2 &u) {
+    // concentric mapping, https://doi.org/10.1080/10867651.1997.10487479
+    float a = 2.0f * u.x - 1.0f;
+    float b = 2.0f * u.y - 1.0f;
+    if (a == 0.0f && b == 0.0f) {
+        return glm::vec2(0.0f, 0.0f);
+    }
+    constexpr float quarter_pi = std::numbers::pi_v<float> / 4.0f;
+    if (std::fabs(a) > std::fabs(b)) {
+        float phi = quarter_pi * (b / a);
+        return glm::vec2(a * std::cos(phi), a * std::sin(phi));
+    }
+    float phi = 2.0f * quarter_pi - quarter_pi * (a / b);
+    return glm::vec2(b * std::cos(phi), b * std::sin(phi));
+}
+
+inline glm::vec3 sphere_from_square(const glm::vec2 &u) {
+    float z = 1.0f - 2.0f * u.x;
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    float phi = 2.0f * std::numbers::pi_v<float> * u.y;
+    return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
 inline glm::vec2 random_disk() {
-    return glm::diskRand(1.0f);
+    return disk_from_square(random_2d());
 }
 
 inline glm::vec3 random_sphere() {
-    return glm::sphericalRand(1.0f);
+    return sphere_from_square(random_2d());
 }
 
 inline glm::vec3 random_hemisphere(const glm::vec3& normal) {
-    glm::vec3 ret = random_sphere();
+    // independent of the sampler, hit records draw this outside any path decision
+    float x = random_float();
+    glm::vec3 ret = sphere_from_square(glm::vec2(x, random_float()));
     if (glm::dot(ret, normal) > 0.0f){
         return ret;
     } else {
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/*
+low-discrepancy sample sequences
+
+every 2d decision of a path (pixel jitter, lens, one per bounce) reads its own dimension pair
+of an owen-scrambled sobol (0,2)-sequence. pairs are decorrelated from each other by shuffling
+the sample index with a per-pair seed, as in Burley, "Practical Hash-based Owen Scrambling"
+https://jcgt.org/published/0009/04/01/
+
+Sobol gives every pixel its own scramble. BlueNoise gives all pixels the same points and
+rotates them toroidally by a blue-noise mask instead, so at low sample counts the remaining
+error is spread as high-frequency noise which the eye (and the denoiser) forgive more easily.
+Random keeps the plain independent draws.
+
+the active sampler is thread_local, so materials draw through random_2d() without
+knowing which sequence is in use.
+*/
+
+enum class SamplerMode {
+    Random,
+    Sobol,
+    BlueNoise
+};
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+inline uint32_t hash_uint(uint32_t x) {
+    // https://nullprogram.com/blog/2018/07/31/
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return hash_uint(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// first two dimensions of the sobol sequence
+inline uint32_t sobol_dimension0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+inline uint32_t sobol_dimension1(uint32_t index) {
+    uint32_t ret = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1u) {
+            ret ^= v;
+        }
+    }
+    return ret;
+}
+
+inline float uint_to_unit_float(uint32_t x) {
+    // top 24 bits, so the result stays below 1.0f
+    return static_cast<float>(x >> 8) * (1.0f / 16777216.0f);
+}
+
+/*
+64x64 tileable blue-noise mask, built once with void-and-cluster
+http://cv.ulichney.com/papers/1993-void-cluster.pdf
+*/
+class BlueNoiseMask {
+    static constexpr int32_t size = 64;
+    static constexpr int32_t n = size * size;
+
+    std::vector<float> ranks;
+
+public:
+    static const BlueNoiseMask &instance() {
+        static BlueNoiseMask mask;
+        return mask;
+    }
+
+    float at(int32_t h, int32_t w) const {
+        return ranks[(h & (size - 1)) * size + (w & (size - 1))];
+    }
+
+private:
+    BlueNoiseMask() {
+        // toroidal gaussian splat, sigma 1.5
+        std::vector<float> kernel(n);
+        for (int32_t dy = 0; dy < size; ++dy) {
+            for (int32_t dx = 0; dx < size; ++dx) {
+                float y = static_cast<float>(std::min(dy, size - dy));
+                float x = static_cast<float>(std::min(dx, size - dx));
+                kernel[dy * size + dx] = std::exp(-(x * x + y * y) / (2.0f * 1.5f * 1.5f));
+            }
+        }
+
+        std::vector<bool> pattern(n, false);
+        std::vector<float> energy(n, 0.0f);
+        auto splat = [&](int32_t p, float sign) {
+            int32_t py = p / size, px = p % size;
+            for (int32_t y = 0; y < size; ++y) {
+                for (int32_t x = 0; x < size; ++x) {
+                    energy[y * size + x] += sign * kernel[((y - py + size) % size) * size + (x - px + size) % size];
+                }
+            }
+        };
+        // tightest cluster: the set pixel of highest energy, largest void: the empty one of lowest
+        auto find = [&](bool value, bool highest) {
+            int32_t best = -1;
+            for (int32_t p = 0; p < n; ++p) {
+                if (pattern[p] == value && (best < 0 || (highest ? energy[p] > energy[best] : energy[p] < energy[best]))) {
+                    best = p;
+                }
+            }
+            return best;
+        };
+
+        // initial pattern: 10% of the pixels from a fixed hash, relaxed until stable
+        int32_t initial = n / 10;
+        for (int32_t i = 0, placed = 0; placed < initial; ++i) {
+            int32_t p = static_cast<int32_t>(hash_uint(static_cast<uint32_t>(i)) % n);
+            if (!pattern[p]) {
+                pattern[p] = true;
+                splat(p, 1.0f);
+                ++placed;
+            }
+        }
+        while (true) {
+            int32_t cluster = find(true, true);
+            pattern[cluster] = false;
+            splat(cluster, -1.0f);
+            int32_t void_ = find(false, false);
+            pattern[void_] = true;
+            splat(void_, 1.0f);
+            if (void_ == cluster) {
+                break;
+            }
+        }
+
+        ranks.assign(n, 0.0f);
+        std::vector<bool> initial_pattern = pattern;
+        std::vector<float> initial_energy = energy;
+
+        // ranks below `initial`: remove the tightest clusters one by one
+        for (int32_t rank = initial - 1; rank >= 0; --rank) {
+            int32_t cluster = find(true, true);
+            pattern[cluster] = false;
+            splat(cluster, -1.0f);
+            ranks[cluster] = static_cast<float>(rank);
+        }
+
+        // ranks from `initial` on: fill the largest voids one by one
+        pattern = initial_pattern;
+        energy = initial_energy;
+        for (int32_t rank = initial; rank < n; ++rank) {
+            int32_t void_ = find(false, false);
+            pattern[void_] = true;
+            splat(void_, 1.0f);
+            ranks[void_] = static_cast<float>(rank);
+        }
+
+        for (float &r : ranks) {
+            r = (r + 0.5f) / static_cast<float>(n);
+        }
+    }
+};
+
+class Sampler {
+    SamplerMode mode = SamplerMode::Sobol;
+    uint32_t seed = 0;
+
+    int32_t h = 0, w = 0;
+    uint32_t pixel_seed = 0;
+    uint32_t sample_index = 0;
+    uint32_t dimension = 0;
+
+public:
+    // dimension pairs reserved before the first bounce: pixel jitter and lens
+    static constexpr uint32_t camera_dimensions = 2;
+    // dimension pairs every bounce may use: its scattering, texel and direction of an environment
+    // sample, and the light and the point on it of a light BVH sample
+    static constexpr uint32_t vertex_dimensions = 5;
+
+    Sampler() {}
+    Sampler(SamplerMode mode, uint32_t seed) : mode(mode), seed(seed) {}
+
+    SamplerMode get_mode() const { return mode; }
+
+    void start_sample(int32_t h, int32_t w, int32_t sample_index) {
+        this->h = h;
+        this->w = w;
+        this->sample_index = static_cast<uint32_t>(sample_index);
+        this->dimension = 0;
+        // blue noise keeps one point set for the whole image, the mask decorrelates the pixels
+        pixel_seed = mode == SamplerMode::BlueNoise ? hash_uint(seed) : hash_combine(hash_combine(seed, static_cast<uint32_t>(h)), static_cast<uint32_t>(w));
+    }
+
+    // every path vertex starts at a fixed dimension, so a material drawing more or fewer
+    // samples does not shift the dimensions of the bounces after it
+    void start_vertex(int32_t vertex) {
+        dimension = camera_dimensions + static_cast<uint32_t>(vertex) * vertex_dimensions;
+    }
+
+    glm::vec2 get_2d() {
+        uint32_t dimension_seed = hash_combine(pixel_seed, dimension);
+        uint32_t index = nested_uniform_scramble(sample_index, dimension_seed);
+
+        uint32_t x = nested_uniform_scramble(sobol_dimension0(index), hash_combine(dimension_seed, 0));
+        uint32_t y = nested_uniform_scramble(sobol_dimension1(index), hash_combine(dimension_seed, 1));
+        glm::vec2 ret(uint_to_unit_float(x), uint_to_unit_float(y));
+
+        if (mode == SamplerMode::BlueNoise) {
+            // cranley-patterson rotation by the mask, read at a different offset for every dimension
+            const BlueNoiseMask &mask = BlueNoiseMask::instance();
+            uint32_t offset = hash_uint(dimension);
+            float rx = mask.at(h + static_cast<int32_t>(offset & 63u), w + static_cast<int32_t>((offset >> 6) & 63u));
+            float ry = mask.at(h + static_cast<int32_t>((offset >> 12) & 63u), w + static_cast<int32_t>((offset >> 18) & 63u));
+            ret.x = ret.x + rx >= 1.0f ? ret.x + rx - 1.0f : ret.x + rx;
+            ret.y = ret.y + ry >= 1.0f ? ret.y + ry - 1.0f : ret.y + ry;
+        }
+
+        ++dimension;
+        return ret;
+    }
+
+    // the calling thread's sampler, nullptr when drawing plain random numbers
+    static Sampler *&current() {
+        thread_local Sampler *sampler = nullptr;
+        return sampler;
+    }
+};
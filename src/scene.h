@@ -0,0 +1,544 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <numbers>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <glm/glm.hpp>
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/transform.hpp>
+
+#include <random.h>
+#include <camera.h>
+#include <object.h>
+#include <material.h>
+#include <sphere.h>
+#include <triangle.h>
+#include <mesh.h>
+#include <light_bvh.h>
+#include <texture.h>
+#include <thread_pool.h>
+#include <trace.h>
+#include <paged_mesh.h>
+#include <environment.h>
+
+// the triangles of an obj file, transformed into world space
+inline std::vector<std::array<glm::vec3, 3>> load_obj(
+    const std::string &filename,
+    const glm::vec3 &translate,
+    const glm::vec3 &rotate_axis,
+    const float rotate_angle, //degree
+    const glm::vec3 &scale
+) {
+    std::vector<glm::vec3> vertices;
+    std::vector<std::array<glm::vec3, 3>> triangles;
+
+    glm::mat4 transform_matrix = glm::mat4(1.0f);
+    transform_matrix = glm::translate(transform_matrix, translate);
+    transform_matrix = glm::rotate(transform_matrix, glm::radians(rotate_angle), rotate_axis);
+    transform_matrix = glm::scale(transform_matrix, scale);
+
+    auto apply_transform = [&](const glm::vec3& vertex) -> glm::vec3 {
+        glm::vec4 transformed_vertex = transform_matrix * glm::vec4(vertex, 1.0f);
+        return glm::vec3(transformed_vertex); // Convert back to 3D vector
+    };
+
+    std::ifstream ifs(filename);
+
+    std::string line;
+    while (getline(ifs, line)) {
+        std::istringstream iss(line);
+        std::string type;
+        iss >> type;
+        if (type == "v") {
+            glm::vec3 v;
+            iss >> v.x >> v.y >> v.z;
+            vertices.push_back(v);
+        } else if (type == "f") {
+            int32_t f[3];
+            iss >> f[0] >> f[1] >> f[2];
+
+            triangles.push_back({
+                apply_transform(vertices[f[0]-1]),
+                apply_transform(vertices[f[1]-1]),
+                apply_transform(vertices[f[2]-1])
+            });
+        } else {
+            std::cout << "object parser error" << std::endl;
+        }
+    }
+
+    return triangles;
+}
+
+/*
+loads the slow parts of a scene as tasks on a thread pool. every mesh is parsed and then gets
+its own BVH as soon as it is parsed, images are decoded, and none of them waits for another.
+scenes only describe what to load, finish() runs the tasks and then adds the results to the
+world in the order they were asked for, so the scene never depends on which task ends first.
+the world's own BVH, built afterwards, only has to sort the meshes' boxes.
+*/
+class SceneLoader {
+    struct PendingMesh {
+        std::string filename;
+        glm::vec3 translate, rotate_axis, scale;
+        float rotate_angle;
+        std::shared_ptr<Material> material;
+        std::vector<std::array<glm::vec3, 3>> vertices;
+        std::shared_ptr<const MeshData> data;
+    };
+
+    World &world;
+    ThreadPool *pool;
+    TaskGraph graph;
+    std::deque<PendingMesh> meshes;
+    std::shared_ptr<const EnvironmentMap> environment;
+    int32_t images = 0;
+
+public:
+    // tasks run on pool, or on a pool of their own if it is nullptr
+    SceneLoader(World &world, ThreadPool *pool) : world(world), pool(pool) {}
+
+    void add_object(
+        const std::string &filename,
+        const glm::vec3 &translate,
+        const glm::vec3 &rotate_axis,
+        const float rotate_angle, //degree
+        const glm::vec3 &scale,
+        std::shared_ptr<Material> &material
+    ) {
+        PendingMesh &mesh = meshes.emplace_back();
+        mesh.filename = filename;
+        mesh.translate = translate;
+        mesh.rotate_axis = rotate_axis;
+        mesh.rotate_angle = rotate_angle;
+        mesh.scale = scale;
+        mesh.material = material;
+
+        int32_t index = static_cast<int32_t>(meshes.size()) - 1;
+        int32_t parse = graph.add([&mesh, index]() {
+            RAY_TRACE_SCOPE_ARG("parse obj", "mesh", index);
+            mesh.vertices = load_obj(mesh.filename, mesh.translate, mesh.rotate_axis, mesh.rotate_angle, mesh.scale);
+        });
+        graph.add([&mesh, index]() {
+            RAY_TRACE_SCOPE_ARG("build mesh", "mesh", index);
+            mesh.data = std::make_shared<const MeshData>(mesh.vertices, mesh.material);
+            mesh.vertices = std::vector<std::array<glm::vec3, 3>>();
+        }, {parse});
+    }
+
+    // the texture is decoded by finish(), materials may hold it before
+    std::shared_ptr<ImageTexture> load_texture(const std::string &filename) {
+        std::shared_ptr<ImageTexture> texture = std::make_shared<ImageTexture>();
+        graph.add([texture, filename]() {
+            RAY_TRACE_SCOPE("load texture");
+            texture->load(filename);
+        });
+        ++images;
+        return texture;
+    }
+
+    void load_environment(const std::string &filename, float intensity) {
+        graph.add([this, filename, intensity]() {
+            RAY_TRACE_SCOPE("load environment");
+            environment = std::make_shared<const EnvironmentMap>(filename, intensity);
+        });
+        ++images;
+    }
+
+    void finish() {
+        if (graph.size() == 0) {
+            return;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        if (pool != nullptr) {
+            graph.run(*pool);
+        } else {
+            ThreadPool loading_pool(static_cast<int32_t>(std::max(1u, std::thread::hardware_concurrency())));
+            graph.run(loading_pool);
+        }
+
+        size_t triangles = 0;
+        for (const PendingMesh &pending : meshes) {
+            Mesh mesh(pending.data, pending.material);
+            triangles += mesh.triangle_count();
+            world.add(mesh);
+        }
+        if (environment) {
+            world.set_environment(environment);
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::clog << "scene: " << meshes.size() << " meshes (" << triangles << " triangles) and " << images
+                  << " images loaded in " << elapsed.count() << " seconds" << std::endl;
+    }
+};
+
+inline void scene1(World &world, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width){
+    // Camera
+    glm::vec3 center(13.0, 2.0, 3.0);
+    glm::vec3 direction(-13.0, -2.0, -3.0);
+    direction = glm::normalize(direction);
+    glm::vec3 up(0.0, 1.0, 0.0);
+    //float fov = 80.00f / 360.0f * 2.0f * std::numbers::pi_v<float>;
+    float fov = 0.607537f;
+    int32_t samples = 50;
+    int32_t max_depth = 25;
+    float focal_distance = 10.0f;
+    float defocus_angle = 0.6f / 180.0f * std::numbers::pi_v<float>;
+
+    perspectiveCamera.setCamera(
+        center,
+        direction,
+        up,
+        height,
+        width,
+        fov,
+        focal_distance,
+        defocus_angle,
+        samples,
+        max_depth
+    );
+
+    // World
+    // std::shared_ptr<ImageTexture> earth_texture = std::make_shared<ImageTexture>("data/earthmap.png");
+    std::shared_ptr<CheckerTexture> checker = std::make_shared<CheckerTexture>(0.32, glm::vec3(0.2, 0.3, 0.1), glm::vec3(0.9, 0.9, 0.9));
+
+    std::shared_ptr<Material> material_ground = std::make_shared<Lambertian>(checker);
+    Sphere sphere_ground(glm::vec3(0.0, -1000.0, 0.0), 1000.0, material_ground);
+    world.add(sphere_ground);
+
+    std::shared_ptr<Material> material1 = std::make_shared<Dielectric>(1.5f);
+    std::shared_ptr<Material> material2 = std::make_shared<Metal>(glm::vec3(0.7, 0.6, 0.5), 0.0);
+    // std::shared_ptr<Material> material3 = std::make_shared<Metal>(glm::vec3(0.1, 0.6, 0.1), 0.0);
+    std::shared_ptr<Material> material_light_yellow = std::make_shared<DiffuseLight>(glm::vec3(0.7, 0.7, 0.0));
+    std::shared_ptr<Material> material_light_purple = std::make_shared<DiffuseLight>(glm::vec3(0.7, 0.0, 0.7));
+    
+    // std::shared_ptr<Material> material3 = std::make_shared<Lambertian>(earth_texture);
+    Sphere sphere1(glm::vec3(-4.0, 1.0, 0.0), 1.0, material_light_yellow);
+    Sphere sphere2(glm::vec3(0.0, 1.0, 0.0), 1.0, material_light_purple);
+    Sphere sphere3(glm::vec3(4.0, 1.0, 0.0), 1.0, material_light_yellow);
+    world.add(sphere1);
+    world.add(sphere2);
+    world.add(sphere3);
+    // add_object(world, "data/prism.obj", glm::vec3(4.0, 1.0, 0.0), glm::vec3(0.0, 1.0, 0.0), 180.0f, glm::vec3(0.8, 0.8, 0.8), material1);    
+
+    for (float a = -11.0f; a < 11.0f; a = a + 1.0f) {
+        for (float b = -11.0f; b < 11.0f; b = b + 1.0f) {
+            float material_choice = random_float();
+
+            glm::vec3 sphere_center(a + 0.9f * random_float(), 0.2f, b + 0.9f * random_float());
+
+            if (glm::length(sphere_center - glm::vec3(4, 0.2, 0.0)) > 0.9f) {
+                std::shared_ptr<Material> material;
+
+                if (material_choice < 0.8f) {
+                    // diffuse
+                    glm::vec3 albedo = glm::vec3(random_float() * random_float(), random_float() * random_float(), random_float() * random_float());
+                    material = std::make_shared<Lambertian>(albedo);
+                } else if (material_choice < 0.95f) {
+                    // metal
+                    glm::vec3 albedo = glm::vec3(0.5f + 0.5f * random_float(), 0.5f + 0.5f * random_float(), 0.5f + 0.5f * random_float());
+                    float fuzz = random_float() * 0.5f;
+                    material = std::make_shared<Metal>(albedo, fuzz);
+                } else {
+                    // dielectric
+                    material = std::make_shared<Dielectric>(1.5f);
+                }
+                Sphere sphere(sphere_center, 0.2, material);
+                world.add(sphere);
+            }
+        }
+    }
+
+}
+
+inline void scene2(World &world, SceneLoader &loader, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width){
+    // Camera
+    glm::vec3 center(0.0, 0.0, 10.0);
+    glm::vec3 direction(0.0, 0.0, -10.0);
+    direction = glm::normalize(direction);
+    glm::vec3 up(0.0, 1.0, 0.0);
+    float fov = 100.00f / 360.0f * 2.0f * std::numbers::pi_v<float>;
+    // float fov = 0.607537f;
+    int32_t samples = 1000;
+    int32_t max_depth = 50;
+    float focal_distance = 10.0f;
+    float defocus_angle = 0.6f / 180.0f * std::numbers::pi_v<float>;
+
+    perspectiveCamera.setCamera(
+        center,
+        direction,
+        up,
+        height,
+        width,
+        fov,
+        focal_distance,
+        defocus_angle,
+        samples,
+        max_depth
+    );
+
+    // World
+
+    std::shared_ptr<Material> material_left_wall = std::make_shared<Lambertian>(glm::vec3(0.0, 0.8, 0.0)); // g
+    std::shared_ptr<Material> material_right_wall = std::make_shared<Lambertian>(glm::vec3(0.8, 0.0, 0.0)); // r
+    std::shared_ptr<Material> material_wall = std::make_shared<Lambertian>(glm::vec3(1.0, 1.0, 1.0));
+
+    std::shared_ptr<Material> material_light = std::make_shared<DiffuseLight>(glm::vec3(7.0, 7.0, 7.0));
+
+    std::shared_ptr<Material> material_glass = std::make_shared<Dielectric>(1.5f);
+
+    loader.add_object("data/plate.obj", glm::vec3(0.0, -5.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 0.0f, glm::vec3(10.0, 10.0, 10.0), material_wall); // down
+    loader.add_object("data/plate.obj", glm::vec3(0.0, 5.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 180.0f, glm::vec3(10.0, 10.0, 10.0), material_wall); // up
+    loader.add_object("data/plate.obj", glm::vec3(5.0, 0.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 90.0f, glm::vec3(10.0, 10.0, 10.0), material_left_wall); // left
+    loader.add_object("data/plate.obj", glm::vec3(-5.0, 0.0, 0.0), glm::vec3(0.0, 0.0, 1.0), 270.0f, glm::vec3(10.0, 10.0, 10.0), material_right_wall); // right
+    loader.add_object("data/plate.obj", glm::vec3(0.0, 0.0, -5.0), glm::vec3(1.0, 0.0, 0.0), 90.0f, glm::vec3(10.0, 10.0, 10.0), material_wall); // back
+
+    // just below the ceiling, coplanar plates would z-fight
+    loader.add_object("data/plate.obj", glm::vec3(0.0, 4.99, 0.0), glm::vec3(0.0, 0.0, 1.0), 180.0f, glm::vec3(3.0, 3.0, 3.0), material_light); // up
+
+    loader.add_object("data/dragon.obj", glm::vec3(0.0, 0.0, 0.0), glm::vec3(0.0, 1.0, 0.0), 90.0f, glm::vec3(2.5, 2.5, 2.5), material_glass);
+
+}
+
+// spheres on open ground, lit only by an environment map
+inline void scene_outdoor(World &world, SceneLoader &loader, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width) {
+    // Camera
+    glm::vec3 center(0.0, 1.5, 7.0);
+    glm::vec3 direction(0.0, -0.15, -1.0);
+    direction = glm::normalize(direction);
+    glm::vec3 up(0.0, 1.0, 0.0);
+    float fov = 0.9f;
+    int32_t samples = 16;
+    int32_t max_depth = 8;
+    float focal_distance = 7.0f;
+    float defocus_angle = 0.0f;
+
+    perspectiveCamera.setCamera(
+        center,
+        direction,
+        up,
+        height,
+        width,
+        fov,
+        focal_distance,
+        defocus_angle,
+        samples,
+        max_depth
+    );
+
+    // World
+    loader.load_environment("data/earthmap.png", 2.0f);
+
+    std::shared_ptr<Material> material_ground = std::make_shared<Lambertian>(glm::vec3(0.5, 0.5, 0.5));
+    Sphere sphere_ground(glm::vec3(0.0, -1000.0, 0.0), 1000.0, material_ground);
+    world.add(sphere_ground);
+
+    std::shared_ptr<Material> material_diffuse = std::make_shared<Lambertian>(glm::vec3(0.8, 0.3, 0.2));
+    std::shared_ptr<Material> material_metal = std::make_shared<Metal>(glm::vec3(0.8, 0.8, 0.8), 0.1);
+    std::shared_ptr<Material> material_glass = std::make_shared<Dielectric>(1.5f);
+
+    Sphere sphere1(glm::vec3(-2.2, 1.0, 0.0), 1.0, material_diffuse);
+    Sphere sphere2(glm::vec3(0.0, 1.0, 0.0), 1.0, material_metal);
+    Sphere sphere3(glm::vec3(2.2, 1.0, 0.0), 1.0, material_glass);
+    world.add(sphere1);
+    world.add(sphere2);
+    world.add(sphere3);
+}
+
+// a room-sized floor lit by a few hundred small lights, for many-light sampling
+inline void scene_lights(World &world, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width) {
+    // Camera
+    glm::vec3 center(0.0, 3.0, 9.0);
+    glm::vec3 direction(0.0, -0.35, -1.0);
+    direction = glm::normalize(direction);
+    glm::vec3 up(0.0, 1.0, 0.0);
+    float fov = 0.9f;
+    int32_t samples = 16;
+    int32_t max_depth = 8;
+    float focal_distance = 9.0f;
+    float defocus_angle = 0.0f;
+
+    perspectiveCamera.setCamera(
+        center,
+        direction,
+        up,
+        height,
+        width,
+        fov,
+        focal_distance,
+        defocus_angle,
+        samples,
+        max_depth
+    );
+
+    // World
+    std::shared_ptr<Material> material_ground = std::make_shared<Lambertian>(glm::vec3(0.6, 0.6, 0.6));
+    Sphere sphere_ground(glm::vec3(0.0, -1000.0, 0.0), 1000.0, material_ground);
+    world.add(sphere_ground);
+
+    std::shared_ptr<Material> material_red = std::make_shared<Lambertian>(glm::vec3(0.7, 0.2, 0.2));
+    std::shared_ptr<Material> material_white = std::make_shared<Lambertian>(glm::vec3(0.8, 0.8, 0.8));
+    std::shared_ptr<Material> material_blue = std::make_shared<Lambertian>(glm::vec3(0.2, 0.3, 0.7));
+    Sphere sphere1(glm::vec3(-2.5, 1.0, 0.0), 1.0, material_red);
+    Sphere sphere2(glm::vec3(0.0, 1.0, 0.0), 1.0, material_white);
+    Sphere sphere3(glm::vec3(2.5, 1.0, 0.0), 1.0, material_blue);
+    world.add(sphere1);
+    world.add(sphere2);
+    world.add(sphere3);
+
+    // 16 x 16 small bulbs above the floor, colours and heights from a fixed hash
+    for (int32_t i = 0; i < 16; ++i) {
+        for (int32_t j = 0; j < 16; ++j) {
+            uint32_t hash = hash_uint(static_cast<uint32_t>(i * 16 + j + 1));
+            glm::vec3 emit(
+                static_cast<float>(hash & 0xffu) / 255.0f,
+                static_cast<float>((hash >> 8) & 0xffu) / 255.0f,
+                static_cast<float>((hash >> 16) & 0xffu) / 255.0f
+            );
+            std::shared_ptr<Material> material_bulb = std::make_shared<DiffuseLight>(emit * 40.0f);
+            float y = 0.3f + 2.5f * static_cast<float>(hash >> 24) / 255.0f;
+            Sphere bulb(glm::vec3(-7.5f + static_cast<float>(i), y, -9.0f + 0.75f * static_cast<float>(j)), 0.05f, material_bulb);
+            world.add(bulb);
+        }
+    }
+
+    // a ring of downward facing panels, two triangles each
+    std::shared_ptr<Material> material_panel = std::make_shared<DiffuseLight>(glm::vec3(3.0, 2.7, 2.2));
+    for (int32_t k = 0; k < 24; ++k) {
+        float angle = 2.0f * std::numbers::pi_v<float> * static_cast<float>(k) / 24.0f;
+        glm::vec3 c(6.0f * std::cos(angle), 4.0f, -3.0f + 6.0f * std::sin(angle));
+        glm::vec3 a(0.15, 0.0, 0.0), b(0.0, 0.0, 0.15);
+        Triangle panel1(c - a - b, c - a + b, c + a + b, material_panel);
+        Triangle panel2(c - a - b, c + a + b, c + a - b, material_panel);
+        world.add(panel1);
+        world.add(panel2);
+    }
+}
+
+// camera and light shared by the single mesh scenes, returns the material for the mesh
+inline std::shared_ptr<Material> mesh_stage(World &world, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width) {
+    // Camera
+    glm::vec3 center(0.0, 0.0, 5.0);
+    glm::vec3 direction(0.0, 0.0, -1.0);
+    glm::vec3 up(0.0, 1.0, 0.0);
+    float fov = 0.7f;
+    int32_t samples = 16;
+    int32_t max_depth = 8;
+    float focal_distance = 5.0f;
+    float defocus_angle = 0.0f;
+
+    perspectiveCamera.setCamera(
+        center,
+        direction,
+        up,
+        height,
+        width,
+        fov,
+        focal_distance,
+        defocus_angle,
+        samples,
+        max_depth
+    );
+
+    // World
+    std::shared_ptr<Material> material_mesh = std::make_shared<Lambertian>(glm::vec3(0.7, 0.7, 0.7));
+    std::shared_ptr<Material> material_light = std::make_shared<DiffuseLight>(glm::vec3(4.0, 4.0, 4.0));
+
+    Sphere light(glm::vec3(0.0, 6.0, 3.0), 2.0, material_light);
+    world.add(light);
+
+    return material_mesh;
+}
+
+struct MeshScene {
+    std::string name;
+    std::string filename;
+    glm::vec3 translate;
+    glm::vec3 scale;
+};
+
+// the single mesh scenes, used to benchmark triangle-heavy traversal
+inline const std::vector<MeshScene> &mesh_scenes() {
+    static const std::vector<MeshScene> scenes = {
+        {"bunny", "data/bunny.obj", glm::vec3(0.0, 0.0, 0.0), glm::vec3(2.5, 2.5, 2.5)},
+        {"dragon", "data/dragon.obj", glm::vec3(0.0, 0.0, 0.0), glm::vec3(2.5, 2.5, 2.5)},
+        {"teapot", "data/teapot.obj", glm::vec3(0.0, -0.6, 0.0), glm::vec3(0.4, 0.4, 0.4)},
+        {"cow", "data/cow.obj", glm::vec3(0.0, 0.0, 0.0), glm::vec3(2.0, 2.0, 2.0)},
+    };
+    return scenes;
+}
+
+inline const MeshScene *find_mesh_scene(const std::string &name) {
+    for (const MeshScene &scene : mesh_scenes()) {
+        if (scene.name == name) {
+            return &scene;
+        }
+    }
+    return nullptr;
+}
+
+// the triangles of a mesh scene, placed as that scene places them
+inline std::vector<std::array<glm::vec3, 3>> load_mesh_scene_triangles(const MeshScene &scene) {
+    return load_obj(scene.filename, scene.translate, glm::vec3(0.0, 1.0, 0.0), 0.0f, scene.scale);
+}
+
+inline void scene_mesh(World &world, SceneLoader &loader, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width, const MeshScene &scene) {
+    std::shared_ptr<Material> material_mesh = mesh_stage(world, perspectiveCamera, height, width);
+    loader.add_object(scene.filename, scene.translate, glm::vec3(0.0, 1.0, 0.0), 0.0f, scene.scale, material_mesh);
+}
+
+// a mesh written by write_paged_mesh, read through a page cache of cache_bytes instead of loaded
+inline bool scene_paged_mesh(World &world, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width, const std::string &filename, size_t cache_bytes) {
+    std::shared_ptr<MeshFile> file = std::make_shared<MeshFile>();
+    if (!file->open(filename, cache_bytes)) {
+        return false;
+    }
+    std::shared_ptr<Material> material_mesh = mesh_stage(world, perspectiveCamera, height, width);
+    PagedMesh mesh(file, material_mesh);
+    world.add(mesh);
+    return true;
+}
+
+struct SceneOptions {
+    size_t page_cache_bytes = 256 * 1024 * 1024;   // for .pmesh scenes
+    ThreadPool *pool = nullptr;                     // for loading, a pool of its own if nullptr
+};
+
+// scenes by name, so that the benchmark, the command line and remote workers agree on what to load
+// a name ending in .pmesh loads that paged mesh file
+inline bool load_scene(const std::string &name, World &world, PerspectiveCamera &perspectiveCamera, int32_t height, int32_t width, const SceneOptions &options = SceneOptions()) {
+    RAY_TRACE_SCOPE("load scene");
+    SceneLoader loader(world, options.pool);
+    if (name == "scene1") {
+        scene1(world, perspectiveCamera, height, width);
+    } else if (name == "scene2") {
+        scene2(world, loader, perspectiveCamera, height, width);
+    } else if (name == "lights") {
+        scene_lights(world, perspectiveCamera, height, width);
+    } else if (name == "outdoor") {
+        scene_outdoor(world, loader, perspectiveCamera, height, width);
+    } else if (const MeshScene *mesh = find_mesh_scene(name)) {
+        scene_mesh(world, loader, perspectiveCamera, height, width, *mesh);
+    } else if (name.size() > 6 && name.compare(name.size() - 6, 6, ".pmesh") == 0) {
+        if (!scene_paged_mesh(world, perspectiveCamera, height, width, name, options.page_cache_bytes)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    loader.finish();
+    // once every mesh is in the world, the lights among them can be sampled
+    RAY_TRACE_SCOPE("build light bvh");
+    world.set_lights(LightBVH::build(world));
+    return true;
+}
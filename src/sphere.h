@@ -63,6 +63,24 @@ public:
         return ret;
     }
 
+    const Material* material() const override {
+        return mat.get();
+    }
+
+    void hash_geometry(GeometryHash &hash) const override {
+        hash.add(origin);
+        hash.add(radius);
+    }
+
+    void emitters(std::vector<Emitter> &out) const override {
+        Emitter emitter;
+        emitter.object = this;
+        emitter.sphere = true;
+        emitter.p0 = origin;
+        emitter.radius = radius;
+        out.push_back(emitter);
+    }
+
     AABB aabb() const override {
         glm::vec3 rvec(radius, radius, radius);
         return AABB(origin - rvec, origin + rvec);
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+
+#include <glm/glm.hpp>
+
+/*
+traversal statistics, compiled in with -DRAY_STATS (see `make stats`)
+
+every worker counts into its own thread_local TraversalStats and merges it
+into the global total once it is done, so the hot loop never touches shared memory.
+without RAY_STATS the RAY_STATS_* macros expand to nothing.
+*/
+
+enum class Termination : int32_t {
+    Escaped = 0,   // ray left the scene
+    Absorbed = 1,  // material did not scatter (lights, metal below the surface)
+    MaxDepth = 2,  // ran out of bounces
+    Count = 3
+};
+
+struct TraversalStats {
+    static constexpr int32_t max_bounces = 64;
+
+    uint64_t nodes_visited = 0;
+    uint64_t boxes_tested = 0;
+    uint64_t primitive_tests = 0;
+    uint64_t paths = 0;
+    uint64_t bounces = 0;
+    std::array<uint64_t, max_bounces + 1> bounce_histogram = {};
+    std::array<uint64_t, static_cast<int32_t>(Termination::Count)> terminations = {};
+
+    // traversal work, used as the per-pixel cost of the heatmap
+    uint64_t cost() const {
+        return nodes_visited + primitive_tests;
+    }
+
+    void end_path(int32_t bounce_count, Termination reason) {
+        ++paths;
+        bounces += bounce_count;
+        ++bounce_histogram[std::min(bounce_count, max_bounces)];
+        ++terminations[static_cast<int32_t>(reason)];
+    }
+
+    void merge(const TraversalStats &other) {
+        nodes_visited += other.nodes_visited;
+        boxes_tested += other.boxes_tested;
+        primitive_tests += other.primitive_tests;
+        paths += other.paths;
+        bounces += other.bounces;
+        for (int32_t i = 0; i <= max_bounces; ++i) {
+            bounce_histogram[i] += other.bounce_histogram[i];
+        }
+        for (size_t i = 0; i < terminations.size(); ++i) {
+            terminations[i] += other.terminations[i];
+        }
+    }
+
+    void print(std::ostream &os) const {
+        double per_path = paths > 0 ? 1.0 / static_cast<double>(paths) : 0.0;
+        os << "paths:            " << paths << std::endl;
+        os << "nodes visited:    " << nodes_visited << " (" << static_cast<double>(nodes_visited) * per_path << " per path)" << std::endl;
+        os << "boxes tested:     " << boxes_tested << " (" << static_cast<double>(boxes_tested) * per_path << " per path)" << std::endl;
+        os << "primitive tests:  " << primitive_tests << " (" << static_cast<double>(primitive_tests) * per_path << " per path)" << std::endl;
+        os << "bounces per path: " << static_cast<double>(bounces) * per_path << std::endl;
+        os << "terminations:     escaped " << terminations[static_cast<int32_t>(Termination::Escaped)]
+           << ", absorbed " << terminations[static_cast<int32_t>(Termination::Absorbed)]
+           << ", max depth " << terminations[static_cast<int32_t>(Termination::MaxDepth)] << std::endl;
+        os << "bounce histogram:";
+        for (int32_t i = 0; i <= max_bounces; ++i) {
+            if (bounce_histogram[i] > 0) {
+                os << " " << i << ":" << bounce_histogram[i];
+            }
+        }
+        os << std::endl;
+    }
+};
+
+inline TraversalStats &thread_stats() {
+    thread_local TraversalStats stats;
+    return stats;
+}
+
+class GlobalStats {
+    std::mutex mutex;
+    TraversalStats total;
+
+public:
+    static GlobalStats &instance() {
+        static GlobalStats stats;
+        return stats;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        total = TraversalStats();
+    }
+
+    // moves the calling thread's counters into the global total
+    void merge_thread() {
+        std::lock_guard<std::mutex> lock(mutex);
+        total.merge(thread_stats());
+        thread_stats() = TraversalStats();
+    }
+
+    TraversalStats get() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total;
+    }
+};
+
+// false colour ramp for the cost heatmap: black -> blue -> cyan -> green -> yellow -> red
+inline glm::vec3 heatmap_color(float t) {
+    static const glm::vec3 ramp[] = {
+        glm::vec3(0.0, 0.0, 0.0),
+        glm::vec3(0.0, 0.0, 1.0),
+        glm::vec3(0.0, 1.0, 1.0),
+        glm::vec3(0.0, 1.0, 0.0),
+        glm::vec3(1.0, 1.0, 0.0),
+        glm::vec3(1.0, 0.0, 0.0),
+    };
+    constexpr int32_t n = sizeof(ramp) / sizeof(ramp[0]) - 1;
+
+    t = std::clamp(t, 0.0f, 1.0f) * static_cast<float>(n);
+    int32_t i = std::min(static_cast<int32_t>(t), n - 1);
+    float f = t - static_cast<float>(i);
+    return ramp[i] * (1.0f - f) + ramp[i + 1] * f;
+}
+
+#ifdef RAY_STATS
+constexpr bool ray_stats_enabled = true;
+#define RAY_STATS_ADD(field, n) (thread_stats().field += (n))
+#define RAY_STATS_END_PATH(bounce_count, reason) (thread_stats().end_path((bounce_count), (reason)))
+#else
+constexpr bool ray_stats_enabled = false;
+#define RAY_STATS_ADD(field, n) ((void)0)
+#define RAY_STATS_END_PATH(bounce_count, reason) ((void)0)
+#endif
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+live render progress
+
+workers publish their running totals into their own cache line with relaxed stores,
+a separate reporter thread samples all slots every `interval` seconds and prints
+completion, throughput and eta to the terminal and/or rewrites a json stats file.
+*/
+
+struct TelemetryConfig {
+    double interval = 0.5;          // seconds between reports, at least 0.05
+    bool terminal = true;           // progress line on std::clog
+    std::string stats_filename;     // json snapshot, rewritten atomically every report, empty to disable
+};
+
+class Telemetry {
+    struct alignas(64) WorkerSlot {
+        std::atomic<uint64_t> pixels{0};
+        std::atomic<uint64_t> samples{0};
+        std::atomic<uint64_t> rays{0};
+    };
+
+    struct Snapshot {
+        uint64_t pixels = 0;
+        uint64_t samples = 0;
+        uint64_t rays = 0;
+        double elapsed = 0.0;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr double min_interval = 0.05;
+
+    TelemetryConfig config;
+    uint64_t total_pixels;
+    std::unique_ptr<WorkerSlot[]> slots;
+    int32_t num_workers;
+
+    Clock::time_point start_time;
+    Snapshot last;
+
+    std::thread reporter;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+
+public:
+    Telemetry(const TelemetryConfig &config, int32_t num_workers, uint64_t total_pixels)
+        : config(config), total_pixels(total_pixels), slots(new WorkerSlot[num_workers]), num_workers(num_workers) {}
+
+    ~Telemetry() {
+        stop();
+    }
+
+    void start() {
+        start_time = Clock::now();
+        last = Snapshot();
+        stopping = false;
+        reporter = std::thread(&Telemetry::report_loop, this);
+    }
+
+    // final report, then joins the reporter
+    void stop() {
+        if (!reporter.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        reporter.join();
+    }
+
+    // called by worker `worker_id` only, with its running totals
+    void update(int32_t worker_id, uint64_t pixels, uint64_t samples, uint64_t rays) {
+        WorkerSlot &slot = slots[worker_id];
+        slot.pixels.store(pixels, std::memory_order_relaxed);
+        slot.samples.store(samples, std::memory_order_relaxed);
+        slot.rays.store(rays, std::memory_order_relaxed);
+    }
+
+private:
+    Snapshot sample() const {
+        Snapshot s;
+        for (int32_t i = 0; i < num_workers; ++i) {
+            s.pixels += slots[i].pixels.load(std::memory_order_relaxed);
+            s.samples += slots[i].samples.load(std::memory_order_relaxed);
+            s.rays += slots[i].rays.load(std::memory_order_relaxed);
+        }
+        s.elapsed = std::chrono::duration<double>(Clock::now() - start_time).count();
+        return s;
+    }
+
+    void report_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        // an interval of 0 would spin the reporter against the workers
+        auto interval = std::chrono::duration<double>(std::max(config.interval, min_interval));
+
+        while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+            report(false);
+        }
+        // even if stop() came before the first wait, so the last line and the final json are written
+        report(true);
+    }
+
+    void report(bool final) {
+        Snapshot now = sample();
+
+        double dt = now.elapsed - last.elapsed;
+        double samples_per_s = dt > 0.0 ? static_cast<double>(now.samples - last.samples) / dt : 0.0;
+        double rays_per_s = dt > 0.0 ? static_cast<double>(now.rays - last.rays) / dt : 0.0;
+
+        double completion = total_pixels > 0 ? static_cast<double>(now.pixels) / static_cast<double>(total_pixels) : 1.0;
+        // eta from the average rate so far, the per-interval rate is too noisy
+        double eta = now.pixels > 0 ? now.elapsed * static_cast<double>(total_pixels - now.pixels) / static_cast<double>(now.pixels) : -1.0;
+
+        if (final) {
+            samples_per_s = now.elapsed > 0.0 ? static_cast<double>(now.samples) / now.elapsed : 0.0;
+            rays_per_s = now.elapsed > 0.0 ? static_cast<double>(now.rays) / now.elapsed : 0.0;
+            eta = 0.0;
+        }
+
+        if (config.terminal) {
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(1)
+               << "\r[" << std::setw(5) << completion * 100.0 << "%] "
+               << std::setprecision(2) << samples_per_s / 1e6 << " Msamples/s, "
+               << rays_per_s / 1e6 << " Mrays/s, "
+               << "elapsed " << format_time(now.elapsed) << ", eta " << format_time(eta) << "   ";
+            if (final) {
+                ss << std::endl;
+            }
+            std::clog << ss.str() << std::flush;
+        }
+
+        if (!config.stats_filename.empty()) {
+            write_stats(now, completion, samples_per_s, rays_per_s, eta, final);
+        }
+
+        last = now;
+    }
+
+    void write_stats(const Snapshot &now, double completion, double samples_per_s, double rays_per_s, double eta, bool final) const {
+        // write then rename, so pollers never see a half written file
+        std::string tmp_filename = config.stats_filename + ".tmp";
+        {
+            std::ofstream ofs(tmp_filename);
+            ofs << std::setprecision(6)
+                << "{\"state\": \"" << (final ? "done" : "rendering") << "\""
+                << ", \"completion\": " << completion
+                << ", \"pixels\": " << now.pixels
+                << ", \"total_pixels\": " << total_pixels
+                << ", \"samples\": " << now.samples
+                << ", \"rays\": " << now.rays
+                << ", \"samples_per_s\": " << samples_per_s
+                << ", \"rays_per_s\": " << rays_per_s
+                << ", \"elapsed_s\": " << now.elapsed
+                << ", \"eta_s\": " << eta
+                << ", \"workers\": " << num_workers
+                << "}" << std::endl;
+        }
+        std::rename(tmp_filename.c_str(), config.stats_filename.c_str());
+    }
+
+    static std::string format_time(double seconds) {
+        if (seconds < 0.0) {
+            return "--:--:--";
+        }
+        int64_t s = static_cast<int64_t>(seconds + 0.5);
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%02lld:%02lld:%02lld",
+            static_cast<long long>(s / 3600), static_cast<long long>(s / 60 % 60), static_cast<long long>(s % 60));
+        return buffer;
+    }
+};
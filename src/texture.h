@@ -51,6 +51,13 @@ class ImageTexture : public Texture {
 
 public:
     ImageTexture(const std::string &filename) {
+        load(filename);
+    }
+
+    // empty until load(), so decoding can happen after materials took the texture
+    ImageTexture() : height(0), width(0) {}
+
+    void load(const std::string &filename) {
         uint32_t error = lodepng::decode(image, width, height, filename);
         if (error) {
             std::cout << "decoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
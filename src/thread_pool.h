@@ -0,0 +1,179 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <latch>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <trace.h>
+
+/*
+fixed set of worker threads that live as long as the pool, so batch renders do not pay
+thread startup per frame. run() must not be called from inside one of the pool's tasks.
+*/
+class ThreadPool {
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+
+public:
+    explicit ThreadPool(int32_t num_threads) {
+        for (int32_t i = 0; i < num_threads; ++i) {
+            threads.emplace_back(&ThreadPool::loop, this, i);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int32_t size() const {
+        return static_cast<int32_t>(threads.size());
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    // runs f(worker_id) for every worker_id in [0, n) and waits for all of them
+    void run(int32_t n, const std::function<void(int32_t)> &f) {
+        std::latch remaining(n);
+        for (int32_t worker_id = 0; worker_id < n; ++worker_id) {
+            submit([&f, &remaining, worker_id]() {
+                f(worker_id);
+                remaining.count_down();
+            });
+        }
+        remaining.wait();
+    }
+
+private:
+    void loop(int32_t index) {
+        RAY_TRACE_THREAD_NAME("pool " + std::to_string(index));
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+// f(worker_id) for worker_id in [0, n) on the pool if there is one, on fresh threads otherwise
+inline void run_workers(ThreadPool *pool, int32_t n, const std::function<void(int32_t)> &f) {
+    if (pool != nullptr) {
+        pool->run(n, f);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (int32_t worker_id = 0; worker_id < n; ++worker_id) {
+        threads.emplace_back(f, worker_id);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+/*
+tasks with dependencies between them. run() submits a task to the pool as soon as every task
+it depends on has finished, so independent tasks overlap and each one starts as early as its
+inputs allow. tasks are added before run(), and must not call ThreadPool::run themselves.
+*/
+class TaskGraph {
+    struct Task {
+        std::function<void()> f;
+        std::vector<int32_t> dependents;
+        int32_t unfinished_dependencies = 0;
+    };
+
+    std::vector<Task> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t unfinished = 0;
+
+public:
+    // returns the task's id, which later tasks can depend on
+    int32_t add(std::function<void()> f, const std::vector<int32_t> &dependencies = {}) {
+        int32_t id = static_cast<int32_t>(tasks.size());
+        tasks.push_back(Task{std::move(f), {}, static_cast<int32_t>(dependencies.size())});
+        for (int32_t dependency : dependencies) {
+            tasks[dependency].dependents.push_back(id);
+        }
+        return id;
+    }
+
+    size_t size() const {
+        return tasks.size();
+    }
+
+    // runs every task and returns once all of them finished
+    void run(ThreadPool &pool) {
+        unfinished = tasks.size();
+        // collected first, tasks finishing meanwhile make their dependents ready themselves
+        std::vector<int32_t> roots;
+        for (int32_t id = 0; id < static_cast<int32_t>(tasks.size()); ++id) {
+            if (tasks[id].unfinished_dependencies == 0) {
+                roots.push_back(id);
+            }
+        }
+        for (int32_t id : roots) {
+            submit(pool, id);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return unfinished == 0; });
+    }
+
+private:
+    void submit(ThreadPool &pool, int32_t id) {
+        pool.submit([this, &pool, id]() {
+            tasks[id].f();
+
+            std::vector<int32_t> ready;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (int32_t dependent : tasks[id].dependents) {
+                    if (--tasks[dependent].unfinished_dependencies == 0) {
+                        ready.push_back(dependent);
+                    }
+                }
+            }
+            for (int32_t dependent : ready) {
+                submit(pool, dependent);
+            }
+
+            // notified under the lock, run() may return and destroy the graph right after
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--unfinished == 0) {
+                cv.notify_all();
+            }
+        });
+    }
+};
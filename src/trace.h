@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+phase timing, compiled in with -DRAY_TRACE (see `make trace`)
+
+RAY_TRACE_SCOPE("name") times the rest of the enclosing scope: loading, BVH builds, every
+worker's share of a render, post-processing and encoding. each thread appends its finished
+scopes to its own ring buffer, so timing never takes a lock, and a thread that records more
+than the buffer holds keeps only its latest events. --trace file writes them all as Chrome
+trace events, which chrome://tracing and https://ui.perfetto.dev show as one timeline row per
+thread: serial sections, idle workers and uneven shares are visible at a glance.
+
+without RAY_TRACE the RAY_TRACE_* macros expand to nothing.
+*/
+
+struct TraceEvent {
+    const char *name;       // a string literal, only the pointer is kept
+    const char *arg_name;   // nullptr without an argument
+    int64_t arg;
+    uint64_t begin_ns, end_ns;
+};
+
+class TraceBuffer {
+public:
+    static constexpr size_t capacity = 1 << 14;
+
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(capacity);
+    std::atomic<uint64_t> written = 0;
+    uint32_t tid = 0;
+    std::string thread_name; // guarded by the recorder's mutex
+
+    // only the owning thread pushes
+    void push(const TraceEvent &event) {
+        uint64_t n = written.load(std::memory_order_relaxed);
+        events[n % capacity] = event;
+        written.store(n + 1, std::memory_order_release);
+    }
+};
+
+class TraceRecorder {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<TraceBuffer>> buffers; // outlive their threads, until export
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+public:
+    static TraceRecorder &instance() {
+        static TraceRecorder recorder;
+        return recorder;
+    }
+
+    uint64_t now_ns() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+    }
+
+    TraceBuffer &thread_buffer() {
+        thread_local std::shared_ptr<TraceBuffer> buffer = register_thread();
+        return *buffer;
+    }
+
+    // the calling thread's row title in the viewer
+    void name_thread(const std::string &name) {
+        TraceBuffer &buffer = thread_buffer();
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer.thread_name = name;
+    }
+
+    /*
+    writes every recorded event in the trace event format,
+    https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+    threads should be done recording, an event pushed meanwhile may come out torn
+    */
+    bool write_chrome_trace(const std::string &filename) {
+        std::ofstream ofs(filename);
+        if (!ofs) {
+            std::cout << "trace: cannot write " << filename << std::endl;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = 0;
+        uint64_t dropped = 0;
+        bool first = true;
+        auto separator = [&]() -> std::ostream& {
+            ofs << (first ? "\n" : ",\n");
+            first = false;
+            return ofs;
+        };
+
+        ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (const std::shared_ptr<TraceBuffer> &buffer : buffers) {
+            std::string name = buffer->thread_name.empty() ? "thread " + std::to_string(buffer->tid) : buffer->thread_name;
+            separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                        << ",\"args\":{\"name\":\"" << name << "\"}}";
+            separator() << "{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                        << ",\"args\":{\"sort_index\":" << buffer->tid << "}}";
+
+            uint64_t written = buffer->written.load(std::memory_order_acquire);
+            uint64_t begin = written > TraceBuffer::capacity ? written - TraceBuffer::capacity : 0;
+            dropped += begin;
+            for (uint64_t i = begin; i < written; ++i) {
+                const TraceEvent &event = buffer->events[i % TraceBuffer::capacity];
+                // complete events, timestamps in microseconds
+                separator() << std::fixed << std::setprecision(3)
+                            << "{\"name\":\"" << event.name << "\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                            << ",\"ts\":" << static_cast<double>(event.begin_ns) / 1e3
+                            << ",\"dur\":" << static_cast<double>(event.end_ns - event.begin_ns) / 1e3;
+                if (event.arg_name != nullptr) {
+                    ofs << ",\"args\":{\"" << event.arg_name << "\":" << event.arg << "}";
+                }
+                ofs << "}";
+                ++count;
+            }
+        }
+        ofs << "\n]}\n";
+
+        std::clog << "trace: " << count << " events from " << buffers.size() << " threads -> " << filename;
+        if (dropped > 0) {
+            std::clog << " (" << dropped << " oldest overwritten)";
+        }
+        std::clog << std::endl;
+        return static_cast<bool>(ofs);
+    }
+
+private:
+    std::shared_ptr<TraceBuffer> register_thread() {
+        std::shared_ptr<TraceBuffer> buffer = std::make_shared<TraceBuffer>();
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer->tid = static_cast<uint32_t>(buffers.size());
+        buffers.push_back(buffer);
+        return buffer;
+    }
+};
+
+// times its own lifetime
+class ScopedTimer {
+    const char *name;
+    const char *arg_name;
+    int64_t arg;
+    uint64_t begin;
+
+public:
+    ScopedTimer(const char *name, const char *arg_name = nullptr, int64_t arg = 0) :
+        name(name), arg_name(arg_name), arg(arg), begin(TraceRecorder::instance().now_ns()) {}
+
+    ~ScopedTimer() {
+        TraceRecorder &recorder = TraceRecorder::instance();
+        recorder.thread_buffer().push(TraceEvent{name, arg_name, arg, begin, recorder.now_ns()});
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+// writes the trace when it goes out of scope, if a file was asked for
+class TraceExport {
+    std::string filename;
+
+public:
+    explicit TraceExport(const std::string &filename) : filename(filename) {}
+
+    ~TraceExport() {
+        if (!filename.empty()) {
+            TraceRecorder::instance().write_chrome_trace(filename);
+        }
+    }
+
+    TraceExport(const TraceExport&) = delete;
+    TraceExport& operator=(const TraceExport&) = delete;
+};
+
+#define RAY_TRACE_CONCAT_(a, b) a##b
+#define RAY_TRACE_CONCAT(a, b) RAY_TRACE_CONCAT_(a, b)
+
+#ifdef RAY_TRACE
+constexpr bool ray_trace_enabled = true;
+#define RAY_TRACE_SCOPE(name) ScopedTimer RAY_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define RAY_TRACE_SCOPE_ARG(name, arg_name, arg) ScopedTimer RAY_TRACE_CONCAT(trace_scope_, __LINE__)((name), (arg_name), static_cast<int64_t>(arg))
+#define RAY_TRACE_THREAD_NAME(name) (TraceRecorder::instance().name_thread(name))
+#else
+constexpr bool ray_trace_enabled = false;
+#define RAY_TRACE_SCOPE(name) ((void)0)
+#define RAY_TRACE_SCOPE_ARG(name, arg_name, arg) ((void)0)
+#define RAY_TRACE_THREAD_NAME(name) ((void)0)
+#endif
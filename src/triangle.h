@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <limits>
 #include <numbers>
 
 #include <glm/glm.hpp>
@@ -23,6 +24,67 @@ counter-clockwise, 1->2->3
 
 
 // P = v1 + (v2 - v1) * u + (v3 - v1) * v
+// Möller–Trumbore, shared by Triangle and the triangles of paged meshes
+inline BVHHit intersect_triangle(const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec3 &v3, const Ray &r, float tmin, float tmax) {
+    BVHHit ret;
+    ret.is_hit = false;
+
+    glm::vec3 edge1 = v2 - v1;
+    glm::vec3 edge2 = v3 - v1;
+    glm::vec3 ray_cross_edge2 = glm::cross(r.direction, edge2);
+    float det = glm::dot(edge1, ray_cross_edge2);
+
+    // the ray is parallel to the triangle.
+    if (std::abs(det) <= std::numeric_limits<float>::epsilon()) {
+        return ret;
+    }
+
+    float inv_det = 1.0f / det;
+    glm::vec3 s = r.origin - v1;
+    float u = inv_det * glm::dot(s, ray_cross_edge2);
+
+    // the intersection is outside of the triangle.
+    if (u < 0.0f || u > 1.0f) {
+        return ret;
+    }
+
+    glm::vec3 q = glm::cross(s, edge1);
+    float v = inv_det * glm::dot(r.direction, q);
+
+    // the intersection is outside of the triangle.
+    if (v < 0.0f || u + v > 1.0f) {
+        return ret;
+    }
+
+    float t = inv_det * glm::dot(edge2, q);
+
+    // the intersection is outside the valid t range.
+    if (t < tmin || t > tmax) {
+        return ret;
+    }
+
+    ret.is_hit = true;
+    ret.t = t;
+    ret.u = u;
+    ret.v = v;
+
+    return ret;
+}
+
+inline ColorHit shade_triangle(const glm::vec3 &normal, const BVHHit &bvhhit, const Ray &r, const std::shared_ptr<Material> &mat) {
+    ColorHit ret;
+    ret.point = r.at(bvhhit.t);
+    ret.direction = random_hemisphere(ret.normal);
+    ret.is_front = glm::dot(r.direction, normal) < 0.0f;
+    ret.normal = ret.is_front ? normal : -normal;
+    ret.mat = mat;
+
+    ret.u = bvhhit.u;
+    ret.v = bvhhit.v;
+
+    return ret;
+}
+
 class Triangle : public Object {
     glm::vec3 v1, v2, v3;
     glm::vec3 normal;
@@ -36,71 +98,69 @@ public:
     }
 
     ColorHit hit(const BVHHit &bvhhit, const Ray &r, float tmin, float tmax) const override {
-        ColorHit ret;
-        ret.point = r.at(bvhhit.t);
-        ret.direction = random_hemisphere(ret.normal);
-        ret.is_front = glm::dot(r.direction, normal) < 0.0f;
-        ret.normal = ret.is_front ? normal : -normal;
-        ret.mat = mat;
-
-        glm::vec3 edge1 = v2 - v1;
-        glm::vec3 edge2 = v3 - v1;
-        glm::vec3 ray_cross_edge2 = glm::cross(r.direction, edge2);
-        float det = glm::dot(edge1, ray_cross_edge2);
-        float inv_det = 1.0f / det;
-        glm::vec3 s = r.origin - v1;
-        glm::vec3 q = glm::cross(s, edge1);
-        float u = inv_det * glm::dot(s, ray_cross_edge2);
-        float v = inv_det * glm::dot(r.direction, q);
-
-        ret.u = u;
-        ret.v = v;
-
-        return ret;
+        return shade_triangle(normal, bvhhit, r, mat);
     }
 
     BVHHit bvh_hit(const Ray &r, float tmin, float tmax) const override {
-        BVHHit ret;
-        ret.is_hit = false;
-
-        glm::vec3 edge1 = v2 - v1;
-        glm::vec3 edge2 = v3 - v1;
-        glm::vec3 ray_cross_edge2 = glm::cross(r.direction, edge2);
-        float det = glm::dot(edge1, ray_cross_edge2);
-
-        // the ray is parallel to the triangle.
-        if (std::abs(det) <= std::numeric_limits<float>::epsilon()) {
-            return ret;
-        }
-
-        float inv_det = 1.0f / det;
-        glm::vec3 s = r.origin - v1;
-        float u = inv_det * glm::dot(s, ray_cross_edge2);
-
-        // the intersection is outside of the triangle.
-        if (u < 0.0f || u > 1.0f) {
-            return ret;
-        }
+        return intersect_triangle(v1, v2, v3, r, tmin, tmax);
+    }
 
-        glm::vec3 q = glm::cross(s, edge1);
-        float v = inv_det * glm::dot(r.direction, q);
+    const Material* material() const override {
+        return mat.get();
+    }
 
-        // the intersection is outside of the triangle.
-        if (v < 0.0f || u + v > 1.0f) {
-            return ret;
-        }
+    void hash_geometry(GeometryHash &hash) const override {
+        hash.add(v1);
+        hash.add(v2);
+        hash.add(v3);
+    }
 
-        float t = inv_det * glm::dot(edge2, q);
+    void emitters(std::vector<Emitter> &out) const override {
+        Emitter emitter;
+        emitter.object = this;
+        emitter.p0 = v1;
+        emitter.p1 = v2;
+        emitter.p2 = v3;
+        out.push_back(emitter);
+    }
 
-        // the intersection is outside the valid t range.
-        if (t < tmin || t > tmax) {
-            return ret;
+    // clips the triangle itself, tighter than cutting its box
+    void split_aabb(int32_t axis, float position, AABB &left, AABB &right) const override {
+        constexpr float inf = std::numeric_limits<float>::infinity();
+        glm::vec3 left_min(inf, inf, inf), left_max(-inf, -inf, -inf);
+        glm::vec3 right_min(inf, inf, inf), right_max(-inf, -inf, -inf);
+
+        const glm::vec3 *vertices[3] = {&v1, &v2, &v3};
+        for (int32_t i = 0; i < 3; ++i) {
+            const glm::vec3 &a = *vertices[i];
+            const glm::vec3 &b = *vertices[(i + 1) % 3];
+
+            if (a[axis] <= position) {
+                left_min = glm::min(left_min, a);
+                left_max = glm::max(left_max, a);
+            }
+            if (a[axis] >= position) {
+                right_min = glm::min(right_min, a);
+                right_max = glm::max(right_max, a);
+            }
+
+            // the edge crosses the plane
+            if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position)) {
+                float t = (position - a[axis]) / (b[axis] - a[axis]);
+                glm::vec3 p = a + (b - a) * t;
+                p[axis] = position;
+                left_min = glm::min(left_min, p);
+                left_max = glm::max(left_max, p);
+                right_min = glm::min(right_min, p);
+                right_max = glm::max(right_max, p);
+            }
         }
 
-        ret.is_hit = true;
-        ret.t = t;
-
-        return ret;
+        // a side without any part stays empty (min above max), the builder drops it
+        left.box_aa = left_min;
+        left.box_bb = left_max;
+        right.box_aa = right_min;
+        right.box_bb = right_max;
     }
 
     AABB aabb() const override {